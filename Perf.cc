@@ -223,6 +223,170 @@ double lltostr() {
     return Cycles::toSeconds(stop - start)/count;
 }
 
+// Integer and score replies as they come back from INCR, ZSCORE and friends.
+static std::vector<std::string> sampleNumbers(bool scores) {
+    std::vector<std::string> numbers;
+    srand(1);
+    for (int i = 0; i < 1000; i++) {
+        char buf[40];
+        if (scores)
+            snprintf(buf, sizeof(buf), "%.*f", i % 4, (rand() % 2000000 - 1000000) / 997.0);
+        else
+            snprintf(buf, sizeof(buf), "%lld", (long long) rand() * (i % 3 == 0 ? 1000003 : 1));
+        numbers.push_back(buf);
+    }
+    return numbers;
+}
+
+double parseIntLexicalCast() {
+    std::vector<std::string> numbers = sampleNumbers(false);
+    int count = 1000;
+    long long sum = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (const std::string& number : numbers)
+            sum += boost::lexical_cast<long long>(number);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&sum);
+    return Cycles::toSeconds(stop - start)/(count * numbers.size());
+}
+
+double parseIntNumber() {
+    std::vector<std::string> numbers = sampleNumbers(false);
+    for (const std::string& number : numbers) {
+        long long value = 0;
+        if (!parse_number(number.data(), number.data() + number.size(), value)
+                || value != strtoll(number.c_str(), NULL, 10)) {
+            printf("parse_number mismatch for %s\n", number.c_str());
+            break;
+        }
+    }
+    int count = 1000;
+    long long sum = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (const std::string& number : numbers) {
+            long long value = 0;
+            if (parse_number(number.data(), number.data() + number.size(), value))
+                sum += value;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&sum);
+    return Cycles::toSeconds(stop - start)/(count * numbers.size());
+}
+
+double parseDoubleLexicalCast() {
+    std::vector<std::string> numbers = sampleNumbers(true);
+    int count = 1000;
+    double sum = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (const std::string& number : numbers)
+            sum += boost::lexical_cast<double>(number);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&sum);
+    return Cycles::toSeconds(stop - start)/(count * numbers.size());
+}
+
+double parseDoubleNumber() {
+    // Results must match strtod() bit for bit, including the slow path.
+    std::vector<std::string> numbers = sampleNumbers(true);
+    std::vector<std::string> checked = numbers;
+    const char* extra[] = {"2.7189999999999999", "3.1410000000000000", "1e22",
+                           "1e23", "-0", "inf", "-inf", "9007199254740993",
+                           "0.1e-5", "123456789012345678901234567890"};
+    for (const char* number : extra)
+        checked.push_back(number);
+    for (const std::string& number : checked) {
+        double value = 0;
+        double expected = strtod(number.c_str(), NULL);
+        if (!parse_number(number.data(), number.data() + number.size(), value)
+                || memcmp(&value, &expected, sizeof(value)) != 0) {
+            printf("parse_number mismatch for %s\n", number.c_str());
+            break;
+        }
+    }
+    int count = 1000;
+    double sum = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (const std::string& number : numbers) {
+            double value;
+            parse_number(number.data(), number.data() + number.size(), value);
+            sum += value;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&sum);
+    return Cycles::toSeconds(stop - start)/(count * numbers.size());
+}
+
+// Scores as a leaderboard would send them with ZADD and ZINCRBY.
+static std::vector<double> sampleScores() {
+    std::vector<double> scores;
+    srand(1);
+    for (int i = 0; i < 1000; i++)
+        scores.push_back((rand() % 2000000 - 1000000) / (i % 2 ? 997.0 : 100.0));
+    return scores;
+}
+
+double formatDoubleLexicalCast() {
+    std::vector<double> scores = sampleScores();
+    int count = 1000;
+    size_t size = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (double score : scores)
+            size += boost::lexical_cast<std::string>(score).size();
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+    return Cycles::toSeconds(stop - start)/(count * scores.size());
+}
+
+double formatDoubleSprintf() {
+    std::vector<double> scores = sampleScores();
+    int count = 1000;
+    size_t size = 0;
+    char buf[32];
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (double score : scores)
+            size += snprintf(buf, sizeof(buf), "%.17g", score);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+    return Cycles::toSeconds(stop - start)/(count * scores.size());
+}
+
+double formatDoubleShortest() {
+    // Every score must read back as itself.
+    std::vector<double> scores = sampleScores();
+    char buf[32];
+    for (double score : scores) {
+        double back;
+        char* end = format_number(buf, score);
+        if (!parse_number(buf, end, back) || back != score) {
+            *end = 0;
+            printf("format_number does not round-trip: %.17g -> %s\n", score, buf);
+            break;
+        }
+    }
+    int count = 1000;
+    size_t size = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (double score : scores)
+            size += format_number(buf, score) - buf;
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+    return Cycles::toSeconds(stop - start)/(count * scores.size());
+}
+
 double requestConst() {
     int count = 1000000;
     uint64_t start = Cycles::rdtsc();
@@ -241,34 +405,120 @@ double requestConst() {
     return Cycles::toSeconds(stop - start)/count;
 }
 
-double requestConstFastcmd() {
+double requestEncoder() {
     int count = 1000000;
+    std::string key = "628282xxxxxxxxxxxxxxxxxxxxxxxx";
+    std::string value = "7SaDL5M5gm9MnLNpWUqdlU0LMlLvyZ5cUFBEdwm5RbwvqXBEOyCD7Q5p9e229ro3bfzEulm6kwkr3HhwWTqWrY0P2D7FnIwwDN0y";
+    uint64_t clientId = 581405568;
+    uint64_t lastRequestId = 99997;
+    // One encoder for all requests, as base_client keeps one per client.
+    cmd_encoder request;
+    size_t size = 0;
     uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        request.begin("SET", 3) << key << value;
+        request.append_id(clientId).append_id(++lastRequestId);
+        size += request.size();
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+// Same as requestEncoder, with the framing of SET taken from its
+// compile-time command_spec.
+double requestEncoderSpec() {
+    int count = 1000000;
     std::string key = "628282xxxxxxxxxxxxxxxxxxxxxxxx";
     std::string value = "7SaDL5M5gm9MnLNpWUqdlU0LMlLvyZ5cUFBEdwm5RbwvqXBEOyCD7Q5p9e229ro3bfzEulm6kwkr3HhwWTqWrY0P2D7FnIwwDN0y";
     uint64_t clientId = 581405568;
     uint64_t lastRequestId = 99997;
-    char strbuf[1000];
-    char* str;
+    cmd_encoder request;
+    size_t size = 0;
+    uint64_t start = Cycles::rdtsc();
     for (int i = 0; i < count; i++) {
-        fastcmd request(5, "SET");
-        request << key << value << clientId << ++lastRequestId;
-        str = request.c_str();
+        request.begin(commands::SET) << key << value;
+        request.append_id(clientId).append_id(++lastRequestId);
+        size += request.size();
     }
     uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+
+    cmd_encoder plain;
+    plain.begin("SET", 3) << key << value;
+    plain.append_id(clientId).append_id(lastRequestId);
+    if (std::string(plain.data(), plain.size())
+            != std::string(request.data(), request.size())) {
+        printf("command_spec and cmd_encoder output are different!\n%s\n\n%s",
+                plain.c_str(), request.c_str());
+    }
+    return Cycles::toSeconds(stop - start)/count;
+}
 
-    fastcmd fastreq(5, "SET");
-    fastreq << key << value << clientId << ++lastRequestId;
-    makecmd request("SET");
-    request << key << value << std::to_string(clientId) << std::to_string(lastRequestId);
-    if (strcmp(fastreq.c_str(), ((std::string)request).c_str()) != 0) {
-        printf("fastcmd and makecmd output are different!\n%s\n\n%s",
-                ((std::string)request).c_str(), fastreq.c_str());
+// GET, where the framing is most of the request.
+double requestGetName() {
+    int count = 1000000;
+    std::string key = "628282xxxxxxxxxxxxxxxxxxxxxxxx";
+    cmd_encoder request;
+    size_t size = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        request.begin("GET", 3) << key;
+        size += request.size();
     }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
+    return Cycles::toSeconds(stop - start)/count;
+}
 
+double requestGetSpec() {
+    int count = 1000000;
+    std::string key = "628282xxxxxxxxxxxxxxxxxxxxxxxx";
+    cmd_encoder request;
+    size_t size = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        request.begin(commands::GET) << key;
+        size += request.size();
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&size);
     return Cycles::toSeconds(stop - start)/count;
 }
 
+// Cost of a 2KB command buffer from buffer_pool and from the heap.
+double bufferPoolAcquire() {
+    int count = 10000000;
+    size_t total = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        size_t size = 2048;
+        char* buf = buffer_pool::acquire(size);
+        buf[0] = 'x';
+        discard(&buf);
+        total += size;
+        buffer_pool::release(buf, size);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&total);
+    return Cycles::toSeconds(stop - start)/count;
+}
+double bufferHeapAlloc() {
+    int count = 10000000;
+    size_t total = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        size_t size = 2048;
+        char* buf = new char[size];
+        buf[0] = 'x';
+        discard(&buf);
+        total += size;
+        delete[] buf;
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&total);
+    return Cycles::toSeconds(stop - start)/count;
+}
 double requestFastConst() {
     int count = 1000000;
     uint64_t start = Cycles::rdtsc();
@@ -373,6 +623,298 @@ double requestSuperFastConst() {
     return Cycles::toSeconds(stop - start)/count;
 }
 
+// A stream of replies of every type, including a nested multi bulk reply as
+// returned by EXEC and a multi bulk reply of 100 values as returned by LRANGE.
+static std::string sampleReplies() {
+    std::string value = "7SaDL5M5gm9MnLNpWUqdlU0LMlLvyZ5cUFBEdwm5RbwvqXBEOyCD7Q5p9e229ro3bfzEulm6kwkr3HhwWTqWrY0P2D7FnIwwDN0y";
+    std::string data = "+OK\r\n-ERR unknown command\r\n:-42\r\n$-1\r\n$0\r\n\r\n*-1\r\n*0\r\n";
+    data += "*3\r\n:1\r\n*2\r\n$3\r\nfoo\r\n$-1\r\n+QUEUED\r\n";
+    data += "$" + std::to_string(value.length()) + "\r\n" + value + "\r\n";
+    data += "*100\r\n";
+    for (int i = 0; i < 100; i++)
+        data += "$" + std::to_string(value.length()) + "\r\n" + value + "\r\n";
+    return data;
+}
+
+static const int sampleReplyCount = 10;
+
+// Feeds data to a parser in chunks of at most maxChunk bytes (random sizes
+// if randomize is set) and collects the replies.
+static void parseReplies(const std::string& data, size_t maxChunk,
+                         bool randomize, std::vector<reply>& out) {
+    reply_parser parser;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t chunk = randomize ? 1 + rand() % maxChunk : maxChunk;
+        size_t end = std::min(data.size(), pos + chunk);
+        while (pos < end) {
+            pos += parser.feed(data.data() + pos, end - pos);
+            if (parser.has_reply())
+                out.push_back(parser.take());
+        }
+    }
+}
+
+static bool sameReply(const reply& a, const reply& b) {
+    if (a.type != b.type || a.str != b.str || a.integer != b.integer ||
+            a.nil != b.nil || a.elements.size() != b.elements.size())
+        return false;
+    for (size_t i = 0; i < a.elements.size(); i++) {
+        if (!sameReply(a.elements[i], b.elements[i]))
+            return false;
+    }
+    return true;
+}
+
+double replyParser() {
+    std::string data = sampleReplies();
+    int count = 10000;
+    std::vector<reply> replies;
+    replies.reserve(sampleReplyCount);
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        replies.clear();
+        parseReplies(data, data.size(), false, replies);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    if (replies.size() != sampleReplyCount) {
+        printf("reply_parser returned %zu replies instead of %d\n",
+               replies.size(), sampleReplyCount);
+    }
+    return Cycles::toSeconds(stop - start)/(count * sampleReplyCount);
+}
+
+double replyParserSmallChunks() {
+    std::string data = sampleReplies();
+    int count = 10000;
+    std::vector<reply> replies;
+    replies.reserve(sampleReplyCount);
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        replies.clear();
+        parseReplies(data, 7, false, replies);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    return Cycles::toSeconds(stop - start)/(count * sampleReplyCount);
+}
+
+double replyParserFuzz() {
+    std::string data = sampleReplies();
+    std::vector<reply> expected;
+    parseReplies(data, data.size(), false, expected);
+
+    // Split the stream at random points and make sure every split yields the
+    // same replies as feeding it at once.
+    int count = 1000;
+    srand(1);
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        std::vector<reply> replies;
+        parseReplies(data, 1 + i % 300, true, replies);
+        bool same = replies.size() == expected.size();
+        for (size_t j = 0; same && j < replies.size(); j++)
+            same = sameReply(replies[j], expected[j]);
+        if (!same) {
+            printf("reply_parser output differs for chunk size up to %d\n",
+                   1 + i % 300);
+            break;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+// A multi bulk reply with 1000 short elements, as returned by KEYS or
+// SMEMBERS, where header parsing dominates.
+static std::string sampleSmallElements() {
+    std::string data = "*1000\r\n";
+    for (int i = 0; i < 1000; i++) {
+        std::string element = "key:" + std::to_string(i);
+        data += "$" + std::to_string(element.length()) + "\r\n" + element + "\r\n";
+    }
+    return data;
+}
+
+double headerReadLine() {
+    std::string data = sampleSmallElements();
+    int count = 1000;
+    long long total = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        // What read_line() and recv_bulk_reply_() did for every header.
+        const char* p = data.data();
+        const char* end = p + data.size();
+        while (p < end) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+            std::string line(p, eol - p);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            long long length = boost::lexical_cast<long long>(line.substr(1));
+            total += length;
+            p = eol + 1;
+            if (line[0] == '$')
+                p += length + 2;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&total);
+    return Cycles::toSeconds(stop - start)/(count * 1001);
+}
+
+double headerScan() {
+    std::string data = sampleSmallElements();
+    int count = 1000;
+    long long total = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        const char* p = data.data();
+        const char* end = p + data.size();
+        while (p < end) {
+            long long length = 0;
+            const char* next = scan_header(p, end, length);
+            total += length;
+            if (*p == '$')
+                next += length + 2;
+            p = next;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&total);
+    return Cycles::toSeconds(stop - start)/(count * 1001);
+}
+
+// Status lines of mixed length, as seen when reading pipelined replies.
+static std::string sampleStatusLines() {
+    std::string data;
+    for (int i = 0; i < 1000; i++) {
+        data += (i % 10 == 0) ? "-ERR wrong number of arguments for 'set' command\r\n"
+                              : "+OK\r\n";
+    }
+    return data;
+}
+
+double eolMemchr() {
+    std::string data = sampleStatusLines();
+    int count = 1000;
+    int lines = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        const char* p = data.data();
+        const char* end = p + data.size();
+        while (p < end) {
+            p = static_cast<const char*>(memchr(p, '\n', end - p)) + 1;
+            lines++;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&lines);
+    return Cycles::toSeconds(stop - start)/lines;
+}
+
+double eolFind() {
+    std::string data = sampleStatusLines();
+    int count = 1000;
+    int lines = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        const char* p = data.data();
+        const char* end = p + data.size();
+        while (p < end) {
+            p = find_eol(p, end - p) + 1;
+            lines++;
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    discard(&lines);
+    return Cycles::toSeconds(stop - start)/lines;
+}
+
+// Three local UDP sockets standing in for witnesses. Nobody reads them, so
+// records are dropped once their buffers are full.
+static std::vector<int> witnessReceivers(std::vector<sockaddr_in>& addrs) {
+    std::vector<int> receivers;
+    for (int i = 0; i < 3; i++) {
+        int s = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(s, (sockaddr*) &sin, sizeof(sin));
+        socklen_t len = sizeof(sin);
+        getsockname(s, (sockaddr*) &sin, &len);
+        receivers.push_back(s);
+        addrs.push_back(sin);
+    }
+    return receivers;
+}
+
+static void closeAll(const std::vector<int>& sockets) {
+    for (size_t i = 0; i < sockets.size(); i++)
+        close(sockets[i]);
+}
+
+// What sendWitnessRecord() used to do: build the record and sendto() it
+// once per witness, each from a socket of its own.
+double witnessSendto() {
+    std::vector<sockaddr_in> addrs;
+    std::vector<int> receivers = witnessReceivers(addrs);
+    std::vector<int> senders;
+    for (size_t w = 0; w < addrs.size(); w++)
+        senders.push_back(createSocket());
+    redis::cmd_encoder request;
+    request.begin(redis::commands::SET) << "key:0000000001" << std::string(100, 'x');
+    request.append_id(1234).append_id(5678);
+    int count = 100000;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        for (size_t w = 0; w < addrs.size(); w++) {
+            witnesscmd_t cmd;
+            create_add_wcmd(&cmd, 1234, i, i & 1023,
+                    const_cast<char*>(request.data()), request.size());
+            udpWrite(senders[w], SRC_ADDR, "127.0.0.1", WITNESS_CLIENT_PORT,
+                    WITNESS_PORT, witness_data(&cmd), witness_size(&cmd),
+                    &addrs[w], false);
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+    closeAll(senders);
+    closeAll(receivers);
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+// The record built once and sent to every witness with one sendmmsg().
+double witnessSendmmsg() {
+    std::vector<sockaddr_in> addrs;
+    std::vector<int> receivers = witnessReceivers(addrs);
+    int sender = createSocket();
+    redis::cmd_encoder request;
+    request.begin(redis::commands::SET) << "key:0000000001" << std::string(100, 'x');
+    request.append_id(1234).append_id(5678);
+    std::vector<mmsghdr> msgs(addrs.size());
+    int count = 100000;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; i++) {
+        witnesscmd_t cmd;
+        create_add_wcmd(&cmd, 1234, i, i & 1023,
+                const_cast<char*>(request.data()), request.size());
+        iovec iov;
+        iov.iov_base = witness_data(&cmd);
+        iov.iov_len = witness_size(&cmd);
+        for (size_t w = 0; w < addrs.size(); w++) {
+            memset(&msgs[w].msg_hdr, 0, sizeof(msghdr));
+            msgs[w].msg_hdr.msg_name = &addrs[w];
+            msgs[w].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[w].msg_hdr.msg_iov = &iov;
+            msgs[w].msg_hdr.msg_iovlen = 1;
+        }
+        sendmmsg(sender, msgs.data(), msgs.size(), 0);
+    }
+    uint64_t stop = Cycles::rdtsc();
+    close(sender);
+    closeAll(receivers);
+    return Cycles::toSeconds(stop - start)/count;
+}
+
 TestInfo tests[] = {
     {"stringlength", stringlength,
      "Getting length from std::string::length()"},
@@ -384,14 +926,56 @@ TestInfo tests[] = {
      "Converting 64_bit value to string using sprintf"},
     {"lltostr", lltostr,
      "Converting 64_bit value to string using to_string"},
+    {"parseIntLexicalCast", parseIntLexicalCast,
+     "Parsing integer reply with lexical_cast"},
+    {"parseIntNumber", parseIntNumber,
+     "Parsing integer reply with parse_number"},
+    {"parseDoubleLexicalCast", parseDoubleLexicalCast,
+     "Parsing score reply with lexical_cast"},
+    {"parseDoubleNumber", parseDoubleNumber,
+     "Parsing score reply with parse_number"},
+    {"formatDoubleLexicalCast", formatDoubleLexicalCast,
+     "Formatting score with lexical_cast"},
+    {"formatDoubleSprintf", formatDoubleSprintf,
+     "Formatting score with snprintf %.17g"},
+    {"formatDoubleShortest", formatDoubleShortest,
+     "Formatting shortest score with format_number"},
     {"requestConst", requestConst,
      "makecmd"},
-    {"fastcmd", requestConstFastcmd,
-     "fastcmd"},
+    {"bufferPool", bufferPoolAcquire,
+     "2KB command buffer from buffer_pool"},
+    {"bufferHeap", bufferHeapAlloc,
+     "2KB command buffer from new/delete"},
+    {"cmdEncoder", requestEncoder,
+     "cmd_encoder reused for every request"},
+    {"cmdEncoderSpec", requestEncoderSpec,
+     "cmd_encoder with SET from a command_spec"},
+    {"getEncoderName", requestGetName,
+     "GET through cmd_encoder, name encoded at runtime"},
+    {"getEncoderSpec", requestGetSpec,
+     "GET through cmd_encoder from a command_spec"},
     {"requestFastConst", requestFastConst,
      "sprintf SET cmd"},
     {"requestSuperFastConst", requestSuperFastConst,
      "custom gen SET cmd using itoa and memcpy"},
+    {"replyParser", replyParser,
+     "reply_parser, whole replies fed at once"},
+    {"replyParserSmallChunks", replyParserSmallChunks,
+     "reply_parser, replies fed in 7-byte chunks"},
+    {"replyParserFuzz", replyParserFuzz,
+     "reply_parser, sample stream split at random"},
+    {"headerReadLine", headerReadLine,
+     "bulk header via memchr, std::string, lexical_cast"},
+    {"headerScan", headerScan,
+     "bulk header via scan_header"},
+    {"eolMemchr", eolMemchr,
+     "find end of status line with memchr"},
+    {"eolFind", eolFind,
+     "find end of status line with find_eol"},
+    {"witnessSendto", witnessSendto,
+     "witness record to 3 witnesses, built and sent per witness"},
+    {"witnessSendmmsg", witnessSendmmsg,
+     "witness record to 3 witnesses, built once, one sendmmsg"},
 };
 
 /**
@@ -93,68 +93,10 @@ UnsyncedRpcTracker::registerUnsynced(int socket, int dbindex,
 }
 
 
-inline static std::string&
-rtrim(std::string & str, const std::string & ws = REDIS_WHITESPACE) {
-    std::string::size_type pos = str.find_last_not_of(ws);
-    str.erase(pos + 1);
-    return str;
-}
-
-// Reads a single line of character data from the given blocking socket.
-// Returns the line that was read, not including EOL delimiter(s).  Both LF
-// ('\n') and CRLF ("\r\n") delimiters are supported.  If there was an I/O
-// error reading from the socket, connection_error is raised.  If max_size
-// bytes are read before finding an EOL delimiter, a blank string is
-// returned.
-static std::string
-read_line(int socket, ssize_t max_size = 2048) {
-    assert(socket > 0);
-    assert(max_size > 0);
-
-    std::ostringstream oss;
-
-    enum {
-        buffer_size = 64
-    };
-    char buffer[buffer_size];
-    memset(buffer, 0, buffer_size);
-
-    ssize_t total_bytes_read = 0;
-    bool found_delimiter = false;
-
-    while (total_bytes_read < max_size && !found_delimiter) {
-        // Peek at what's available.
-        ssize_t bytes_received = redis::recv_or_throw(socket, buffer, buffer_size, MSG_PEEK);
-
-        // Some data is available; Length might be < buffer_size.
-        // Look for newline in whatever was read though.
-        char * eol = static_cast<char *> (memchr(buffer, '\n', bytes_received));
-
-        // If found, write data from the buffer to the output string.
-        // Else, write the entire buffer and continue reading more data.
-        ssize_t to_read = bytes_received;
-
-        if (eol) {
-            to_read = eol - buffer + 1;
-            oss.write(buffer, to_read);
-            found_delimiter = true;
-        } else
-            oss.write(buffer, bytes_received);
-
-        // Now read from the socket to remove the peeked data from the socket's
-        // read buffer.  This will not block since we've peeked already and know
-        // there's data waiting.  It might fail if we were interrupted however.
-        bytes_received = redis::recv_or_throw(socket, buffer, to_read, 0);
-    }
-
-    // Construct final line string. Remove trailing CRLF-based whitespace.
-
-    std::string line = oss.str();
-    return rtrim(line, REDIS_LBR);
-}
-
-static bool recv_ok_reply_(int socket) {
-    std::string line = read_line(socket);
+static bool recv_ok_reply_(redis::recv_buffer& rbuf, int socket) {
+    size_t len;
+    const char* data = rbuf.read_line(socket, len);
+    std::string line(data, len);
 
     if (line.empty())
         throw redis::protocol_error("empty single line reply");
@@ -221,6 +163,7 @@ conn_err:
         goto conn_err;
     }
     anetTcpNoDelay(NULL, socketForReplay);
+    redis::recv_buffer replayBuf;
 
     int currentDbIndex = -1;
 
@@ -233,12 +176,12 @@ conn_err:
                 goto conn_err;
             ++sentCommands;
             currentDbIndex = rpc.dbindex;
-            if (!recv_ok_reply_(socketForReplay)) continue;
+            if (!recv_ok_reply_(replayBuf, socketForReplay)) continue;
         }
 
         if (anetWrite(socketForReplay, rpc.data, rpc.size) == -1)
             goto conn_err;
-        if (!recv_ok_reply_(socketForReplay)) continue;
+        if (!recv_ok_reply_(replayBuf, socketForReplay)) continue;
         rpc.callback();
         free(rpc.data);
         master->rpcs.pop();
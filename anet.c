@@ -32,6 +32,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -40,6 +42,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -207,6 +210,63 @@ int anetWrite(int fd, char *buf, int count)
     return totlen;
 }
 
+/* Like writev(2) but make sure all the 'iovcnt' buffers are written before
+ * to return (unless error is encountered). The iovec array is modified to
+ * skip what was written on partial writes. */
+int anetWritev(int fd, struct iovec *iov, int iovcnt)
+{
+    int totlen = 0;
+    while(iovcnt > 0) {
+        int nwritten = writev(fd,iov,iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten == 0) return totlen;
+        if (nwritten == -1) return -1;
+        totlen += nwritten;
+        while(iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (nwritten > 0) {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return totlen;
+}
+
+/* Writes 'count' bytes of 'in_fd' starting at 'offset' to 'fd' with
+ * sendfile(2), so the data does not pass through user space. Falls back to
+ * pread(2)/write(2) if 'in_fd' does not support sendfile. The file offset of
+ * 'in_fd' is not changed. Returns the number of bytes written, which is less
+ * than 'count' only at end of file, or -1 on error. */
+long anetSendFile(int fd, int in_fd, off_t offset, size_t count)
+{
+    size_t totlen = 0;
+    while(totlen != count) {
+        ssize_t nwritten = sendfile(fd,in_fd,&offset,count-totlen);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten == -1 && (errno == EINVAL || errno == ENOSYS) && totlen == 0)
+            break;
+        if (nwritten == -1) return -1;
+        if (nwritten == 0) return totlen;
+        totlen += nwritten;
+    }
+
+    while(totlen != count) {
+        char buf[16*1024];
+        size_t chunk = count-totlen < sizeof(buf) ? count-totlen : sizeof(buf);
+        ssize_t nread = pread(in_fd,buf,chunk,offset);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1) return -1;
+        if (nread == 0) return totlen;
+        if (anetWrite(fd,buf,nread) != nread) return -1;
+        offset += nread;
+        totlen += nread;
+    }
+    return totlen;
+}
+
 int anetTcpServer(char *err, int port, char *bindaddr)
 {
     int s, on = 1;
@@ -31,10 +31,14 @@
 #ifndef ANET_H
 #define ANET_H
 
+#include <sys/types.h>
+
 #define ANET_OK 0
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
 
+struct iovec;
+
 int anetTcpConnect(char *err, char *addr, int port);
 int anetTcpNonBlockConnect(char *err, char *addr, int port);
 int anetRead(int fd, char *buf, int count);
@@ -42,6 +46,8 @@ int anetResolve(char *err, char *host, char *ipbuf);
 int anetTcpServer(char *err, int port, char *bindaddr);
 int anetAccept(char *err, int serversock, char *ip, int *port);
 int anetWrite(int fd, char *buf, int count);
+int anetWritev(int fd, struct iovec *iov, int iovcnt);
+long anetSendFile(int fd, int in_fd, off_t offset, size_t count);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
@@ -27,6 +27,8 @@
 #include <string>
 #include <vector>
 #include <thread>
+#include <deque>
+#include <future>
 #include "Atomic.h"
 
 #include <sys/time.h>
@@ -35,6 +37,7 @@
 #include <typeinfo>
 
 #include "redisclient.h"
+#include "rediscoroclient.h"
 #include "Cycles.h"
 #include <iostream>
 #include <atomic>
@@ -65,6 +68,7 @@ int clientIndex = 0;    // ClientIndex as in RAMCloud clusterPerf.
 int threads = 50;        // How many client threads per machine to run benchmark.
                         // used for throughput benchmark only.
 int numWitness = 3;// send requests to witness as well as master.
+redis::durability durability = redis::durability_witness; // Of the writes.
 
 redis::client* client;
 //redis::client* multiClient[1000];
@@ -159,8 +163,113 @@ void makeKey(int value, uint32_t length, char* dest)
     memcpy(dest, str.c_str(), str.size());
 }
 
+// CPU time used by the calling thread so far, which leaves out time spent
+// blocked waiting for replies.
+double
+threadCpuSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Keys are loaded in chunks of this many items, each through bulk_load with
+// up to fillWindow commands in flight.
+const int fillChunk = 100000;
+const size_t fillWindow = 1024;
+int fillDone = 0;       // Keys of the chunks loaded so far.
+
+void
+printFillProgress(const redis::client::bulk_load_stats& stats)
+{
+    fprintf(stderr, "\rfilled %zu keys (%.0f keys/s)", fillDone + stats.acked,
+            stats.rate());
+}
+
+/**
+ * Fills the table with keys 0 to numKeys - 1 through client->bulk_load.
+ *
+ * \param makeValue
+ *      Called with each key and the value to fill in, as in
+ *      makeValue(key, value).
+ */
+template<typename VALUE, typename MAKE_VALUE>
+void
+fillTable(int numKeys, uint16_t keyLength, MAKE_VALUE makeValue)
+{
+    std::vector<char> key(keyLength + 1);
+    std::vector<std::pair<std::string, VALUE> > items;
+    Cycles::init();
+    uint64_t start = Cycles::rdtsc();
+    for (int first = 0; first < numKeys; first += fillChunk) {
+        fillDone = first;
+        int last = std::min(numKeys, first + fillChunk);
+        items.resize(last - first);
+        for (int i = first; i < last; ++i) {
+            makeKey(i, keyLength, &key[0]);
+            items[i - first].first.assign(&key[0], keyLength);
+            makeValue(items[i - first].first, items[i - first].second);
+        }
+        client->bulk_load(items.begin(), items.end(), fillWindow,
+                          printFillProgress);
+    }
+    double seconds = Cycles::toSeconds(Cycles::rdtsc() - start);
+    fprintf(stderr, "\rfilled %d keys in %.2f s (%.0f keys/s)\n", numKeys,
+            seconds, numKeys / seconds);
+}
+
+// Value makers for fillTable.
+struct ZeroValue {
+    void operator()(const std::string& key, std::string& value) {
+        value = "0";
+    }
+};
+
+struct RandomValue {
+    RandomValue() : buf(objectSize + 1) {}
+
+    void operator()(const std::string& key, std::string& value) {
+        genRandomString(&buf[0], objectSize);
+        value.assign(&buf[0], objectSize);
+    }
+
+    std::vector<char> buf;
+};
+
+// Ten fields holding the same random value.
+struct RandomHash {
+    void operator()(const std::string& key,
+                    redis::client::string_pair_vector& fields) {
+        std::string value;
+        RandomValue()(key, value);
+        fields.clear();
+        for (int j = 0; j < 10; ++j)
+            fields.push_back(std::make_pair(std::to_string(j), value));
+    }
+};
+
 PerfUtils::Atomic<int64_t> writeThroughputTotalWrites(0);
 
+// Clients for writeThroughput's threads, each with its own witness sockets.
+redis::client_pool* clientPool;
+
+redis::client*
+newWitnessClient()
+{
+    std::vector<std::string> witnessIpsVec;
+    std::vector<int> witnessMasterIdx;
+    if (numWitness) {
+        for (int i = 0; i < numWitness; ++i) {
+            const char* witnessIp = witnessIps[i];
+            witnessIpsVec.push_back(std::string(witnessIp, strlen(witnessIp)));
+            witnessMasterIdx.push_back(1);
+        }
+    }
+    redis::client* c = new redis::client(hostIp, witnessIpsVec, witnessMasterIdx);
+    c->set_durability(durability);
+    return c;
+}
+
 void
 writeThroughputRunner(int tid) {
     int numKeys = 2000000;
@@ -168,26 +277,15 @@ writeThroughputRunner(int tid) {
     char* key = new char[keyLength + 1];
     char* value = new char[objectSize + 1];
 
-    redis::client* clientPtr = client;
-    if (tid != 0) {
-        std::vector<std::string> witnessIpsVec;
-        std::vector<int> witnessMasterIdx;
-        if (numWitness) {
-            for (int i = 0; i < numWitness; ++i) {
-                const char* witnessIp = witnessIps[i];
-                witnessIpsVec.push_back(std::string(witnessIp, strlen(witnessIp)));
-                witnessMasterIdx.push_back(1);
-            }
-        }
-        clientPtr = new redis::client(hostIp, witnessIpsVec, witnessMasterIdx);
-    }
-
 //    printf("New thread created! tid: %d clienId Assigned: %" PRIu64 ", rpcId: %" PRIu64 "\n", tid, multiClient[tid]->clientId, multiClient[tid]->lastRequestId);
+    // Held for the whole run, so that the pool's lock is not part of what
+    // is measured.
+    redis::client_pool::lease c = clientPool->acquire();
     uint64_t writeCount = 0;
     while(true) {
         makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, key);
         genRandomString(value, objectSize);
-        clientPtr->set(std::string(key, keyLength), std::string(value, objectSize));
+        c->set(std::string(key, keyLength), std::string(value, objectSize));
         writeCount++;
         if (writeCount % 1000 == 0) {
             writeThroughputTotalWrites.add(1000);
@@ -199,6 +297,10 @@ void
 writeThroughput()
 {
     Cycles::init();
+    redis::client_pool::options poolOptions;
+    poolOptions.max_size = threads;
+    redis::client_pool pool(&newWitnessClient, poolOptions);
+    clientPool = &pool;
     // Add startup delay.
     int delayInSec = 3;
     std::vector<std::thread> stdthreads;
@@ -228,6 +330,135 @@ writeThroughput()
     }
 }
 
+// Same load as writeThroughput, but from a single thread: an async_client
+// keeps `threads` writes in flight and issues a new one as each completes.
+// Writes are not recorded on witnesses.
+struct AsyncWriter {
+    redis::async_client* client;
+    int numKeys;
+    uint16_t keyLength;
+    char* key;
+    char* value;
+    uint64_t writeCount;
+
+    void issue() {
+        makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, key);
+        genRandomString(value, objectSize);
+        client->set(std::string(key, keyLength), std::string(value, objectSize),
+                    [this](redis::reply& r) { done(r); });
+    }
+
+    void done(redis::reply& r) {
+        if (r.type == redis::error_reply)
+            fprintf(stderr, "write failed: %s\n", r.str.c_str());
+        writeCount++;
+        if (writeCount % 1000 == 0) {
+            writeThroughputTotalWrites.add(1000);
+        }
+        issue();
+    }
+};
+
+void
+writeThroughputAsync()
+{
+    Cycles::init();
+    redis::async_client asyncClient(hostIp, 6379, 0);
+    AsyncWriter writer;
+    writer.client = &asyncClient;
+    writer.numKeys = 2000000;
+    writer.keyLength = 30;
+    writer.key = new char[writer.keyLength + 1];
+    writer.value = new char[objectSize + 1];
+    writer.writeCount = 0;
+    for (int i = 0; i < threads; ++i) {
+        writer.issue();
+    }
+    printf("Started %d outstanding writes.\n", threads);
+
+    int delayInSec = 3;
+    int64_t lastWriteTotal = 0;
+    uint64_t lastPrintTime = Cycles::rdtsc();
+    uint64_t nextPrint = lastPrintTime + Cycles::fromSeconds(delayInSec);
+    while(true) {
+        asyncClient.poll(100);
+        uint64_t currentTime = Cycles::rdtsc();
+        if (currentTime < nextPrint) {
+            continue;
+        }
+        printf("Outstanding writes: %d. Throughput: %7.2f kops/sec\n", threads,
+                (writeThroughputTotalWrites - lastWriteTotal) * 1e3 /
+                Cycles::toMicroseconds(currentTime - lastPrintTime));
+        lastPrintTime = currentTime;
+        nextPrint = currentTime + Cycles::fromSeconds(delayInSec);
+        lastWriteTotal = writeThroughputTotalWrites;
+    }
+}
+
+// writeThroughput through one redis::batching_client shared by all threads.
+// Each thread keeps up to batchingWindow writes outstanding. Writes are not
+// recorded on witnesses.
+const size_t batchingWindow = 64;
+
+void
+writeThroughputBatchingRunner(redis::batching_client* batching) {
+    int numKeys = 2000000;
+    const uint16_t keyLength = 30;
+    char* key = new char[keyLength + 1];
+    char* value = new char[objectSize + 1];
+
+    std::deque<std::future<void> > outstanding;
+    uint64_t writeCount = 0;
+    while(true) {
+        makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, key);
+        genRandomString(value, objectSize);
+        if (outstanding.size() >= batchingWindow) {
+            outstanding.front().get();
+            outstanding.pop_front();
+        }
+        outstanding.push_back(batching->set(std::string(key, keyLength),
+                                            std::string(value, objectSize)));
+        writeCount++;
+        if (writeCount % 1000 == 0) {
+            writeThroughputTotalWrites.add(1000);
+        }
+    }
+}
+
+void
+writeThroughputBatching()
+{
+    Cycles::init();
+    redis::batching_client batching(hostIp, 6379, 0);
+    std::vector<std::thread> stdthreads;
+    for (int i = 0; i < threads; ++i) {
+        stdthreads.emplace_back(writeThroughputBatchingRunner, &batching);
+    }
+    printf("Started %d threads.\n", threads);
+
+    int delayInSec = 3;
+    int64_t lastWriteTotal = 0;
+    redis::batching_client::batch_stats last;
+    while(true) {
+        uint64_t start = Cycles::rdtsc();
+        sleep(delayInSec);
+        uint64_t elapsed = Cycles::rdtsc() - start;
+        redis::batching_client::batch_stats now = batching.stats();
+        uint64_t batches = now.batches() - last.batches();
+        printf("Threads: %d. Throughput: %7.2f kops/sec. Commands per batch: "
+               "%.1f (size %" PRIu64 ", deadline %" PRIu64 ")\n", threads,
+               (writeThroughputTotalWrites - lastWriteTotal) * 1e3 /
+               Cycles::toMicroseconds(elapsed),
+               batches ? double(now.commands - last.commands) / batches : 0.0,
+               now.flushes[redis::batching_client::flush_size] -
+               last.flushes[redis::batching_client::flush_size],
+               now.flushes[redis::batching_client::flush_deadline] -
+               last.flushes[redis::batching_client::flush_deadline]);
+        lastWriteTotal = writeThroughputTotalWrites;
+        last = now;
+    }
+}
+
 // Write or overwrite randomly-chosen objects from a large table (so that there
 // will be cache misses on the hash table and the object) and compute a
 // cumulative distribution of write times.
@@ -246,14 +477,7 @@ writeDistRandom()
     char* value = new char[objectSize + 1];
 
     // fill table first.
-//    for (int i = 0; i < numKeys; ++i) {
-    for (int i = 0; i < 10000; ++i) {
-        makeKey(static_cast<int>(i), keyLength, key);
-        genRandomString(value, objectSize);
-
-        client->set(std::string(key, keyLength), std::string(value, objectSize));
-        // TODO: use pipelining.
-    }
+    fillTable<std::string>(numKeys, keyLength, RandomValue());
     Cycles::init();
 
     Cycles::sleep(10000);
@@ -265,6 +489,7 @@ writeDistRandom()
     // Issue the writes back-to-back, and save the times.
     std::vector<uint64_t> ticks;
     ticks.resize(count);
+    double cpuSeconds = 0;
     for (int i = 0; i < count; i++) {
         Cycles::sleep(3); // to give master time for syncing to backups.
         // We generate the random number separately to avoid timing potential
@@ -272,15 +497,23 @@ writeDistRandom()
         makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, key);
         genRandomString(value, objectSize);
         // Do the benchmark
+        double cpuStart = threadCpuSeconds();
         uint64_t start = Cycles::rdtsc();
         client->set(std::string(key, keyLength), std::string(value, objectSize));
         uint64_t now = Cycles::rdtsc();
+        cpuSeconds += threadCpuSeconds() - cpuStart;
         ticks.at(i) = now - start;
         if (now >= stop) {
             count = i+1;
             break;
         }
     }
+    fprintf(stderr, "CPU per write: %.2f us\n", cpuSeconds * 1e6 / count);
+    uint64_t witnessWrites, witnessSyscalls;
+    client->witness_stats(witnessWrites, witnessSyscalls);
+    if (witnessWrites > 0)
+        fprintf(stderr, "Witness syscalls per write: %.2f\n",
+                double(witnessSyscalls) / witnessWrites);
 
     // Output the times (several comma-separated values on each line).
     int valuesInLine = 0;
@@ -304,6 +537,134 @@ writeDistRandom()
     delete[] value;
 }
 
+#ifdef REDIS_HAS_COROUTINES
+// Coroutine variants of writeDistRandom and writeThroughput, built when
+// compiling as C++20. Writes go through redis::coro_client and are not
+// recorded on witnesses.
+
+redis::task<>
+writeDistRandomTask(redis::coro_client& c, std::vector<uint64_t>& ticks,
+                    double& cpuSeconds)
+{
+    int numKeys = 2000000;
+    const uint16_t keyLength = 30;
+    std::vector<char> key(keyLength + 1);
+    std::vector<char> value(objectSize + 1);
+
+    Cycles::init();
+
+    Cycles::sleep(10000);
+
+    uint64_t stop = Cycles::rdtsc() + Cycles::fromSeconds(300.0);
+    for (size_t i = 0; i < ticks.size(); i++) {
+        Cycles::sleep(3);
+        makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, &key[0]);
+        genRandomString(&value[0], objectSize);
+        double cpuStart = threadCpuSeconds();
+        uint64_t start = Cycles::rdtsc();
+        co_await c.set(std::string(&key[0], keyLength),
+                       std::string(&value[0], objectSize));
+        uint64_t now = Cycles::rdtsc();
+        cpuSeconds += threadCpuSeconds() - cpuStart;
+        ticks.at(i) = now - start;
+        if (now >= stop) {
+            ticks.resize(i+1);
+            break;
+        }
+    }
+}
+
+void
+writeDistRandomCoro()
+{
+    usleep(500);
+    if (clientIndex != 0)
+        return;
+
+    // Same table as writeDistRandom, so that the writes overwrite keys.
+    int numKeys = 2000000;
+    const uint16_t keyLength = 30;
+    fillTable<std::string>(numKeys, keyLength, RandomValue());
+    redis::coro_client c(hostIp, 6379, 0);
+    std::vector<uint64_t> ticks(count);
+    double cpuSeconds = 0;
+    c.spawn(writeDistRandomTask(c, ticks, cpuSeconds));
+    c.run();
+    fprintf(stderr, "CPU per write: %.2f us\n", cpuSeconds * 1e6 / ticks.size());
+
+    // Output the times (several comma-separated values on each line).
+    int valuesInLine = 0;
+    for (size_t i = 0; i < ticks.size(); i++) {
+        if (valuesInLine >= 10) {
+            valuesInLine = 0;
+            printf("\n");
+        }
+        if (valuesInLine != 0) {
+            printf(",");
+        }
+        double micros = Cycles::toSeconds(ticks.at(i))*1.0e06;
+        printf("%.2f", micros);
+        valuesInLine++;
+    }
+    printf("\n");
+}
+
+redis::task<>
+writeThroughputTask(redis::coro_client& c)
+{
+    int numKeys = 2000000;
+    const uint16_t keyLength = 30;
+    std::vector<char> key(keyLength + 1);
+    std::vector<char> value(objectSize + 1);
+    uint64_t writeCount = 0;
+    while(true) {
+        makeKey(static_cast<int>(generateRandom() % numKeys), keyLength, &key[0]);
+        genRandomString(&value[0], objectSize);
+        co_await c.set(std::string(&key[0], keyLength),
+                       std::string(&value[0], objectSize));
+        writeCount++;
+        if (writeCount % 1000 == 0) {
+            writeThroughputTotalWrites.add(1000);
+        }
+    }
+}
+
+// Runs `threads` coroutines, each writing back-to-back, on one thread.
+void
+writeThroughputCoro()
+{
+    Cycles::init();
+    redis::coro_client c(hostIp, 6379, 0);
+    for (int i = 0; i < threads; ++i) {
+        c.spawn(writeThroughputTask(c));
+    }
+    printf("Started %d coroutines.\n", threads);
+
+    int delayInSec = 3;
+    int64_t lastWriteTotal = 0;
+    uint64_t lastPrintTime = Cycles::rdtsc();
+    double lastCpu = threadCpuSeconds();
+    uint64_t nextPrint = lastPrintTime + Cycles::fromSeconds(delayInSec);
+    while(true) {
+        c.step(100);
+        uint64_t currentTime = Cycles::rdtsc();
+        if (currentTime < nextPrint) {
+            continue;
+        }
+        int64_t writes = writeThroughputTotalWrites - lastWriteTotal;
+        double cpu = threadCpuSeconds();
+        printf("Coroutines: %d. Throughput: %7.2f kops/sec, CPU per write: %.2f us\n",
+                threads, writes * 1e3 /
+                Cycles::toMicroseconds(currentTime - lastPrintTime),
+                writes ? (cpu - lastCpu) * 1e6 / writes : 0.0);
+        lastPrintTime = currentTime;
+        lastCpu = cpu;
+        nextPrint = currentTime + Cycles::fromSeconds(delayInSec);
+        lastWriteTotal = writeThroughputTotalWrites;
+    }
+}
+#endif // REDIS_HAS_COROUTINES
+
 void
 incrDistRandom()
 {
@@ -318,11 +679,7 @@ incrDistRandom()
     char* key = new char[keyLength + 1];
 
     // fill table first.
-    for (int i = 0; i < numKeys; ++i) {
-        makeKey(static_cast<int>(i), keyLength, key);
-        client->set(std::string(key, keyLength), "0");
-        // TODO: use pipelining.
-    }
+    fillTable<std::string>(numKeys, keyLength, ZeroValue());
     Cycles::init();
 
     Cycles::sleep(10000);
@@ -408,18 +765,7 @@ hmsetDistRandom()
     typedef std::vector<string_pair> string_pair_vector;
 
     // fill table first.
-    for (int i = 0; i < numKeys; ++i) {
-        makeKey(static_cast<int>(i), keyLength, key);
-        genRandomString(value, objectSize);
-
-        string_pair_vector vecValue;
-        for (int j = 0; j < 10; ++j) {
-            vecValue.push_back(std::make_pair(std::to_string(j),
-                                              std::string(value, objectSize)));
-        }
-        client->hmset(std::string(key, keyLength), vecValue);
-        // TODO: use pipelining.
-    }
+    fillTable<string_pair_vector>(numKeys, keyLength, RandomHash());
     Cycles::init();
 
     Cycles::sleep(10000);
@@ -497,7 +843,8 @@ parseOptions(int argc, char* argv[]) {
         {"clientIndex", 'i', true},
         {"size", 's', true},
         {"threads", 't', true},
-        {"witness", 'w', true}
+        {"witness", 'w', true},
+        {"durability", 'd', true}
     };
     const int UNRECOGNIZED = ~0;
 
@@ -552,6 +899,19 @@ parseOptions(int argc, char* argv[]) {
             case 'w':
                 numWitness = atoi(optionArgument);
                 break;
+            case 'd':
+                if (strcmp(optionArgument, "none") == 0)
+                    durability = redis::durability_none;
+                else if (strcmp(optionArgument, "witness") == 0)
+                    durability = redis::durability_witness;
+                else if (strcmp(optionArgument, "sync") == 0)
+                    durability = redis::durability_sync;
+                else {
+                    fprintf(stderr, "Unknown durability %s; use none, witness or sync.\n",
+                            optionArgument);
+                    exit(1);
+                }
+                break;
             case UNRECOGNIZED:
                 i++;
         }
@@ -582,6 +942,7 @@ main(int argc, char *argv[]) {
         }
     }
     redis::client realClient(hostIp, witnessIpsVec, witnessMasterIdx);
+    realClient.set_durability(durability);
     client = &realClient;
 //    for (int tid = 0; tid < threads; tid++) {
 //        multiClient[tid] = new redis::client(hostIp, witnessIpsVec, witnessMasterIdx);
@@ -596,6 +957,16 @@ main(int argc, char *argv[]) {
         incrDistRandom();
     } else if (strncmp("hmsetDistRandom", argv[1], 20) == 0) {
         hmsetDistRandom();
+#ifdef REDIS_HAS_COROUTINES
+    } else if (strncmp("writeDistRandomCoro", argv[1], 25) == 0) {
+        writeDistRandomCoro();
+    } else if (strncmp("writeThroughputCoro", argv[1], 25) == 0) {
+        writeThroughputCoro();
+#endif
+    } else if (strncmp("writeThroughputAsync", argv[1], 25) == 0) {
+        writeThroughputAsync();
+    } else if (strncmp("writeThroughputBatching", argv[1], 25) == 0) {
+        writeThroughputBatching();
     } else if (strncmp("writeThroughput", argv[1], 20) == 0) {
         writeThroughput();
     } else {
@@ -33,13 +33,29 @@
 
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <string>
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <stdexcept>
+#include <exception>
 #include <ctime>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <sstream>
 #include <errno.h>
 
@@ -49,12 +65,16 @@
 #include <boost/foreach.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/random.hpp>
 #include <boost/cstdint.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/optional.hpp>
 #include <boost/variant.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/utility/string_ref.hpp>
 
 
 #include "util.h"
@@ -107,10 +127,12 @@ namespace redis {
         multi_bulk_reply
     };
 
+    class recv_buffer;
+
     struct connection_data {
 
         connection_data(const std::string & host = "localhost", uint16_t port = 6379, uint16_t replayPort = 6380, int dbindex = 0)
-        : host(host), witnessIps(), witnessBufferIndex(), port(port), replayPort(replayPort), dbindex(dbindex), socket(ANET_ERR),  witnessSockets() {
+        : host(host), witnessIps(), witnessBufferIndex(), port(port), replayPort(replayPort), dbindex(dbindex), socket(ANET_ERR), witnessSocket(-1) {
         }
 
         bool operator==(const connection_data & other) const {
@@ -133,7 +155,8 @@ namespace redis {
 
     private:
         int socket;
-        std::vector<int> witnessSockets;
+        boost::shared_ptr<recv_buffer> rbuf; // Replaced on every (re)connect.
+        int witnessSocket; // Sends to and receives from every witness.
         std::vector<sockaddr_in> witnessSockAddrs;
 
         template<typename CONSISTENT_HASHER>
@@ -145,6 +168,14 @@ namespace redis {
         role_slave
     };
 
+    // How far a write has got when set(), hmset(), set_from_fd(), incr() or
+    // lpush() of base_client return; see base_client::set_durability().
+    enum durability {
+        durability_none, // Sent; the master's reply is suppressed (CLIENT REPLY SKIP).
+        durability_witness, // Master replied and witnesses, if any, recorded it (CURP).
+        durability_sync // Master replied and backups acknowledged it (WAIT).
+    };
+
     // Generic error that is thrown when communicating with the redis server.
 
     class redis_error : public std::exception {
@@ -230,239 +261,1144 @@ namespace redis {
         std::string name;
     };
 
-    class makecmd {
+    // Number of decimal digits of value, from its bit width and a table of
+    // powers of 10, so that encoders can size their output before writing.
+
+    inline unsigned decimal_digits(unsigned long long value) {
+        static const unsigned long long powers[] = {
+            1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+            10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+            100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+            100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+            100000000000000000ULL, 1000000000000000000ULL,
+            10000000000000000000ULL
+        };
+        value |= 1;
+        unsigned log10 = (64 - __builtin_clzll(value)) * 1233 >> 12; // * log10(2)
+        return log10 + 1 - (value < powers[log10]);
+    }
+
+    // Writes value in decimal at p, which needs room for 20 digits and a
+    // sign, and returns the end; the counterpart of parse_number(). Digits
+    // are written in place, two at a time, from the end backwards.
+
+    inline char * format_number(char * p, unsigned long long value) {
+        static const char pairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        char * end = p + decimal_digits(value);
+        char * d = end;
+        while (value >= 100) {
+            unsigned pair = static_cast<unsigned> (value % 100) * 2;
+            value /= 100;
+            *--d = pairs[pair + 1];
+            *--d = pairs[pair];
+        }
+        if (value >= 10) {
+            *--d = pairs[value * 2 + 1];
+            *--d = pairs[value * 2];
+        } else {
+            *--d = static_cast<char> ('0' + value);
+        }
+        return end;
+    }
+
+    inline char * format_number(char * p, long long value) {
+        unsigned long long magnitude = value;
+        if (value < 0) {
+            *p++ = '-';
+            magnitude = 0ULL - magnitude;
+        }
+        return format_number(p, magnitude);
+    }
+
+    // Shortest decimal form of a double that reads back as the same double,
+    // after Loitsch's Grisu2 ("Printing Floating-Point Numbers Quickly and
+    // Accurately with Integers", PLDI 2010). The result always round-trips
+    // and is the shortest one in all but rare cases, where it is at most
+    // one digit longer. This is what to_chars() gives in C++17.
+
+    struct diy_fp {
+        uint64_t f;
+        int e;
+
+        diy_fp(uint64_t f, int e) : f(f), e(e) {
+        }
+
+        diy_fp operator-(const diy_fp & other) const {
+            return diy_fp(f - other.f, e);
+        }
+
+        // The upper 64 bits of the 128-bit product, rounded.
+        diy_fp operator*(const diy_fp & other) const {
+            const uint64_t u_lo = f & 0xFFFFFFFFu, u_hi = f >> 32;
+            const uint64_t v_lo = other.f & 0xFFFFFFFFu, v_hi = other.f >> 32;
+            const uint64_t p0 = u_lo * v_lo, p1 = u_lo * v_hi;
+            const uint64_t p2 = u_hi * v_lo, p3 = u_hi * v_hi;
+            uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+            q += 1ULL << 31;
+            return diy_fp(p3 + (p2 >> 32) + (p1 >> 32) + (q >> 32), e + other.e + 64);
+        }
+
+        diy_fp normalize() const {
+            diy_fp x = *this;
+            int shift = __builtin_clzll(x.f);
+            x.f <<= shift;
+            x.e -= shift;
+            return x;
+        }
+    };
+
+    // 10^k for k = -300, -292, ..., 340 as normalized diy_fp.
+    struct grisu_power {
+        uint64_t f;
+        int e;
+        int k;
+    };
+
+    inline const grisu_power & grisu_cached_power(int e) {
+        static const grisu_power powers[] = {
+            {0xAB70FE17C79AC6CAULL, -1060, -300},
+            {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+            {0xBE5691EF416BD60CULL, -1007, -284},
+            {0x8DD01FAD907FFC3CULL, -980, -276},
+            {0xD3515C2831559A83ULL, -954, -268},
+            {0x9D71AC8FADA6C9B5ULL, -927, -260},
+            {0xEA9C227723EE8BCBULL, -901, -252},
+            {0xAECC49914078536DULL, -874, -244},
+            {0x823C12795DB6CE57ULL, -847, -236},
+            {0xC21094364DFB5637ULL, -821, -228},
+            {0x9096EA6F3848984FULL, -794, -220},
+            {0xD77485CB25823AC7ULL, -768, -212},
+            {0xA086CFCD97BF97F4ULL, -741, -204},
+            {0xEF340A98172AACE5ULL, -715, -196},
+            {0xB23867FB2A35B28EULL, -688, -188},
+            {0x84C8D4DFD2C63F3BULL, -661, -180},
+            {0xC5DD44271AD3CDBAULL, -635, -172},
+            {0x936B9FCEBB25C996ULL, -608, -164},
+            {0xDBAC6C247D62A584ULL, -582, -156},
+            {0xA3AB66580D5FDAF6ULL, -555, -148},
+            {0xF3E2F893DEC3F126ULL, -529, -140},
+            {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+            {0x87625F056C7C4A8BULL, -475, -124},
+            {0xC9BCFF6034C13053ULL, -449, -116},
+            {0x964E858C91BA2655ULL, -422, -108},
+            {0xDFF9772470297EBDULL, -396, -100},
+            {0xA6DFBD9FB8E5B88FULL, -369, -92},
+            {0xF8A95FCF88747D94ULL, -343, -84},
+            {0xB94470938FA89BCFULL, -316, -76},
+            {0x8A08F0F8BF0F156BULL, -289, -68},
+            {0xCDB02555653131B6ULL, -263, -60},
+            {0x993FE2C6D07B7FACULL, -236, -52},
+            {0xE45C10C42A2B3B06ULL, -210, -44},
+            {0xAA242499697392D3ULL, -183, -36},
+            {0xFD87B5F28300CA0EULL, -157, -28},
+            {0xBCE5086492111AEBULL, -130, -20},
+            {0x8CBCCC096F5088CCULL, -103, -12},
+            {0xD1B71758E219652CULL, -77, -4},
+            {0x9C40000000000000ULL, -50, 4},
+            {0xE8D4A51000000000ULL, -24, 12},
+            {0xAD78EBC5AC620000ULL, 3, 20},
+            {0x813F3978F8940984ULL, 30, 28},
+            {0xC097CE7BC90715B3ULL, 56, 36},
+            {0x8F7E32CE7BEA5C70ULL, 83, 44},
+            {0xD5D238A4ABE98068ULL, 109, 52},
+            {0x9F4F2726179A2245ULL, 136, 60},
+            {0xED63A231D4C4FB27ULL, 162, 68},
+            {0xB0DE65388CC8ADA8ULL, 189, 76},
+            {0x83C7088E1AAB65DBULL, 216, 84},
+            {0xC45D1DF942711D9AULL, 242, 92},
+            {0x924D692CA61BE758ULL, 269, 100},
+            {0xDA01EE641A708DEAULL, 295, 108},
+            {0xA26DA3999AEF774AULL, 322, 116},
+            {0xF209787BB47D6B85ULL, 348, 124},
+            {0xB454E4A179DD1877ULL, 375, 132},
+            {0x865B86925B9BC5C2ULL, 402, 140},
+            {0xC83553C5C8965D3DULL, 428, 148},
+            {0x952AB45CFA97A0B3ULL, 455, 156},
+            {0xDE469FBD99A05FE3ULL, 481, 164},
+            {0xA59BC234DB398C25ULL, 508, 172},
+            {0xF6C69A72A3989F5CULL, 534, 180},
+            {0xB7DCBF5354E9BECEULL, 561, 188},
+            {0x88FCF317F22241E2ULL, 588, 196},
+            {0xCC20CE9BD35C78A5ULL, 614, 204},
+            {0x98165AF37B2153DFULL, 641, 212},
+            {0xE2A0B5DC971F303AULL, 667, 220},
+            {0xA8D9D1535CE3B396ULL, 694, 228},
+            {0xFB9B7CD9A4A7443CULL, 720, 236},
+            {0xBB764C4CA7A44410ULL, 747, 244},
+            {0x8BAB8EEFB6409C1AULL, 774, 252},
+            {0xD01FEF10A657842CULL, 800, 260},
+            {0x9B10A4E5E9913129ULL, 827, 268},
+            {0xE7109BFBA19C0C9DULL, 853, 276},
+            {0xAC2820D9623BF429ULL, 880, 284},
+            {0x80444B5E7AA7CF85ULL, 907, 292},
+            {0xBF21E44003ACDD2DULL, 933, 300},
+            {0x8E679C2F5E44FF8FULL, 960, 308},
+            {0xD433179D9C8CB841ULL, 986, 316},
+            {0x9E19DB92B4E31BA9ULL, 1013, 324},
+            {0xEB96BF6EBADF77D9ULL, 1039, 332},
+            {0xAF87023B9BF0EE6BULL, 1066, 340},
+        };
+        // Picks a power c with alpha <= e + c.e + 64 <= gamma, for alpha
+        // -60 and gamma -32, so that the digits fit into 32 and 64 bits.
+        const int f = -60 - e - 1;
+        const int k = (f * 78913) / (1 << 18) + (f > 0 ? 1 : 0); // ceil(f * log10(2))
+        return powers[(300 + k + 7) / 8];
+    }
+
+    // Steps the last digit down while that gets closer to w, rest being the
+    // distance from the digits to the upper bound.
+    inline void grisu_round(char * digits, int len, uint64_t dist, uint64_t delta,
+            uint64_t rest, uint64_t ten_k) {
+        while (rest < dist && delta - rest >= ten_k
+                && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+            digits[len - 1]--;
+            rest += ten_k;
+        }
+    }
+
+    // Generates the digits of a number between m_minus and m_plus, as close
+    // to w as can be found; the result is digits * 10^exponent.
+    inline int grisu_digits(char * digits, int & exponent, const diy_fp & m_minus,
+            const diy_fp & w, const diy_fp & m_plus) {
+        uint64_t delta = (m_plus - m_minus).f;
+        uint64_t dist = (m_plus - w).f;
+        const int shift = -m_plus.e;
+        const uint64_t one = 1ULL << shift;
+
+        uint32_t p1 = static_cast<uint32_t> (m_plus.f >> shift);
+        uint64_t p2 = m_plus.f & (one - 1);
+
+        int len = 0;
+        int n = static_cast<int> (decimal_digits(p1));
+        static const uint32_t pow10[] = {
+            1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+        };
+        while (n > 0) {
+            uint32_t divisor = pow10[n - 1];
+            digits[len++] = static_cast<char> ('0' + p1 / divisor);
+            p1 %= divisor;
+            --n;
+            uint64_t rest = (static_cast<uint64_t> (p1) << shift) + p2;
+            if (rest <= delta) {
+                exponent += n;
+                grisu_round(digits, len, dist, delta, rest, static_cast<uint64_t> (divisor) << shift);
+                return len;
+            }
+        }
+
+        int m = 0;
+        for (;;) {
+            p2 *= 10;
+            digits[len++] = static_cast<char> ('0' + (p2 >> shift));
+            p2 &= one - 1;
+            ++m;
+            delta *= 10;
+            dist *= 10;
+            if (p2 <= delta)
+                break;
+        }
+        exponent -= m;
+        grisu_round(digits, len, dist, delta, p2, one);
+        return len;
+    }
+
+    // Shortest digits of a positive, finite value: value = digits * 10^exponent.
+    inline int grisu2(char * digits, int & exponent, double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        const uint64_t hidden_bit = 1ULL << 52;
+        const uint64_t fraction = bits & (hidden_bit - 1);
+        const int biased_exponent = static_cast<int> (bits >> 52);
+
+        diy_fp v = biased_exponent == 0
+                ? diy_fp(fraction, 1 - 1075)
+                : diy_fp(fraction + hidden_bit, biased_exponent - 1075);
+
+        // The boundaries halfway to the neighbouring doubles; the lower one
+        // is closer when value is a power of two.
+        diy_fp m_plus = diy_fp(2 * v.f + 1, v.e - 1).normalize();
+        diy_fp m_minus = fraction == 0 && biased_exponent > 1
+                ? diy_fp(4 * v.f - 1, v.e - 2)
+                : diy_fp(2 * v.f - 1, v.e - 1);
+        m_minus = diy_fp(m_minus.f << (m_minus.e - m_plus.e), m_plus.e);
+        v = v.normalize();
+
+        const grisu_power & cached = grisu_cached_power(m_plus.e);
+        const diy_fp c(cached.f, cached.e);
+        const diy_fp w = v * c;
+        const diy_fp w_minus = m_minus * c;
+        const diy_fp w_plus = m_plus * c;
+
+        // Stay strictly inside the boundaries to make up for the rounding in
+        // the products.
+        exponent = -cached.k;
+        return grisu_digits(digits, exponent, diy_fp(w_minus.f + 1, w_minus.e), w,
+                diy_fp(w_plus.f - 1, w_plus.e));
+    }
+
+    // Writes the shortest form of value at p, which needs room for 25
+    // characters, and returns the end. Like %g, but without rounding to a
+    // precision: plain notation for decimal exponents from -4 to 16,
+    // scientific otherwise ("1e+21"), "inf", "-inf" and "nan".
+
+    inline char * format_number(char * p, double value) {
+        if (std::isnan(value)) {
+            memcpy(p, "nan", 3);
+            return p + 3;
+        }
+        if (std::signbit(value)) {
+            *p++ = '-';
+            value = -value;
+        }
+        if (std::isinf(value)) {
+            memcpy(p, "inf", 3);
+            return p + 3;
+        }
+        if (value == 0) {
+            *p++ = '0';
+            return p;
+        }
+
+        char digits[20];
+        int exponent;
+        const int k = grisu2(digits, exponent, value);
+        const int n = k + exponent; // value = 0.digits * 10^n
+
+        if (k <= n && n <= 17) {
+            // digits000
+            memcpy(p, digits, k);
+            memset(p + k, '0', n - k);
+            return p + n;
+        }
+        if (0 < n && n <= 17) {
+            // dig.its
+            memcpy(p, digits, n);
+            p[n] = '.';
+            memcpy(p + n + 1, digits + n, k - n);
+            return p + k + 1;
+        }
+        if (-4 < n && n <= 0) {
+            // 0.000digits
+            p[0] = '0';
+            p[1] = '.';
+            memset(p + 2, '0', -n);
+            memcpy(p + 2 - n, digits, k);
+            return p + 2 - n + k;
+        }
+
+        // d.igitse+x
+        *p++ = digits[0];
+        if (k > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, k - 1);
+            p += k - 1;
+        }
+        *p++ = 'e';
+        int e = n - 1;
+        if (e < 0) {
+            *p++ = '-';
+            e = -e;
+        } else {
+            *p++ = '+';
+        }
+        return format_number(p, static_cast<unsigned long long> (e));
+    }
+
+    // Command framing worked out at compile time. A command_spec holds
+    // "*<argc>\r\n$<length>\r\n<name>\r\n" for a command name and a number
+    // of arguments (the name included), so that cmd_encoder can start the
+    // command with one memcpy() and only encodes the variable arguments.
+    // C++11 takes no string literals as template arguments, so specs are
+    // made by make_command_spec() at compile time instead; see namespace
+    // commands.
+
+    constexpr size_t spec_digits(size_t x) {
+        return x < 10 ? 1 : 1 + spec_digits(x / 10);
+    }
+
+    constexpr size_t spec_pow10(size_t n) {
+        return n == 0 ? 1 : 10 * spec_pow10(n - 1);
+    }
+
+    // The i-th decimal digit of x, from the left.
+    constexpr char spec_digit(size_t x, size_t i) {
+        return static_cast<char> ('0' + x / spec_pow10(spec_digits(x) - 1 - i) % 10);
+    }
+
+    // The i-th character of "$<len>\r\n<name>\r\n", then NULs.
+    constexpr char spec_name_char(const char * name, size_t len, size_t i) {
+        return i == 0 ? REDIS_PREFIX_SINGLE_BULK_REPLY
+                : i <= spec_digits(len) ? spec_digit(len, i - 1)
+                : i == spec_digits(len) + 1 ? '\r'
+                : i == spec_digits(len) + 2 ? '\n'
+                : i < spec_digits(len) + 3 + len ? name[i - spec_digits(len) - 3]
+                : i == spec_digits(len) + 3 + len ? '\r'
+                : i == spec_digits(len) + 4 + len ? '\n'
+                : '\0';
+    }
+
+    // The i-th character of the whole framing.
+    constexpr char spec_char(const char * name, size_t len, size_t argc, size_t i) {
+        return i == 0 ? REDIS_PREFIX_MULTI_BULK_REPLY
+                : i <= spec_digits(argc) ? spec_digit(argc, i - 1)
+                : i == spec_digits(argc) + 1 ? '\r'
+                : i == spec_digits(argc) + 2 ? '\n'
+                : spec_name_char(name, len, i - spec_digits(argc) - 3);
+    }
+
+    template<size_t... I>
+    struct spec_indices {
+    };
+
+    template<size_t N, size_t... I>
+    struct make_spec_indices : make_spec_indices<N - 1, N - 1, I...> {
+    };
+
+    template<size_t... I>
+    struct make_spec_indices<0, I...> {
+        typedef spec_indices<I...> type;
+    };
+
+    template<size_t N>
+    struct command_spec {
+        // Up to 999 arguments and names of up to 999 characters.
+        static const size_t capacity = N + 16;
+
+        template<size_t... I>
+        constexpr command_spec(const char (&name)[N], size_t argc, spec_indices<I...>)
+        : data{spec_char(name, N - 1, argc, I)...},
+        size(argc < 1000 && N <= 1000
+                ? spec_digits(argc) + spec_digits(N - 1) + N - 1 + 8
+                : throw std::length_error("command_spec too long")),
+        header_size(spec_digits(argc) + 3),
+        argc(argc) {
+        }
+
+        char data[capacity];
+        size_t size;
+        size_t header_size; // "*<argc>\r\n"
+        size_t argc;
+    };
+
+    template<size_t N>
+    constexpr command_spec<N> make_command_spec(const char (&name)[N], size_t argc) {
+        return command_spec<N>(name, argc, typename make_spec_indices<command_spec<N>::capacity>::type());
+    }
+
+    // Specs for the commands with a fixed number of arguments. SET, INCR and
+    // LPUSH carry the client and request ids.
+
+    namespace commands {
+        constexpr auto EXISTS = make_command_spec("EXISTS", 2);
+        constexpr auto DEL = make_command_spec("DEL", 2);
+        constexpr auto TYPE = make_command_spec("TYPE", 2);
+        constexpr auto EXPIRE = make_command_spec("EXPIRE", 3);
+        constexpr auto TTL = make_command_spec("TTL", 2);
+        constexpr auto MOVE = make_command_spec("MOVE", 3);
+        constexpr auto RENAME = make_command_spec("RENAME", 3);
+        constexpr auto RENAMENX = make_command_spec("RENAMENX", 3);
+        constexpr auto SELECT = make_command_spec("SELECT", 2);
+
+        constexpr auto GET = make_command_spec("GET", 2);
+        constexpr auto SET = make_command_spec("SET", 5);
+        constexpr auto GETSET = make_command_spec("GETSET", 3);
+        constexpr auto SETNX = make_command_spec("SETNX", 3);
+        constexpr auto SETEX = make_command_spec("SETEX", 4);
+        constexpr auto APPEND = make_command_spec("APPEND", 3);
+        constexpr auto SUBSTR = make_command_spec("SUBSTR", 4);
+        constexpr auto INCR = make_command_spec("INCR", 4);
+        constexpr auto INCRBY = make_command_spec("INCRBY", 3);
+        constexpr auto DECR = make_command_spec("DECR", 2);
+        constexpr auto DECRBY = make_command_spec("DECRBY", 3);
+
+        constexpr auto RPUSH = make_command_spec("RPUSH", 3);
+        constexpr auto LPUSH = make_command_spec("LPUSH", 5);
+        constexpr auto LLEN = make_command_spec("LLEN", 2);
+        constexpr auto LRANGE = make_command_spec("LRANGE", 4);
+        constexpr auto LTRIM = make_command_spec("LTRIM", 4);
+        constexpr auto LINDEX = make_command_spec("LINDEX", 3);
+        constexpr auto LSET = make_command_spec("LSET", 4);
+        constexpr auto LREM = make_command_spec("LREM", 4);
+        constexpr auto LPOP = make_command_spec("LPOP", 2);
+        constexpr auto RPOP = make_command_spec("RPOP", 2);
+
+        constexpr auto SADD = make_command_spec("SADD", 3);
+        constexpr auto SREM = make_command_spec("SREM", 3);
+        constexpr auto SPOP = make_command_spec("SPOP", 2);
+        constexpr auto SMOVE = make_command_spec("SMOVE", 4);
+        constexpr auto SCARD = make_command_spec("SCARD", 2);
+        constexpr auto SISMEMBER = make_command_spec("SISMEMBER", 3);
+        constexpr auto SMEMBERS = make_command_spec("SMEMBERS", 2);
+
+        constexpr auto ZADD = make_command_spec("ZADD", 4);
+        constexpr auto ZREM = make_command_spec("ZREM", 3);
+        constexpr auto ZINCRBY = make_command_spec("ZINCRBY", 4);
+        constexpr auto ZRANK = make_command_spec("ZRANK", 3);
+        constexpr auto ZREVRANK = make_command_spec("ZREVRANK", 3);
+        constexpr auto ZRANGE = make_command_spec("ZRANGE", 4);
+        constexpr auto ZREVRANGE = make_command_spec("ZREVRANGE", 4);
+        constexpr auto ZCARD = make_command_spec("ZCARD", 2);
+        constexpr auto ZSCORE = make_command_spec("ZSCORE", 3);
+        constexpr auto ZCOUNT = make_command_spec("ZCOUNT", 4);
+        constexpr auto ZREMRANGEBYRANK = make_command_spec("ZREMRANGEBYRANK", 4);
+        constexpr auto ZREMRANGEBYSCORE = make_command_spec("ZREMRANGEBYSCORE", 4);
+
+        constexpr auto HSET = make_command_spec("HSET", 4);
+        constexpr auto HSETNX = make_command_spec("HSETNX", 4);
+        constexpr auto HGET = make_command_spec("HGET", 3);
+        constexpr auto HINCRBY = make_command_spec("HINCRBY", 4);
+        constexpr auto HEXISTS = make_command_spec("HEXISTS", 3);
+        constexpr auto HDEL = make_command_spec("HDEL", 3);
+        constexpr auto HLEN = make_command_spec("HLEN", 2);
+        constexpr auto HKEYS = make_command_spec("HKEYS", 2);
+        constexpr auto HVALS = make_command_spec("HVALS", 2);
+        constexpr auto HGETALL = make_command_spec("HGETALL", 2);
+    }
+
+    // Command buffers come from a per-thread pool of power-of-two size
+    // classes, from min_size to max_size, so that commands which outgrow an
+    // inline or kept buffer do not each pay for new[] and delete[]. Released
+    // buffers are kept for reuse, up to max_free per class; larger ones go
+    // straight to the heap. A buffer may be released on another thread than
+    // the one that acquired it.
+
+    class buffer_pool {
     public:
+        static const size_t min_size = 256;
+        static const size_t max_size = 1 << 20;
+        static const size_t max_free = 8;
+
+        struct stats_type {
+            uint64_t hits; // acquire() served from the pool
+            uint64_t misses; // acquire() that allocated
+            uint64_t releases; // Buffers kept for reuse
+            uint64_t drops; // Buffers freed: class full or too large
+        };
 
-        explicit makecmd(const std::string & cmd_name) {
-            append(cmd_name);
-            //if (!finalize)
-            //  buffer_ << " ";
+        // A buffer of at least size bytes; size is set to its capacity.
+        static char * acquire(size_t & size) {
+            buffer_pool * pool = local();
+            if (size > max_size) {
+                if (pool)
+                    ++pool->stats_.misses;
+                return new char[size];
+            }
+            int c = size_class(size);
+            size = min_size << c;
+            if (pool) {
+                std::vector<char *> & free_list = pool->free_[c];
+                if (!free_list.empty()) {
+                    ++pool->stats_.hits;
+                    char * buf = free_list.back();
+                    free_list.pop_back();
+                    return buf;
+                }
+                ++pool->stats_.misses;
+            }
+            return new char[size];
+        }
+
+        // Takes back a buffer of capacity size from acquire().
+        static void release(char * buf, size_t size) {
+            buffer_pool * pool = local();
+            if (pool && size <= max_size) {
+                std::vector<char *> & free_list = pool->free_[size_class(size)];
+                if (free_list.size() < max_free) {
+                    ++pool->stats_.releases;
+                    free_list.push_back(buf);
+                    return;
+                }
+            }
+            if (pool)
+                ++pool->stats_.drops;
+            delete[] buf;
         }
 
-        const std::string & key_name() const {
-            if (!key_name_)
-                throw std::runtime_error("No key defined!");
-            return *key_name_;
+        // Counters of the calling thread's pool.
+        static stats_type stats() {
+            buffer_pool * pool = local();
+            stats_type none = {0, 0, 0, 0};
+            return pool ? pool->stats_ : none;
         }
 
-        inline makecmd & operator<<(const key & datum) {
-            if (key_name_)
-                throw std::runtime_error("You could not add a second key");
-            else
-                key_name_ = datum.name;
-            append(datum.name);
+        static void reset_stats() {
+            buffer_pool * pool = local();
+            if (pool) {
+                stats_type none = {0, 0, 0, 0};
+                pool->stats_ = none;
+            }
+        }
+
+        ~buffer_pool() {
+            destroyed() = true;
+            for (int c = 0; c < class_count; ++c) {
+                for (size_t i = 0; i < free_[c].size(); ++i)
+                    delete[] free_[c][i];
+            }
+        }
+
+    private:
+        static const int class_count = 13; // 256 bytes to 1MB
+
+        buffer_pool() {
+            stats_type none = {0, 0, 0, 0};
+            stats_ = none;
+            for (int c = 0; c < class_count; ++c)
+                free_[c].reserve(max_free);
+        }
+
+        buffer_pool(const buffer_pool &);
+        buffer_pool & operator=(const buffer_pool &);
+
+        // The calling thread's pool, or NULL once it has been destroyed at
+        // thread exit; buffers released later go straight to the heap.
+        static buffer_pool * local() {
+            if (destroyed())
+                return NULL;
+            static thread_local buffer_pool pool;
+            return &pool;
+        }
+
+        static bool & destroyed() {
+            static thread_local bool flag = false;
+            return flag;
+        }
+
+        static int size_class(size_t size) {
+            if (size <= min_size)
+                return 0;
+            return 64 - __builtin_clzll(size - 1) - 8; // log2(min_size)
+        }
+
+        std::vector<char *> free_[class_count];
+        stats_type stats_;
+    };
+
+    // Encodes a command straight into a buffer that is kept from one command
+    // to the next, so that encoding allocates nothing once the buffer has
+    // grown to size. The argument count is only known at the end; it goes
+    // into room left free at the front of the buffer when data() is called,
+    // right before the first argument, so nothing is moved.
+
+    class cmd_encoder {
+    public:
+
+        cmd_encoder() : buf_(NULL), capacity_(0), argc_(0), framed_argc_(0), start_(header_room), end_(header_room) {
+        }
+
+        explicit cmd_encoder(const std::string & cmd_name) : buf_(NULL), capacity_(0), argc_(0), framed_argc_(0), start_(header_room), end_(header_room) {
+            append(cmd_name.data(), cmd_name.size());
+        }
+
+        cmd_encoder(const cmd_encoder & other) : buf_(NULL), capacity_(0), argc_(0), framed_argc_(0), start_(header_room), end_(header_room) {
+            copy_from(other);
+        }
+
+        cmd_encoder & operator=(const cmd_encoder & other) {
+            if (this != &other)
+                copy_from(other);
             return *this;
         }
 
-        inline makecmd & operator<<(const std::string & datum) {
-            append(datum);
+        cmd_encoder(cmd_encoder && other) : buf_(NULL), capacity_(0), argc_(0), framed_argc_(0), start_(header_room), end_(header_room) {
+            swap(other);
+        }
+
+        cmd_encoder & operator=(cmd_encoder && other) {
+            swap(other);
             return *this;
         }
 
-        template <typename T>
-        makecmd & operator<<(T const & datum) {
-            append(boost::lexical_cast<std::string>(datum));
+        void swap(cmd_encoder & other) {
+            std::swap(buf_, other.buf_);
+            std::swap(capacity_, other.capacity_);
+            std::swap(argc_, other.argc_);
+            std::swap(framed_argc_, other.framed_argc_);
+            std::swap(start_, other.start_);
+            std::swap(end_, other.end_);
+        }
+
+        ~cmd_encoder() {
+            if (buf_)
+                buffer_pool::release(buf_, capacity_);
+        }
+
+        // Drops the previous command and starts a new one.
+        cmd_encoder & begin(const char * cmd_name, size_t len) {
+            if (capacity_ > retain_limit)
+                drop_buffer();
+            argc_ = 0;
+            framed_argc_ = 0;
+            start_ = end_ = header_room;
+            return append(cmd_name, len);
+        }
+
+        // Starts a new command from a command_spec. Its header is kept unless
+        // the command ends up with a different number of arguments.
+        template<size_t N>
+        cmd_encoder & begin(const command_spec<N> & spec) {
+            if (capacity_ > retain_limit)
+                drop_buffer();
+            start_ = end_ = header_room - spec.header_size;
+            memcpy(reserve(spec.size), spec.data, spec.size);
+            end_ += spec.size;
+            argc_ = 1;
+            framed_argc_ = spec.argc;
+            return *this;
+        }
+
+        // Encoded size of an argument of size bytes: "$<size>\r\n<data>\r\n".
+        static size_t bulk_size(size_t size) {
+            return decimal_digits(size) + size + 5;
+        }
+
+        // Makes room for bytes more of encoded arguments, e.g. the sum of
+        // bulk_size() over the arguments of a command, so that the buffer
+        // grows at most once while they are appended.
+        cmd_encoder & expect(size_t bytes) {
+            reserve(bytes);
             return *this;
         }
 
-        makecmd & operator<<(const std::vector<std::string> & data) {
-            lines_.insert(lines_.end(), data.begin(), data.end());
+        cmd_encoder & append(const char * value, size_t size) {
+            char * p = reserve(bulk_size(size));
+            *p++ = REDIS_PREFIX_SINGLE_BULK_REPLY;
+            p = format_number(p, static_cast<unsigned long long> (size));
+            *p++ = '\r';
+            *p++ = '\n';
+            memcpy(p, value, size);
+            p += size;
+            *p++ = '\r';
+            *p++ = '\n';
+            end_ = p - buf_;
+            ++argc_;
             return *this;
         }
 
+        cmd_encoder & operator<<(const std::string & value) {
+            return append(value.data(), value.size());
+        }
+
+        cmd_encoder & operator<<(const char * value) {
+            return append(value, strlen(value));
+        }
+
+        cmd_encoder & operator<<(const key & datum) {
+            return append(datum.name.data(), datum.name.size());
+        }
+
+        cmd_encoder & operator<<(int datum) {
+            return append_signed(datum);
+        }
+
+        cmd_encoder & operator<<(long datum) {
+            return append_signed(datum);
+        }
+
+        cmd_encoder & operator<<(long long datum) {
+            return append_signed(datum);
+        }
+
+        cmd_encoder & operator<<(unsigned datum) {
+            return append_unsigned(datum);
+        }
+
+        cmd_encoder & operator<<(unsigned long datum) {
+            return append_unsigned(datum);
+        }
+
+        cmd_encoder & operator<<(unsigned long long datum) {
+            return append_unsigned(datum);
+        }
+
+        // Shortest form that reads back as datum; see format_number().
+        cmd_encoder & operator<<(double datum) {
+            char buf[32];
+            return append(buf, format_number(buf, datum) - buf);
+        }
+
         template <typename T>
-        makecmd & operator<<(const std::vector<T> & data) {
-            size_t n = data.size();
-            for (size_t i = 0; i < n; ++i) {
-                append(boost::lexical_cast<std::string>(data[i]));
-                //if (i < n - 1)
-                //  buffer_ << " ";
-            }
+        cmd_encoder & operator<<(const std::vector<T> & data) {
+            for (size_t i = 0; i < data.size(); ++i)
+                *this << data[i];
             return *this;
         }
 
-        operator std::string() const {
-            std::ostringstream oss;
-            size_t n = lines_.size();
-            oss << REDIS_PREFIX_MULTI_BULK_REPLY << n << REDIS_LBR;
+        // Client and request ids go in the compact base64 form that the
+        // server expects for them.
+        cmd_encoder & append_id(uint64_t id) {
+            char buf[16];
+            int len = ulltoa64_custom(buf, sizeof(buf), id);
+            return append(buf, len);
+        }
 
-            for (size_t i = 0; i < n; ++i) {
-                const std::string & param = lines_[i];
-                oss << REDIS_PREFIX_SINGLE_BULK_REPLY << param.size() << REDIS_LBR;
-                oss << param << REDIS_LBR;
-            }
+        size_t argc() const {
+            return argc_;
+        }
+
+        // The encoded command; valid until the encoder is changed.
+        const char * data() {
+            finish();
+            return buf_ + start_;
+        }
+
+        size_t size() {
+            finish();
+            return end_ - start_;
+        }
+
+        // NUL-terminated data(), for diagnostics.
+        const char * c_str() {
+            reserve(1)[0] = '\0';
+            return data();
+        }
 
-            return oss.str();
+        void append_to(std::string & out) const {
+            char header[header_room];
+            char * p = header;
+            *p++ = REDIS_PREFIX_MULTI_BULK_REPLY;
+            p = format_number(p, static_cast<unsigned long long> (argc_));
+            *p++ = '\r';
+            *p++ = '\n';
+            out.append(header, p - header);
+            if (end_ > header_room)
+                out.append(buf_ + header_room, end_ - header_room);
         }
 
     private:
+        // "*<count>\r\n" with a count of up to 20 digits.
+        static const size_t header_room = 24;
+        static const size_t retain_limit = 1 << 20;
+
+        char * reserve(size_t n) {
+            if (end_ + n > capacity_) {
+                size_t size = std::max(capacity_ * 2, end_ + n);
+                char * buf = buffer_pool::acquire(size);
+                if (buf_) {
+                    memcpy(buf, buf_, end_);
+                    buffer_pool::release(buf_, capacity_);
+                }
+                buf_ = buf;
+                capacity_ = size;
+            }
+            return buf_ + end_;
+        }
 
-        void append(const std::string & param) {
-            lines_.push_back(param);
+        void drop_buffer() {
+            buffer_pool::release(buf_, capacity_);
+            buf_ = NULL;
+            capacity_ = 0;
         }
 
-        std::vector<std::string> lines_;
-        boost::optional<std::string> key_name_;
+        void copy_from(const cmd_encoder & other) {
+            if (capacity_ < other.end_) {
+                if (buf_)
+                    drop_buffer();
+                size_t size = other.end_;
+                buf_ = buffer_pool::acquire(size);
+                capacity_ = size;
+            }
+            if (other.end_ > 0 && other.buf_)
+                memcpy(buf_, other.buf_, other.end_);
+            argc_ = other.argc_;
+            framed_argc_ = other.framed_argc_;
+            start_ = other.start_;
+            end_ = other.end_;
+        }
+
+        void finish() {
+            if (argc_ == framed_argc_)
+                return;
+            framed_argc_ = argc_;
+            reserve(0);
+            char header[header_room];
+            char * p = header;
+            *p++ = REDIS_PREFIX_MULTI_BULK_REPLY;
+            p = format_number(p, static_cast<unsigned long long> (argc_));
+            *p++ = '\r';
+            *p++ = '\n';
+            start_ = header_room - (p - header);
+            memcpy(buf_ + start_, header, p - header);
+        }
+
+        cmd_encoder & append_signed(long long datum) {
+            char buf[24];
+            return append(buf, format_number(buf, datum) - buf);
+        }
+
+        cmd_encoder & append_unsigned(unsigned long long datum) {
+            char buf[24];
+            return append(buf, format_number(buf, datum) - buf);
+        }
+
+        char * buf_;
+        size_t capacity_;
+        size_t argc_;
+        size_t framed_argc_; // Argument count in the header at start_.
+        size_t start_;
+        size_t end_;
     };
 
-    class fastcmd {
+    // A command built up by the caller, e.g. for base_client::exec(). It is
+    // encoded as it is built, by a cmd_encoder of its own.
+
+    class makecmd {
     public:
 
-        explicit fastcmd(int argc, const std::string & cmd_name) {
-            strbuf = inlineBuf;
-            bufSize = inlineBufSize;
-            strbuf[0] = '*';
-            appended = 1;
-            char* buf = strbuf + appended;
-            itoa_custom(argc, buf, 10);
-            buf += strlen(buf);
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
-
-            itoa_custom(cmd_name.length(), buf, 10);
-            buf += strlen(buf);
-            memcpy(buf, newline, 2);
-            buf += 2;
-            memcpy(buf, cmd_name.data(), cmd_name.length());
-            buf += cmd_name.length();
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
-            appended = buf - strbuf;
-        }
-
-        ~fastcmd() {
-            destroy();
-        }
-
-        inline fastcmd& append(const char* value, int size) {
-            ensureSpace(size + 15);
-            char* buf = strbuf + appended;
-
-            itoa_custom(size, buf, 10);
-            buf += strlen(buf);
-            memcpy(buf, newline, 2);
-            buf += 2;
-            memcpy(buf, value, size);
-            buf += size;
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
-
-            appended = buf - strbuf;
-            return *this;
+        explicit makecmd(const std::string & cmd_name) : encoder_(cmd_name) {
         }
 
-        inline fastcmd& operator<<(const std::string& value) {
-            ensureSpace(value.length() + 15);
-            char* buf = strbuf + appended;
+        const std::string & key_name() const {
+            if (!key_name_)
+                throw std::runtime_error("No key defined!");
+            return *key_name_;
+        }
 
-            itoa_custom(value.length(), buf, 10);
-            buf += strlen(buf);
-            memcpy(buf, newline, 2);
-            buf += 2;
-            memcpy(buf, value.data(), value.length());
-            buf += value.length();
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
+        inline makecmd & operator<<(const key & datum) {
+            if (key_name_)
+                throw std::runtime_error("You could not add a second key");
+            else
+                key_name_ = datum.name;
+            encoder_ << datum;
+            return *this;
+        }
 
-            appended = buf - strbuf;
+        template <typename T>
+        makecmd & operator<<(T const & datum) {
+            encoder_ << datum;
             return *this;
         }
 
-        inline fastcmd& operator<<(const uint64_t datum) {
-            ensureSpace(30);
-            char* buf = strbuf + appended;
-            char* bufPosForIntLen = buf;
-            if (datum >= 0x40000000000000) { // TODO: check for correct number.
-                buf += 4; // 2 for int value, 2 for \r\n
+        operator std::string() const {
+            std::string out;
+            encoder_.append_to(out);
+            return out;
+        }
+
+        const cmd_encoder & encoder() const {
+            return encoder_;
+        }
+
+    private:
+        cmd_encoder encoder_;
+        boost::optional<std::string> key_name_;
+    };
+
+    // Scatter-gather command encoding for commands with large arguments.
+    // Framing and small arguments are encoded into a header buffer, while
+    // arguments of reference_threshold bytes or more are only referenced
+    // where they live and are sent with writev(), so their payload is never
+    // copied. Referenced arguments must outlive the command. Arguments can
+    // also be taken from a file descriptor and are then sent with sendfile().
+    //
+    // data() and size() give the flat encoding, as cmd_encoder does, for callers
+    // that need one (witness records, logging). It is built on first use.
+
+    class iovcmd {
+    public:
+        static const size_t reference_threshold = 4096;
+
+        explicit iovcmd(int argc, const std::string & cmd_name) : header_start_(0) {
+            char buf[32];
+            header_ += '*';
+            itoa_custom(argc, buf, 10);
+            header_ += buf;
+            header_ += "\r\n";
+            append(cmd_name.data(), cmd_name.size());
+        }
+
+        iovcmd & append(const char * value, size_t size) {
+            char buf[32];
+            header_ += '$';
+            ulltoa_custom(size, buf, 10);
+            header_ += buf;
+            header_ += "\r\n";
+            if (size >= reference_threshold) {
+                cut_header();
+                segment ref = {value, 0, size, -1};
+                segments_.push_back(ref);
             } else {
-                buf += 3; // 1 for int value, 2 for \r\n
+                header_.append(value, size);
             }
+            header_ += "\r\n";
+            return *this;
+        }
 
-            ulltoa64_custom(buf, 30 - 4, datum);
-//            ulltoa(datum, buf, 10);
-            int datumLen = strlen(buf);
-            buf += datumLen;
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
-
-            itoa_custom(datumLen, bufPosForIntLen, 10);
-            bufPosForIntLen += strlen(bufPosForIntLen);
-            memcpy(bufPosForIntLen, newline, 2);
+        iovcmd & operator<<(const std::string & value) {
+            return append(value.data(), value.size());
+        }
 
-            appended = buf - strbuf;
+        // Adds an argument made of size bytes of fd starting at offset. The
+        // file offset of fd is not used or changed.
+        iovcmd & append_fd(int fd, off_t offset, size_t size) {
+            char buf[32];
+            header_ += '$';
+            ulltoa_custom(size, buf, 10);
+            header_ += buf;
+            header_ += "\r\n";
+            cut_header();
+            segment ref = {NULL, static_cast<size_t> (offset), size, fd};
+            segments_.push_back(ref);
+            header_ += "\r\n";
             return *this;
         }
 
-        inline fastcmd& operator<<(const int datum) {
-            ensureSpace(20);
-            char* buf = strbuf + appended;
-            char* bufPosForIntLen = buf;
-            if (datum < 0) {
-                fprintf(stderr, "negative integer is not supported in fast cmd.");
-                exit(1);
-            }
-            if (datum >= 1000000000) {
-                buf += 4; // 2 for int value, 2 for \r\n
-            } else {
-                buf += 3; // 1 for int value, 2 for \r\n
-            }
+        // Base64 encoded, as cmd_encoder::append_id() does.
+        iovcmd & append_id(uint64_t id) {
+            char buf[32];
+            ulltoa64_custom(buf, sizeof(buf), id);
+            return append_small(buf);
+        }
 
-            itoa_custom(datum, buf, 10);
-            int datumLen = strlen(buf);
-            buf += datumLen;
-            memcpy(buf, newlineDollar, 3);
-            buf += 3;
+        iovcmd & operator<<(int datum) {
+            return append_signed(datum);
+        }
 
-            itoa_custom(datumLen, bufPosForIntLen, 10);
-            bufPosForIntLen += strlen(bufPosForIntLen);
-            memcpy(bufPosForIntLen, newline, 2);
+        iovcmd & operator<<(long datum) {
+            return append_signed(datum);
+        }
 
-            appended = buf - strbuf;
-            return *this;
+        iovcmd & operator<<(long long datum) {
+            return append_signed(datum);
         }
 
-        char* c_str() {
-            strbuf[appended - 1] = 0;
-            return strbuf;
+        iovcmd & operator<<(unsigned datum) {
+            return append_unsigned(datum);
         }
-        int size() {
-            return appended - 1; // Don't count tailing '$'.
+
+        iovcmd & operator<<(unsigned long datum) {
+            return append_unsigned(datum);
+        }
+
+        iovcmd & operator<<(unsigned long long datum) {
+            return append_unsigned(datum);
+        }
+
+        // Writes the command to socket: runs of memory buffers with one
+        // writev() each, file arguments with sendfile(). Returns false with
+        // errno set on failure.
+        bool write_to(int socket) {
+            cut_header();
+            std::vector<iovec> iov;
+            iov.reserve(segments_.size());
+            for (size_t i = 0; i <= segments_.size(); ++i) {
+                if (i == segments_.size() || segments_[i].fd != -1) {
+                    if (!iov.empty() && anetWritev(socket, iov.data(), iov.size()) == -1)
+                        return false;
+                    iov.clear();
+                    if (i == segments_.size())
+                        break;
+                    const segment & seg = segments_[i];
+                    long sent = anetSendFile(socket, seg.fd, seg.offset, seg.len);
+                    if (sent == -1)
+                        return false;
+                    if (static_cast<size_t> (sent) != seg.len) {
+                        errno = EIO; // The file is shorter than announced.
+                        return false;
+                    }
+                    continue;
+                }
+                iov.push_back(memory(segments_[i]));
+            }
+            return true;
         }
+
         char* data() {
-            return strbuf;
+            flatten();
+            return &flat_[0];
+        }
+
+        int size() {
+            flatten();
+            return flat_.size();
+        }
+
+        char* c_str() {
+            flatten();
+            return &flat_[0];
         }
 
     private:
-        inline void ensureSpace(int size) {
-            if (appended + size > bufSize) {
-                char* newBuf = new char[bufSize * 2];
-                memcpy(newBuf, strbuf, appended);
-                destroy();
-                strbuf = newBuf;
-                bufSize = bufSize * 2;
-            }
+
+        // A referenced argument, a span of header_ if ptr is NULL, or a part
+        // of a file starting at offset if fd is not -1.
+        struct segment {
+            const char * ptr;
+            size_t offset;
+            size_t len;
+            int fd;
+        };
+
+        iovec memory(const segment & seg) {
+            iovec v;
+            v.iov_base = const_cast<char *> (seg.ptr != NULL ? seg.ptr : header_.data() + seg.offset);
+            v.iov_len = seg.len;
+            return v;
         }
 
-        void destroy() {
-            if (strbuf != inlineBuf) {
-                delete[] strbuf;
-            }
+        iovcmd & append_small(const char * value) {
+            return append(value, strlen(value));
+        }
+
+        iovcmd & append_signed(long long datum) {
+            char buf[24];
+            return append(buf, format_number(buf, datum) - buf);
+        }
+
+        iovcmd & append_unsigned(unsigned long long datum) {
+            char buf[24];
+            return append(buf, format_number(buf, datum) - buf);
         }
 
+        // Ends the current span of header_ so that a referenced argument can
+        // follow it.
+        void cut_header() {
+            if (header_.size() > header_start_) {
+                segment span = {NULL, header_start_, header_.size() - header_start_, -1};
+                segments_.push_back(span);
+                header_start_ = header_.size();
+            }
+        }
 
-        char* strbuf;
-        int bufSize;
-        int appended = 0;
-        char inlineBuf[1000];
-        const static int inlineBufSize = 1000;
+        void flatten() {
+            if (!flat_.empty())
+                return;
+            cut_header();
+            for (size_t i = 0; i < segments_.size(); ++i) {
+                const segment & seg = segments_[i];
+                if (seg.fd == -1) {
+                    iovec v = memory(seg);
+                    flat_.append(static_cast<const char *> (v.iov_base), v.iov_len);
+                    continue;
+                }
+                size_t start = flat_.size();
+                flat_.resize(start + seg.len);
+                for (size_t done = 0; done < seg.len;) {
+                    ssize_t n = pread(seg.fd, &flat_[start + done], seg.len - done, seg.offset + done);
+                    if (n == -1 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        throw redis_error("could not read command argument from file");
+                    done += n;
+                }
+            }
+        }
 
-        static constexpr const char* newline = "\r\n";
-        static constexpr const char* newlineDollar = "\r\n$";
+        std::string header_;
+        size_t header_start_; // Start of the span not yet in segments_.
+        std::vector<segment> segments_;
+        std::string flat_;
     };
 
     template<typename CONSISTENT_HASHER>
     class base_client;
 
+    template<typename CONSISTENT_HASHER>
+    class base_pipeline;
+
     typedef boost::variant< std::string, int, std::vector<std::string> > reply_val_t;
     typedef std::pair<reply_t, reply_val_t> reply_data_t;
 
@@ -555,18 +1491,705 @@ namespace redis {
         return bytes_received;
     }
 
-    // You should construct a 'client' object per connection to a redis-server.
-    //
-    // Please read the online redis command reference:
-    // http://code.google.com/p/redis/wiki/CommandReference
-    //
-    // No provisions for customizing the allocator on the string/bulk value type
-    // (std::string) are provided.  If needed, you can always change the
-    // string_type typedef in your local version.
+    // Returns a pointer to the first '\n' in [p, p + n), or NULL. Scans 32 or
+    // 16 bytes at a time when built with AVX2 (e.g. -march=native) or SSE2,
+    // which x86-64 always has; short tails are scanned bytewise, which beats
+    // a memchr() call for the few bytes of a typical reply header.
+
+    inline const char * find_eol(const char * p, size_t n) {
+        const char * end = p + n;
+#if defined(__AVX2__)
+        const __m256i lf32 = _mm256_set1_epi8('\n');
+        for (; end - p >= 32; p += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *> (p));
+            unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, lf32));
+            if (mask != 0)
+                return p + __builtin_ctz(mask);
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i lf = _mm_set1_epi8('\n');
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *> (p));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf));
+            if (mask != 0)
+                return p + __builtin_ctz(mask);
+        }
+#endif
+        for (; p < end; ++p) {
+            if (*p == '\n')
+                return p;
+        }
+        return NULL;
+    }
 
-    template<typename CONSISTENT_HASHER>
-    class base_client {
-    private:
+    // Number parsing in the manner of C++17's std::from_chars, for C++11: it
+    // works on raw reply bytes in place, without temporary strings, locales
+    // or exceptions. Each parse_number() returns false unless all of
+    // [first, last) is a number that fits into value, which is left alone
+    // then.
+
+    // Parses the magnitude of a run of decimal digits of at most limit.
+    inline bool parse_digits(const char * first, const char * last,
+            unsigned long long limit, unsigned long long & value) {
+        if (first == last)
+            return false;
+
+        unsigned long long v = 0;
+        if (last - first <= 18) {
+            // 18 digits can't overflow, so check the range once at the end.
+            for (; first != last; ++first) {
+                unsigned digit = static_cast<unsigned char> (*first) - '0';
+                if (digit > 9)
+                    return false;
+                v = v * 10 + digit;
+            }
+            if (v > limit)
+                return false;
+        } else {
+            for (; first != last; ++first) {
+                unsigned digit = static_cast<unsigned char> (*first) - '0';
+                if (digit > 9 || v > (limit - digit) / 10)
+                    return false;
+                v = v * 10 + digit;
+            }
+        }
+        value = v;
+        return true;
+    }
+
+    inline bool parse_number(const char * first, const char * last, long long & value) {
+        bool negative = first != last && *first == '-';
+        unsigned long long magnitude;
+        if (!parse_digits(first + (negative ? 1 : 0), last,
+                negative ? 0ULL - LLONG_MIN : LLONG_MAX, magnitude))
+            return false;
+        value = negative ? static_cast<long long> (0ULL - magnitude) : static_cast<long long> (magnitude);
+        return true;
+    }
+
+    inline bool parse_number(const char * first, const char * last, unsigned long long & value) {
+        return parse_digits(first, last, ULLONG_MAX, value);
+    }
+
+    template<typename INT>
+    bool parse_number(const char * first, const char * last, INT & value) {
+        static_assert(std::numeric_limits<INT>::is_integer, "parse_number() needs an integer or double");
+        if (std::numeric_limits<INT>::is_signed) {
+            long long v;
+            if (!parse_number(first, last, v)
+                    || v < static_cast<long long> (std::numeric_limits<INT>::min())
+                    || v > static_cast<long long> (std::numeric_limits<INT>::max()))
+                return false;
+            value = static_cast<INT> (v);
+        } else {
+            unsigned long long v;
+            if (!parse_number(first, last, v)
+                    || v > static_cast<unsigned long long> (std::numeric_limits<INT>::max()))
+                return false;
+            value = static_cast<INT> (v);
+        }
+        return true;
+    }
+
+    // Scores and other doubles. Numbers with at most 53 bits of significant
+    // digits and a decimal exponent within 22 are converted exactly with a
+    // single multiplication or division (Clinger's fast path); everything
+    // else, including "inf", goes through strtod().
+    inline bool parse_number(const char * first, const char * last, double & value) {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const unsigned long long max_mantissa = 1ULL << 53;
+
+        const char * p = first;
+        bool negative = p != last && *p == '-';
+        if (p != last && (*p == '-' || *p == '+'))
+            ++p;
+
+        unsigned long long mantissa = 0;
+        int exponent = 0;
+        bool fast = true;
+        bool digits = false;
+        for (; p != last && fast; ++p) {
+            unsigned digit = static_cast<unsigned char> (*p) - '0';
+            if (digit > 9)
+                break;
+            digits = true;
+            fast = mantissa <= (max_mantissa - digit) / 10;
+            mantissa = mantissa * 10 + digit;
+        }
+        if (fast && p != last && *p == '.') {
+            // Trailing zeros of the fraction don't count against the limit.
+            int zeros = 0;
+            for (++p; p != last && fast; ++p) {
+                unsigned digit = static_cast<unsigned char> (*p) - '0';
+                if (digit > 9)
+                    break;
+                digits = true;
+                if (digit == 0) {
+                    ++zeros;
+                    continue;
+                }
+                for (; zeros > 0 && fast; --zeros, --exponent) {
+                    fast = mantissa <= max_mantissa / 10;
+                    mantissa *= 10;
+                }
+                fast = fast && mantissa <= (max_mantissa - digit) / 10;
+                mantissa = mantissa * 10 + digit;
+                --exponent;
+            }
+        }
+        if (fast && digits && p != last && (*p == 'e' || *p == 'E')) {
+            const char * exp_end = p + 1;
+            while (exp_end != last && (static_cast<unsigned> (static_cast<unsigned char> (*exp_end) - '0') <= 9
+                    || *exp_end == '-' || *exp_end == '+'))
+                ++exp_end;
+            int e;
+            if (exp_end - p > 5 || !parse_number(*(p + 1) == '+' ? p + 2 : p + 1, exp_end, e))
+                fast = false;
+            else
+                exponent += e;
+            p = exp_end;
+        }
+
+        if (fast && digits && p == last && exponent >= -22 && exponent <= 22) {
+            double d = static_cast<double> (mantissa);
+            d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+            value = negative ? -d : d;
+            return true;
+        }
+
+        // strtod() needs a terminated string and is more lenient than
+        // from_chars; reject what it would otherwise accept.
+        size_t len = last - first;
+        if (len == 0 || isspace(static_cast<unsigned char> (*first))
+                || std::find(first, last, 'x') != last || std::find(first, last, 'X') != last)
+            return false;
+        char buf[64];
+        std::string long_buf;
+        char * str = buf;
+        if (len >= sizeof(buf)) {
+            long_buf.assign(first, last);
+            str = &long_buf[0];
+        } else {
+            memcpy(buf, first, len);
+            buf[len] = '\0';
+        }
+        char * end;
+        errno = 0;
+        double d = strtod(str, &end);
+        if (end != str + len || (errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL)))
+            return false;
+        value = d;
+        return true;
+    }
+
+    // Parses an integer that spans all of [s, s + len) and throws
+    // protocol_error if it is malformed or out of range.
+
+    inline long long parse_decimal(const char * s, size_t len) {
+        long long value;
+        if (!parse_number(s, s + len, value))
+            throw protocol_error("invalid integer in reply");
+        return value;
+    }
+
+    // Parses a "<prefix><integer>\r\n" header at p, as sent for bulk lengths,
+    // multi bulk counts and integer replies. Digits are accumulated while
+    // looking for the CR, so the line is not searched separately. Returns a
+    // pointer past the header, or NULL if it is not complete before end.
+
+    inline const char * scan_header(const char * p, const char * end, long long & value) {
+        const char * q = p + 1;
+        bool negative = q < end && *q == '-';
+        if (negative)
+            ++q;
+
+        const char * digits = q;
+        unsigned long long v = 0;
+        unsigned digit;
+        while (q < end && (digit = static_cast<unsigned char> (*q) - '0') <= 9) {
+            v = v * 10 + digit;
+            ++q;
+        }
+
+        if (q < end && *q != '\r')
+            throw protocol_error("invalid integer in reply");
+        if (end - q < 2)
+            return NULL;
+        if (q == digits || q[1] != '\n')
+            throw protocol_error("invalid integer in reply");
+
+        if (q - digits > 18)
+            value = parse_decimal(p + 1, q - p - 1); // Range checked.
+        else
+            value = negative ? -static_cast<long long> (v) : static_cast<long long> (v);
+        return q + 2;
+    }
+
+    // A complete reply of any type as produced by reply_parser. Elements of a
+    // multi bulk reply are replies themselves, so nested replies (e.g. EXEC)
+    // are represented as well.
+
+    struct reply {
+
+        reply() : type(no_reply), integer(0), nil(false) {
+        }
+
+        reply_t type;
+        std::string str; // Status, error (without '-') or bulk data.
+        long long integer; // Integer reply.
+        bool nil; // Nil bulk or nil multi bulk reply.
+        std::vector<reply> elements; // Multi bulk reply.
+    };
+
+    // Resumable parser for the redis protocol. It is fed chunks of any size,
+    // down to a single byte, and keeps its position within a reply between
+    // calls, so it works the same on top of blocking, non-blocking or batched
+    // I/O. It never touches a socket itself.
+
+    class reply_parser {
+    public:
+
+        reply_parser() : state_(state_type), prefix_(0), remaining_(0), done_(false) {
+        }
+
+        // Consumes data until one complete reply was parsed or all of data was
+        // consumed, and returns the number of bytes consumed. Bytes following a
+        // complete reply are left to the caller and must be fed again after the
+        // reply was taken. Throws protocol_error on malformed input.
+        size_t feed(const char * data, size_t len) {
+            const char * p = data;
+            const char * end = data + len;
+
+            while (p < end && !done_) {
+                switch (state_) {
+                    case state_type:
+                        prefix_ = *p++;
+                        line_.clear();
+                        state_ = state_line;
+                        break;
+
+                    case state_line:
+                    {
+                        const char * eol = find_eol(p, end - p);
+                        if (eol == NULL) {
+                            line_.append(p, end);
+                            p = end;
+                            break;
+                        }
+                        // Only lines split across chunks are copied.
+                        const char * line = p;
+                        size_t line_len = eol - p;
+                        if (!line_.empty()) {
+                            line_.append(p, eol);
+                            line = line_.data();
+                            line_len = line_.size();
+                        }
+                        p = eol + 1;
+                        if (line_len > 0 && line[line_len - 1] == '\r')
+                            --line_len;
+                        on_line(line, line_len);
+                        break;
+                    }
+
+                    case state_bulk:
+                    {
+                        size_t n = std::min(remaining_, static_cast<size_t> (end - p));
+                        cur_.str.append(p, n);
+                        p += n;
+                        remaining_ -= n;
+                        if (remaining_ == 0)
+                            state_ = state_crlf;
+                        break;
+                    }
+
+                    case state_crlf:
+                        if (*p++ != REDIS_LBR[remaining_])
+                            throw protocol_error("invalid bulk reply data; missing CRLF");
+                        if (++remaining_ == 2)
+                            complete();
+                        break;
+                }
+            }
+
+            return p - data;
+        }
+
+        // True once a complete reply can be taken.
+        bool has_reply() const {
+            return done_;
+        }
+
+        // Hands out the parsed reply and readies the parser for the next one.
+        reply take() {
+            assert(done_);
+            done_ = false;
+            return std::move(result_);
+        }
+
+        // Drops a partially parsed reply, e.g. after the connection was reset.
+        void reset() {
+            state_ = state_type;
+            cur_ = reply();
+            stack_.clear();
+            done_ = false;
+        }
+
+    private:
+
+        enum state {
+            state_type,
+            state_line,
+            state_bulk,
+            state_crlf
+        };
+
+        struct frame {
+            reply r;
+            long long remaining;
+        };
+
+        void on_line(const char * line, size_t len) {
+            switch (prefix_) {
+                case REDIS_PREFIX_STATUS_REPLY_VALUE:
+                case REDIS_PREFIX_STATUS_REPLY_UNSYNCED:
+                    cur_.type = status_code_reply;
+                    cur_.str.assign(line, len);
+                    complete();
+                    break;
+
+                case REDIS_PREFIX_STATUS_REPLY_ERR_C:
+                    cur_.type = error_reply;
+                    cur_.str.assign(line, len);
+                    complete();
+                    break;
+
+                case REDIS_PREFIX_INT_REPLY:
+                    cur_.type = int_reply;
+                    cur_.integer = parse_decimal(line, len);
+                    complete();
+                    break;
+
+                case REDIS_PREFIX_SINGLE_BULK_REPLY:
+                {
+                    cur_.type = bulk_reply;
+                    long long length = parse_decimal(line, len);
+                    if (length == -1) {
+                        cur_.nil = true;
+                        complete();
+                    } else if (length < 0) {
+                        throw protocol_error("invalid bulk reply; negative length");
+                    } else {
+                        cur_.str.reserve(length);
+                        remaining_ = length;
+                        state_ = length > 0 ? state_bulk : state_crlf;
+                    }
+                    break;
+                }
+
+                case REDIS_PREFIX_MULTI_BULK_REPLY:
+                {
+                    cur_.type = multi_bulk_reply;
+                    long long count = parse_decimal(line, len);
+                    if (count == -1) {
+                        cur_.nil = true;
+                        complete();
+                    } else if (count < 0) {
+                        throw protocol_error("invalid multi bulk reply; negative count");
+                    } else if (count == 0) {
+                        complete();
+                    } else {
+                        // Don't trust the count too much before data arrives.
+                        cur_.elements.reserve(std::min(count, 64 * 1024LL));
+                        frame f;
+                        f.r = std::move(cur_);
+                        f.remaining = count;
+                        stack_.push_back(std::move(f));
+                        cur_ = reply();
+                        state_ = state_type;
+                    }
+                    break;
+                }
+
+                default:
+                    throw protocol_error("invalid/unknown reply type from redis server");
+            }
+        }
+
+        // Attaches the current reply to its enclosing multi bulk reply, if
+        // any, completing enclosing replies as their last element arrives.
+        void complete() {
+            reply r(std::move(cur_));
+            cur_ = reply();
+            state_ = state_type;
+
+            while (!stack_.empty()) {
+                frame & top = stack_.back();
+                top.r.elements.push_back(std::move(r));
+                if (--top.remaining > 0)
+                    return;
+                r = std::move(top.r);
+                stack_.pop_back();
+            }
+
+            result_ = std::move(r);
+            done_ = true;
+        }
+
+        state state_;
+        char prefix_;
+        std::string line_; // Header line split across chunks.
+        size_t remaining_; // Bulk bytes left, or CRLF bytes seen.
+        reply cur_;
+        std::vector<frame> stack_; // Enclosing multi bulk replies.
+        reply result_;
+        bool done_;
+    };
+
+    // Receive buffer owned by each connection. Replies are drained from the
+    // socket in large reads and lines and bulk data are served from memory,
+    // so a typical reply costs a single recv() instead of a MSG_PEEK/recv
+    // pair per 64 bytes. Lines are not limited in length.
+    //
+    // Data handed out by read_view() is pinned: it is neither moved nor freed
+    // until unpin() is called, which base_client does whenever the next
+    // command is sent over the connection.
+    //
+    // Multi bulk replies may also be read lazily, one element at a time (see
+    // base_client::string_range). Elements the reader did not get to are
+    // counted here and skipped by skip_unread() before the next command.
+
+    class recv_buffer {
+    public:
+
+        explicit recv_buffer(size_t initial_size = 16 * 1024)
+        : buf_(initial_size), begin_(0), end_(0), pinned_(false),
+        unread_elements_(0), lazy_id_(0) {
+        }
+
+        // Number of received bytes that were not consumed yet.
+        size_t size() const {
+            return end_ - begin_;
+        }
+
+        void clear() {
+            begin_ = end_ = 0;
+        }
+
+        // Returns the next byte without consuming it.
+        char peek(int socket) {
+            if (begin_ == end_)
+                fill(socket, 1);
+            return buf_[begin_];
+        }
+
+        // Reads a single line and returns a pointer to it; len is set to its
+        // length without the EOL delimiter. Both LF and CRLF are supported.
+        // The line stays valid until the next call on this buffer.
+        const char * read_line(int socket, size_t & len) {
+            size_t scanned = 0;
+            const char * eol;
+            while ((eol = find_eol(buf_.data() + begin_ + scanned, size() - scanned)) == NULL) {
+                scanned = size();
+                fill(socket, scanned + 1);
+            }
+
+            const char * line = buf_.data() + begin_;
+            len = eol - line;
+            begin_ += len + 1;
+            while (len > 0 && line[len - 1] == '\r')
+                --len;
+            return line;
+        }
+
+        // Passes the next n bytes to sink in chunks of at most the buffer size,
+        // so data of any length is received without further allocation.
+        template<typename SINK>
+        void read_chunks(int socket, size_t n, SINK & sink) {
+            while (n > 0) {
+                if (begin_ == end_)
+                    fill(socket, 1);
+                size_t chunk = std::min(n, size());
+                sink(buf_.data() + begin_, chunk);
+                begin_ += chunk;
+                n -= chunk;
+            }
+        }
+
+        // Reads a header such as "$5\r\n" and stores its integer in value.
+        // Returns false without consuming anything if the next reply starts
+        // with a different prefix.
+        bool read_header(int socket, char prefix, long long & value) {
+            for (;;) {
+                const char * p = buf_.data() + begin_;
+                const char * end = buf_.data() + end_;
+                if (p != end) {
+                    if (*p != prefix)
+                        return false;
+                    const char * next = scan_header(p, end, value);
+                    if (next != NULL) {
+                        begin_ += next - p;
+                        return true;
+                    }
+                }
+                fill(socket, size() + 1);
+            }
+        }
+
+        // Copies the next n bytes to dst. Data beyond what is already buffered
+        // is received directly into dst if it would not fit into the buffer.
+        void read_n(int socket, char * dst, size_t n) {
+            size_t buffered = std::min(n, size());
+            memcpy(dst, buf_.data() + begin_, buffered);
+            begin_ += buffered;
+            dst += buffered;
+            n -= buffered;
+
+            if (n >= buf_.size()) {
+                while (n > 0) {
+                    ssize_t bytes_received = recv_or_throw(socket, dst, n, 0);
+                    dst += bytes_received;
+                    n -= bytes_received;
+                }
+            } else if (n > 0) {
+                fill(socket, n);
+                memcpy(dst, buf_.data() + begin_, n);
+                begin_ += n;
+            }
+        }
+
+        // Consumes the next n bytes and returns a pointer to them inside the
+        // buffer. The data stays valid until unpin() is called.
+        const char * read_view(int socket, size_t n) {
+            pinned_ = true;
+            fill(socket, n);
+            const char * data = buf_.data() + begin_;
+            begin_ += n;
+            return data;
+        }
+
+        // Feeds buffered data to the parser, receiving more as needed, until it
+        // has a complete reply. Only the bytes of that reply are consumed.
+        void read_reply(int socket, reply_parser & parser) {
+            for (;;) {
+                begin_ += parser.feed(buf_.data() + begin_, size());
+                if (parser.has_reply())
+                    return;
+                fill(socket, 1);
+            }
+        }
+
+        // Releases all data handed out by read_view().
+        void unpin() {
+            pinned_ = false;
+            retired_.clear();
+        }
+
+        // Registers a multi bulk reply of count elements whose header was read
+        // and whose elements will be read lazily. Returns an id that stays
+        // current until the elements are skipped.
+        unsigned long start_lazy(size_t count) {
+            unread_elements_ = count;
+            return ++lazy_id_;
+        }
+
+        unsigned long lazy_id() const {
+            return lazy_id_;
+        }
+
+        // Retires the id of the lazy reply without reading its elements, as
+        // when the connection they were due on is gone.
+        void retire_lazy() {
+            ++lazy_id_;
+            unread_elements_ = 0;
+        }
+
+        // Elements of the lazy reply that were not read yet.
+        size_t & unread_elements() {
+            return unread_elements_;
+        }
+
+        // Skips the unread elements of a lazy reply, which must be bulk
+        // replies, and retires its id.
+        void skip_unread(int socket) {
+            ++lazy_id_;
+            for (; unread_elements_ > 0; --unread_elements_) {
+                long long length;
+                if (!read_header(socket, REDIS_PREFIX_SINGLE_BULK_REPLY, length))
+                    throw protocol_error("unexpected prefix for bulk reply");
+                if (length >= 0)
+                    skip(socket, length + 2);
+            }
+        }
+
+    private:
+
+        void skip(int socket, size_t n) {
+            while (n > 0) {
+                if (begin_ == end_)
+                    fill(socket, 1);
+                size_t chunk = std::min(n, size());
+                begin_ += chunk;
+                n -= chunk;
+            }
+        }
+
+        // Receives until at least n unconsumed bytes are buffered.
+        void fill(int socket, size_t n) {
+            if (size() >= n)
+                return;
+
+            if (!pinned_ && begin_ == end_)
+                begin_ = end_ = 0;
+
+            if (begin_ + n > buf_.size()) {
+                size_t unread = size();
+                if (pinned_) {
+                    // Keep the old storage alive for outstanding views.
+                    std::vector<char> fresh(std::max(n, buf_.size()));
+                    memcpy(fresh.data(), buf_.data() + begin_, unread);
+                    retired_.push_back(std::vector<char>());
+                    retired_.back().swap(buf_);
+                    buf_.swap(fresh);
+                } else {
+                    if (n > buf_.size())
+                        buf_.resize(std::max(n, buf_.size() * 2));
+                    memmove(buf_.data(), buf_.data() + begin_, unread);
+                }
+                begin_ = 0;
+                end_ = unread;
+            }
+
+            while (size() < n)
+                end_ += recv_or_throw(socket, buf_.data() + end_, buf_.size() - end_, 0);
+        }
+
+        std::vector<char> buf_;
+        size_t begin_;
+        size_t end_;
+        bool pinned_;
+        std::vector< std::vector<char> > retired_;
+        size_t unread_elements_;
+        unsigned long lazy_id_;
+    };
+
+    // You should construct a 'client' object per connection to a redis-server.
+    //
+    // Please read the online redis command reference:
+    // http://code.google.com/p/redis/wiki/CommandReference
+    //
+    // No provisions for customizing the allocator on the string/bulk value type
+    // (std::string) are provided.  If needed, you can always change the
+    // string_type typedef in your local version.
+
+    template<typename CONSISTENT_HASHER>
+    class base_client {
+    private:
+        template<typename>
+        friend class base_pipeline;
 
         void init(connection_data & con) {
             char err[ANET_ERR_LEN];
@@ -577,14 +2200,20 @@ namespace redis {
                 throw connection_error(os.str());
             }
             anetTcpNoDelay(NULL, con.socket);
+            // On a reconnect, ranges still holding the old buffer must not read
+            // from the new socket, which may reuse the old descriptor. The
+            // buffer is this client's own; constructors start without one.
+            if (con.rbuf)
+                con.rbuf->retire_lazy();
+            con.rbuf.reset(new recv_buffer());
             select(con.dbindex, con);
 
-            // Set up connection to witness.
-            if (con.witnessSockets.size() == con.witnessIps.size()) return;
-            con.witnessSockets.clear();
+            // Set up connection to witness. A single unconnected socket is
+            // enough, and lets sendWitnessRecord() reach all of them at once.
+            if (con.witnessIps.empty() || con.witnessSocket != -1) return;
+            con.witnessSocket = createSocket();
+            con.witnessSockAddrs.clear();
             for (std::string witnessIp : con.witnessIps) {
-                int s = createSocket();
-                con.witnessSockets.push_back(s);
                 struct sockaddr_in sin;
                 sin.sin_family = AF_INET;
                 sin.sin_port = htons(WITNESS_PORT);
@@ -602,14 +2231,163 @@ namespace redis {
         typedef std::vector<string_score_pair> string_score_vector;
         typedef std::set<string_type> string_set;
 
+        // Views into a connection's receive buffer; see get(key, string_ref &).
+        typedef boost::string_ref string_ref;
+        typedef std::vector<string_ref> string_ref_vector;
+        typedef std::pair<string_ref, string_ref> string_ref_pair;
+        typedef std::vector<string_ref_pair> string_ref_pair_vector;
+
+        // Receives a large value piece by piece; see get_to().
+        typedef boost::function<void (const char * data, size_t len)> chunk_sink;
+
         typedef long int_type;
 
+        /**
+         * Elements of a multi bulk reply, received from the connection only as
+         * the range is iterated, so replies of any size are walked in constant
+         * memory and can be abandoned early. Iteration is single pass.
+         *
+         * The range can be used until the next command is sent over the same
+         * connection. Elements not iterated by then are skipped; touching the
+         * range afterwards throws redis_error. A range can be moved but not
+         * copied, as copies would share the connection's unread elements.
+         */
+        class string_range {
+        public:
+
+            class iterator {
+            public:
+                typedef std::input_iterator_tag iterator_category;
+                typedef string_type value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const string_type * pointer;
+                typedef const string_type & reference;
+
+                iterator() : range_(NULL) {
+                }
+
+                reference operator*() const {
+                    return range_->current_;
+                }
+
+                pointer operator->() const {
+                    return &range_->current_;
+                }
+
+                iterator & operator++() {
+                    if (!range_->next())
+                        range_ = NULL;
+                    return *this;
+                }
+
+                bool operator==(const iterator & other) const {
+                    return range_ == other.range_;
+                }
+
+                bool operator!=(const iterator & other) const {
+                    return range_ != other.range_;
+                }
+
+            private:
+                friend class string_range;
+
+                explicit iterator(string_range * range) : range_(range) {
+                }
+
+                string_range * range_;
+            };
+
+            string_range() : part_(0), size_(0), started_(false), valid_(false) {
+            }
+
+            string_range(string_range && other) = default;
+            string_range & operator=(string_range && other) = default;
+            string_range(const string_range &) = delete;
+            string_range & operator=(const string_range &) = delete;
+
+            // Total number of elements, including those not received yet.
+            size_t size() const {
+                return size_;
+            }
+
+            bool empty() const {
+                return size_ == 0;
+            }
+
+            iterator begin() {
+                if (!started_) {
+                    started_ = true;
+                    valid_ = next();
+                }
+                return valid_ ? iterator(this) : iterator();
+            }
+
+            iterator end() {
+                return iterator();
+            }
+
+        private:
+            friend class base_client;
+
+            struct part {
+                int socket;
+                boost::shared_ptr<recv_buffer> rbuf; // Outlives a reconnect.
+                unsigned long lazy_id;
+            };
+
+            // Receives the next element into current_.
+            bool next() {
+                for (; part_ < parts_.size(); ++part_) {
+                    part & p = parts_[part_];
+                    if (p.rbuf->lazy_id() != p.lazy_id)
+                        throw redis_error("range used after another command was sent");
+                    size_t & unread = p.rbuf->unread_elements();
+                    if (unread == 0)
+                        continue;
+
+                    long long length;
+                    if (!p.rbuf->read_header(p.socket, REDIS_PREFIX_SINGLE_BULK_REPLY, length))
+                        throw protocol_error("unexpected prefix for bulk reply");
+                    --unread;
+
+                    if (length == -1) {
+                        current_ = missing_value();
+                    } else if (length < 0) {
+                        throw protocol_error("invalid bulk reply data; negative length");
+                    } else {
+                        // Reuses the capacity of the previous element.
+                        current_.resize(length);
+                        if (length > 0)
+                            p.rbuf->read_n(p.socket, &current_[0], length);
+                        char crlf[2];
+                        p.rbuf->read_n(p.socket, crlf, 2);
+                        if (crlf[0] != '\r' || crlf[1] != '\n')
+                            throw protocol_error("invalid bulk reply data; data of unexpected length");
+                    }
+                    valid_ = true;
+                    return true;
+                }
+                valid_ = false;
+                return false;
+            }
+
+            std::vector<part> parts_; // One per connection the reply spans.
+            size_t part_;
+            size_t size_;
+            bool started_;
+            bool valid_;
+            string_type current_;
+        };
+
         explicit base_client(const string_type & host,
                 const std::vector<string_type>& witnessIps = std::vector<string_type>(),
                 const std::vector<int>& witnessBufferIndex = std::vector<int>(),
                 uint16_t port = 6379, uint16_t replayPort = 6380, int_type dbindex = 0) {
             clientId = rand() + 1; // Must not be 0.
             lastRequestId = 0;
+            durability_ = durability_witness;
+            set_sync_backups(1, 1000);
+            witness_writes_ = witness_syscalls_ = 0;
             connection_data con;
             con.host = host;
             con.witnessIps = witnessIps;
@@ -617,16 +2395,23 @@ namespace redis {
             con.port = port;
             con.replayPort = replayPort;
             con.dbindex = dbindex;
-            init(con);
+            // Added before init() so that replies can find its receive buffer.
             connections_.push_back(con);
+            init(connections_.back());
         }
 
         template<typename CON_ITERATOR>
         base_client(CON_ITERATOR begin, CON_ITERATOR end) {
+            durability_ = durability_witness;
+            set_sync_backups(1, 1000);
+            witness_writes_ = witness_syscalls_ = 0;
             while (begin != end) {
-                connection_data con = *begin;
-                init(con);
-                connections_.push_back(con);
+                connections_.push_back(*begin);
+                // Witness replies and lazy replies must not go to the client
+                // copied from.
+                connections_.back().witnessSocket = -1;
+                connections_.back().rbuf.reset();
+                init(connections_.back());
                 begin++;
             }
 
@@ -635,7 +2420,37 @@ namespace redis {
         }
 
         base_client<CONSISTENT_HASHER>* clone() const {
-            return new base_client<CONSISTENT_HASHER>(connections_.begin(), connections_.end());
+            base_client<CONSISTENT_HASHER>* c =
+                    new base_client<CONSISTENT_HASHER>(connections_.begin(), connections_.end());
+            c->durability_ = durability_;
+            c->set_sync_backups(sync_backups_, sync_timeout_ms_);
+            return c;
+        }
+
+        /**
+         * Durability of the writes that do not ask for one; the default is
+         * durability_witness. With durability_none, incr() and lpush()
+         * return 0 as there is no reply to take the new value from. Neither
+         * durability_none nor durability_sync writes are sent to witnesses
+         * or kept for replay after a reconnect.
+         */
+        void set_durability(durability level) {
+            durability_ = level;
+        }
+
+        durability get_durability() const {
+            return durability_;
+        }
+
+        /**
+         * durability_sync writes wait for this many backups to acknowledge
+         * them, for up to timeout_ms (0 waits forever), and throw
+         * timeout_error if fewer did. The write itself is not undone then.
+         */
+        void set_sync_backups(int backups, int timeout_ms) {
+            sync_backups_ = backups;
+            sync_timeout_ms_ = timeout_ms;
+            sync_cmd_ = makecmd("WAIT") << backups << timeout_ms;
         }
 
         inline static string_type missing_value() {
@@ -684,9 +2499,7 @@ namespace redis {
             BOOST_FOREACH(connection_data & con, connections_) {
                 // Close all sockets;
                 if (con.socket != ANET_ERR) close(con.socket);
-                for (int s : con.witnessSockets) {
-                    close(s);
-                }
+                if (con.witnessSocket != -1) close(con.witnessSocket);
             }
         }
 
@@ -699,136 +2512,279 @@ namespace redis {
                 throw std::runtime_error("feature is not available in cluster mode");
 
             int socket = connections_[0].socket;
-            send_(socket, makecmd("AUTH") << pass);
+            send_(socket, cmd_("AUTH") << pass);
             recv_ok_reply_(socket);
         }
 
         void set(const string_type & key,
                 const string_type & value) {
+            set(key, value, durability_);
+        }
+
+        void set(const string_type & key,
+                const string_type & value, durability level) {
             TimeTrace::record("Staring set operation.");
+            if (value.size() >= iovcmd::reference_threshold) {
+                iovcmd request(5, "SET");
+                request << key << value;
+                request.append_id(clientId).append_id(++lastRequestId);
+                sendRecvOk(key, request, level);
+                return;
+            }
 //            makecmd request("SET");
 //            request << key << value << std::to_string(clientId) << std::to_string(++lastRequestId);
-            fastcmd request(5, "SET");
-            request << key << value << clientId << ++lastRequestId;
-            sendRecvOk(key, request);
+            cmd_encoder & request = write_cmd_(commands::SET);
+            request << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            sendRecvOk(key, request, level);
         }
 
         void mset(const string_vector & keys, const string_vector & values) {
             assert(keys.size() == values.size());
 
-            std::map< int, boost::optional<makecmd> > socket_commands;
+            shard_batch batch;
+            group_by_shard_(keys, batch);
+            shard_encoder<string_vector> encode("MSET", keys, batch, &values);
+            encode_shards_(batch, keys.size(), encode);
+            send_shards_(batch);
 
-            for (size_t i = 0; i < keys.size(); i++) {
-                int socket = get_socket(keys);
-                boost::optional<makecmd> & cmd = socket_commands[socket];
-                if (!cmd)
-                    cmd = makecmd("MSET");
-                *cmd << keys[i] << values[i];
-            }
-
-            typedef std::pair< int, boost::optional<makecmd> > sock_pair;
-
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                send_(sp.first, *sp.second);
-            }
-
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                recv_ok_reply_(sp.first);
-            }
+            fan_in f(batch.conns);
+            size_t slot;
+            while (next_reply_(f, slot))
+                recv_ok_reply_(connections_[batch.conns[slot]].socket);
         }
 
         void mset(const string_pair_vector & key_value_pairs) {
-            std::map< int, boost::optional<makecmd> > socket_commands;
+            shard_batch batch;
+            group_by_shard_(key_value_pairs, batch);
+            shard_encoder<string_pair_vector> encode("MSET", key_value_pairs, batch);
+            encode_shards_(batch, key_value_pairs.size(), encode);
+            send_shards_(batch);
 
-            for (size_t i = 0; i < key_value_pairs.size(); i++) {
-                const string_type & key = key_value_pairs[i].first;
-                const string_type & value = key_value_pairs[i].second;
-
-                int socket = get_socket(key);
-                boost::optional<makecmd> & cmd = socket_commands[socket];
-                if (!cmd)
-                    cmd = makecmd("MSET");
-                *cmd << key << value;
-            }
-
-            typedef std::pair< int, boost::optional<makecmd> > sock_pair;
+            fan_in f(batch.conns);
+            size_t slot;
+            while (next_reply_(f, slot))
+                recv_ok_reply_(connections_[batch.conns[slot]].socket);
+        }
 
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                send_(sp.first, *sp.second);
+        void msetex(const string_pair_vector & key_value_pairs, int_type seconds) {
+            shard_batch batch;
+            group_by_shard_(key_value_pairs, batch);
+            msetex_encoder encode(key_value_pairs, batch, seconds);
+            encode_shards_(batch, key_value_pairs.size(), encode);
+
+            for (size_t slot = 0; slot < batch.conns.size(); slot++) {
+                int socket = connections_[batch.conns[slot]].socket;
+                std::string cmds;
+                batch.requests[slot].append_to(cmds);
+                cmds += encode.expire_cmds[slot];
+                send_(socket, cmds);
             }
 
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                recv_ok_reply_(sp.first);
+            // MSET and an EXPIRE per key; all replies of a server arrive
+            // together, so they are read in one go.
+            fan_in f(batch.conns);
+            size_t slot;
+            while (next_reply_(f, slot)) {
+                int socket = connections_[batch.conns[slot]].socket;
+                recv_ok_reply_(socket);
+                for (size_t i = 0; i < batch.indices[slot].size(); i++)
+                    recv_int_ok_reply_(socket);
             }
         }
 
-    private:
-
-        struct msetex_data {
-            boost::optional<makecmd> mset_cmd;
-            std::string expire_cmds;
-            size_t count;
-        };
+        // Progress of a bulk_load().
+        struct bulk_load_stats {
 
-    public:
+            bulk_load_stats() : sent(0), acked(0), failed(0), seconds(0) {
+            }
 
-        void msetex(const string_pair_vector & key_value_pairs, int_type seconds) {
-            std::map< int, msetex_data > socket_commands;
+            // Replies per second.
+            double rate() const {
+                return seconds > 0 ? acked / seconds : 0;
+            }
 
-            for (size_t i = 0; i < key_value_pairs.size(); i++) {
-                const string_type & key = key_value_pairs[i].first;
-                const string_type & value = key_value_pairs[i].second;
+            size_t sent; // Commands written.
+            size_t acked; // Replies read, including error replies.
+            size_t failed; // Error replies.
+            double seconds; // Since the load started.
+        };
 
-                int socket = get_socket(key);
-                msetex_data & dat = socket_commands[socket];
-                boost::optional<makecmd> & cmd = dat.mset_cmd;
-                if (!cmd) {
-                    cmd = makecmd("MSET");
-                    dat.count = 0;
-                }
-                *cmd << key << value;
+        typedef boost::function<void (const bulk_load_stats &) > bulk_load_callback;
 
-                std::string & expire_cmds = dat.expire_cmds;
-                expire_cmds += makecmd("EXPIRE") << key << seconds;
-                dat.count++;
+        /**
+         * Writes [begin, end) with up to window commands in flight per server
+         * instead of waiting for each reply. Items are pairs of a key and
+         * either a value, written with SET, or a string_pair_vector, written
+         * with HMSET. Both carry the client and request ids like set() and
+         * hmset(), but are not recorded on witnesses.
+         *
+         * Commands go out in batches of half a window. Before a batch is
+         * written, replies are read until it fits into the window. progress,
+         * if set, is called about once a second and at the end. Error replies
+         * do not stop the load; once every reply was read they are thrown as
+         * one protocol_error.
+         */
+        template<typename ITERATOR>
+        bulk_load_stats bulk_load(ITERATOR begin, ITERATOR end, size_t window = 1024,
+                const bulk_load_callback & progress = bulk_load_callback()) {
+            if (window == 0)
+                throw std::invalid_argument("bulk_load window must not be 0");
+
+            bulk_load_state st(connections_.size(), window, progress);
+            cmd_encoder request;
+            for (; begin != end; ++begin) {
+                size_t conn = get_conn_index_(begin->first);
+                bulk_encode_(request, *begin);
+                typename bulk_load_state::shard & shard = st.shards[conn];
+                request.append_to(shard.out);
+                if (++shard.unsent >= st.batch)
+                    bulk_flush_(st, conn);
             }
 
-            typedef std::pair< int, msetex_data > sock_pair;
-
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                std::string cmds = *sp.second.mset_cmd;
-                cmds += sp.second.expire_cmds;
-                send_(sp.first, cmds);
+            std::vector<size_t> conns;
+            for (size_t conn = 0; conn < st.shards.size(); conn++) {
+                if (st.shards[conn].unsent > 0)
+                    bulk_flush_(st, conn);
+                if (st.shards[conn].in_flight > 0)
+                    conns.push_back(conn);
             }
 
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                recv_ok_reply_(sp.first);
-                for (size_t i = 0; i < sp.second.count; i++)
-                    recv_int_ok_reply_(sp.first);
-
+            fan_in f(conns, 0);
+            for (size_t slot = 0; slot < conns.size(); slot++) {
+                f.owed[slot] = st.shards[conns[slot]].in_flight;
+                f.remaining += f.owed[slot];
             }
+            size_t slot;
+            while (next_reply_(f, slot))
+                bulk_reap_(st, conns[slot]);
+
+            st.report(true);
+            if (st.stats.failed > 0)
+                throw protocol_error(boost::lexical_cast<std::string>(st.stats.failed)
+                    + " bulk_load commands failed; first error: " + st.first_error);
+            return st.stats;
         }
 
         string_type get(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("GET") << key);
+            send_(socket, cmd_(commands::GET) << key);
             return recv_bulk_reply_(socket);
         }
 
+        /**
+         * Zero-copy variant of get(). The view points into the receive buffer of
+         * the key's connection and stays valid until the next command is sent
+         * over that connection. Copy it into a string_type to keep it longer.
+         * A missing key is returned as a view of missing_value().
+         */
+        void get(const string_type & key, string_ref & out) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::GET) << key);
+            out = recv_bulk_reply_view_(socket);
+        }
+
+        /**
+         * Streaming variants of get() for very large values. The value is passed
+         * on in chunks as it arrives, straight from the receive buffer, and is
+         * never built up in memory as a whole.
+         *
+         * The sink is called with consecutive chunks of the value; it must not
+         * throw, as the rest of the reply could not be read then. Returns false
+         * if the key does not exist.
+         */
+        bool get_to(const string_type & key, const chunk_sink & sink) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::GET) << key);
+            return recv_bulk_reply_to_(socket, sink);
+        }
+
+        /**
+         * Writes the value to the file descriptor fd. Returns false if the key
+         * does not exist. If writing fails the rest of the value is discarded
+         * and redis_error is thrown.
+         */
+        bool get_to(const string_type & key, int fd) {
+            fd_sink sink(fd);
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::GET) << key);
+            bool found = recv_bulk_reply_to_(socket, sink);
+            if (sink.error != 0)
+                throw redis_error(std::string("write error: ") + strerror(sink.error));
+            return found;
+        }
+
+        /**
+         * Copies the value into buf, which holds size bytes. Returns the length
+         * of the value, which is larger than size if it was truncated, or -1 if
+         * the key does not exist.
+         */
+        int_type get_to(const string_type & key, char * buf, size_t size) {
+            buffer_sink sink(buf, size);
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::GET) << key);
+            if (!recv_bulk_reply_to_(socket, sink))
+                return -1;
+            return sink.length;
+        }
+
+        /**
+         * Variant of get() that stores the value in out and reuses its
+         * capacity, so a read loop with a long-lived string makes no
+         * allocations once the string is large enough.
+         */
+        void get(const string_type & key, string_type & out) {
+            int socket = get_socket(key);
+            cmd_encoder & request = cmd_(commands::GET);
+            request << key;
+            send_(socket, request);
+            recv_bulk_reply_(socket, out);
+        }
+
         string_type getset(const string_type & key, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("GETSET") << key << value);
+            send_(socket, cmd_(commands::GETSET) << key << value);
             return recv_bulk_reply_(socket);
         }
 
+        /**
+         * Variant of getset() that stores the old value in out; see
+         * get(key, string_type &).
+         */
+        void getset(const string_type & key, const string_type & value, string_type & out) {
+            int socket = get_socket(key);
+            cmd_encoder & request = cmd_(commands::GETSET);
+            request << key << value;
+            send_(socket, request);
+            recv_bulk_reply_(socket, out);
+        }
+
     private:
 
-        struct connection_keys {
-            boost::optional<makecmd> cmd;
+        template<typename VECTOR>
+        void mget_base(const string_vector & keys, VECTOR & out) {
+            out = VECTOR(keys.size());
+
+            shard_batch batch;
+            group_by_shard_(keys, batch);
+            shard_encoder<string_vector> encode("MGET", keys, batch);
+            encode_shards_(batch, keys.size(), encode);
+            send_shards_(batch);
+
+            fan_in f(batch.conns);
+            size_t slot;
+            VECTOR cur_out;
+            while (next_reply_(f, slot)) {
+                const std::vector<size_t> & indices = batch.indices[slot];
+                cur_out.clear();
+                recv_multi_bulk_reply_(connections_[batch.conns[slot]].socket, cur_out);
+                if (cur_out.size() != indices.size())
+                    throw protocol_error("MGET returned an unexpected number of values");
 
-            /// Gives the position of the value in the original array
-            std::vector<size_t> indices;
-        };
+                for (size_t i = 0; i < cur_out.size(); i++)
+                    out[indices[i]] = std::move(cur_out[i]);
+            }
+        }
 
     public:
 
@@ -838,23 +2794,42 @@ namespace redis {
             cmd.set_reply(recv_generic_reply_(socket));
         }
 
+        // See base_pipeline for typed replies.
         void exec(std::vector<command> & commands) {
-            std::map< int, std::string > socket_commands;
+            if (commands.empty())
+                return;
+
+            std::vector<size_t> conns;
+            std::vector< std::vector<size_t> > indices;
+            std::vector<std::string> requests;
+            std::vector<size_t> slot_of(connections_.size(), size_t(-1));
 
             for (size_t i = 0; i < commands.size(); i++) {
-                int socket = get_socket(commands[i].hash_key_);
-                socket_commands[socket] += commands[i].request_;
+                size_t conn = get_conn_index_(commands[i].hash_key_);
+                if (slot_of[conn] == size_t(-1)) {
+                    slot_of[conn] = conns.size();
+                    conns.push_back(conn);
+                    indices.push_back(std::vector<size_t>());
+                    requests.push_back(std::string());
+                }
+                indices[slot_of[conn]].push_back(i);
+                requests[slot_of[conn]] += commands[i].request_;
             }
 
-            typedef std::pair< int, std::string > sock_pair;
+            for (size_t slot = 0; slot < conns.size(); slot++)
+                send_(connections_[conns[slot]].socket, requests[slot]);
 
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                send_(sp.first, sp.second);
-            }
+            // A server's replies come in the order of its commands.
+            fan_in f(conns, 0);
+            for (size_t slot = 0; slot < conns.size(); slot++)
+                f.owed[slot] = indices[slot].size();
+            f.remaining = commands.size();
 
-            for (size_t i = 0; i < commands.size(); i++) {
-                int socket = get_socket(commands[i].hash_key_);
-                commands[i].set_reply(recv_generic_reply_(socket));
+            std::vector<size_t> next(conns.size(), 0);
+            size_t slot;
+            while (next_reply_(f, slot)) {
+                command & cmd = commands[indices[slot][next[slot]++]];
+                cmd.set_reply(recv_generic_reply_(connections_[conns[slot]].socket));
             }
         }
 
@@ -889,40 +2864,38 @@ namespace redis {
             }
         }
 
+        /**
+         * out is resized to one value per key. With a single connection the
+         * strings already in out are reused, so repeated calls with the same
+         * vector make no allocations once it is large enough.
+         */
         void mget(const string_vector & keys, string_vector & out) {
-            out = string_vector(keys.size());
-            std::map< int, connection_keys > socket_commands;
-
-            for (size_t i = 0; i < keys.size(); i++) {
-                int socket = get_socket(keys[i]);
-                connection_keys & con_keys = socket_commands[socket];
-                boost::optional<makecmd> & cmd = con_keys.cmd;
-                if (!cmd)
-                    cmd = makecmd("MGET");
-                *cmd << keys[i];
-                con_keys.indices.push_back(i);
-            }
-
-            typedef std::pair< int, connection_keys > sock_pair;
-
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                send_(sp.first, *sp.second.cmd);
+            if (connections_.size() > 1 || keys.empty()) {
+                mget_base(keys, out);
+                return;
             }
 
-            BOOST_FOREACH(const sock_pair & sp, socket_commands) {
-                const connection_keys & con_keys = sp.second;
-                string_vector cur_out;
-                recv_multi_bulk_reply_(sp.first, cur_out);
+            int socket = connections_[0].socket;
+            cmd_encoder & request = cmd_("MGET");
+            request.expect(bulk_size_(keys));
+            for (size_t i = 0; i < keys.size(); i++)
+                request << keys[i];
+            send_(socket, request);
+            recv_multi_bulk_reply_reuse_(socket, out);
+        }
 
-                for (size_t i = 0; i < cur_out.size(); i++)
-                    out[con_keys.indices[i]] = cur_out[i];
-            }
+        /**
+         * Zero-copy variant of mget(); see get(key, string_ref &) for the
+         * lifetime of the returned views.
+         */
+        void mget(const string_vector & keys, string_ref_vector & out) {
+            mget_base(keys, out);
         }
 
         bool setnx(const string_type & key,
                 const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SETNX") << key << value);
+            send_(socket, cmd_(commands::SETNX) << key << value);
             return recv_int_reply_(socket) == 1;
         }
 
@@ -974,13 +2947,56 @@ namespace redis {
 
         void setex(const string_type & key, const string_type & value, unsigned int secs) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SETEX") << key << secs << value);
+            send_(socket, cmd_(commands::SETEX) << key << secs << value);
             recv_ok_reply_(socket);
         }
 
+        /**
+         * Sets key to len bytes of the regular file fd starting at offset. The
+         * payload is sent with sendfile() and never copied into user space,
+         * except for the witness record if witnesses are configured. The file
+         * offset of fd is not changed.
+         */
+        void set_from_fd(const string_type & key, int fd, off_t offset, size_t len) {
+            set_from_fd(key, fd, offset, len, durability_);
+        }
+
+        void set_from_fd(const string_type & key, int fd, off_t offset, size_t len,
+                durability level) {
+            check_file_range_(fd, offset, len);
+            iovcmd request(5, "SET");
+            request << key;
+            request.append_fd(fd, offset, len);
+            request.append_id(clientId).append_id(++lastRequestId);
+            sendRecvOk(key, request, level);
+        }
+
+        /**
+         * Appends len bytes of the regular file fd starting at offset to key;
+         * see set_from_fd(). Returns the new length of the value.
+         */
+        size_t append_from_fd(const string_type & key, int fd, off_t offset, size_t len) {
+            check_file_range_(fd, offset, len);
+            int socket = get_socket(key);
+            iovcmd request(3, "APPEND");
+            request << key;
+            request.append_fd(fd, offset, len);
+            send_(socket, request);
+            int_type res = recv_int_reply_(socket);
+            if (res < 0)
+                throw protocol_error("expected value size");
+            return static_cast<size_t> (res);
+        }
+
         size_t append(const string_type & key, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("APPEND") << key << value);
+            if (value.size() >= iovcmd::reference_threshold) {
+                iovcmd request(3, "APPEND");
+                request << key << value;
+                send_(socket, request);
+            } else {
+                send_(socket, cmd_(commands::APPEND) << key << value);
+            }
             int res = recv_int_reply_(socket);
             if (res < 0)
                 throw protocol_error("expected value size");
@@ -991,61 +3007,117 @@ namespace redis {
 
         string_type substr(const string_type & key, int start, int end) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SUBSTR") << key << start << end);
+            send_(socket, cmd_(commands::SUBSTR) << key << start << end);
             return recv_bulk_reply_(socket);
         }
 
-        void sendWitnessRecord(const std::string& key, fastcmd& request) {
-            connection_data con = get_conn(key);
+        /**
+         * Variant of substr() that stores the result in out; see
+         * get(key, string_type &).
+         */
+        void substr(const string_type & key, int start, int end, string_type & out) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::SUBSTR) << key << start << end);
+            recv_bulk_reply_(socket, out);
+        }
+
+        /**
+         * Writes recorded on witnesses so far, and the system calls that
+         * took: one sendmmsg() for the records and one recvmmsg() for the
+         * replies, however many witnesses there are.
+         */
+        void witness_stats(uint64_t & writes, uint64_t & syscalls) const {
+            writes = witness_writes_;
+            syscalls = witness_syscalls_;
+        }
+
+        template<typename REQUEST>
+        void sendWitnessRecord(const std::string& key, REQUEST& request) {
+            connection_data & con = get_conn(key);
+            size_t count = con.witnessSockAddrs.size();
+            if (con.witnessSocket == -1 || count == 0)
+                return;
             uint32_t keyHash;
             MurmurHash3_x86_32(key.data(), key.size(), con.dbindex, &keyHash);
             int hashIndex = keyHash & 1023;
 //          fprintf(stderr, "dbindex: %d, hashIndex: %d clientId: %lld, requestId: %lld\n",
 //                  con.dbindex, hashIndex, clientId, lastRequestId);
-            for (unsigned long idx = 0; idx < con.witnessSockets.size(); idx++) {
-                witnesscmd_t cmd;
-                create_add_wcmd(&cmd, clientId, lastRequestId,
-                    hashIndex, request.data(), request.size()); 
-                TimeTrace::record("Constructed witness record request string.");
-                //fprintf(stderr, "data: %x\nrequest: %s\n", witness_data(&cmd)[0], request.data());
-                //fprintf(stderr, "size: %lu vs. %d vs %d\n", strlen(witness_data(&cmd)), witness_size(&cmd), request.size());
-                udpWrite(con.witnessSockets.at(idx),
-                         SRC_ADDR,
-                         con.witnessIps.at(idx).c_str(),
-                         WITNESS_CLIENT_PORT, WITNESS_PORT, witness_data(&cmd),
-                         witness_size(&cmd),
-                         &con.witnessSockAddrs.at(idx),
-                         false);
-                TimeTrace::record("Sent to witness");
+            // The record is the same for every witness, so it is built once
+            // and handed to the kernel once.
+            witnesscmd_t cmd;
+            create_add_wcmd(&cmd, clientId, lastRequestId,
+                hashIndex, const_cast<char *> (request.data()), request.size());
+            TimeTrace::record("Constructed witness record request string.");
+            struct iovec iov;
+            iov.iov_base = witness_data(&cmd);
+            iov.iov_len = witness_size(&cmd);
+            witness_msgs_.resize(count);
+            for (size_t idx = 0; idx < count; idx++) {
+                struct msghdr & hdr = witness_msgs_[idx].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_name = &con.witnessSockAddrs[idx];
+                hdr.msg_namelen = sizeof(sockaddr_in);
+                hdr.msg_iov = &iov;
+                hdr.msg_iovlen = 1;
+            }
+            size_t sent = 0;
+            while (sent < count) {
+                ++witness_syscalls_;
+                int n = sendmmsg(con.witnessSocket, &witness_msgs_[sent], count - sent, 0);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    perror("sendmmsg failed");
+                    break;
+                }
+                sent += n;
             }
+            ++witness_writes_;
+            TimeTrace::record("Sent to witness");
         }
 
         /**
-         * Receive one reply which has witness record result.
+         * Receives the replies of all witnesses to the last record.
          * \return
-         *      returns true if accepted. false if rejected.
+         *      returns true if all accepted. false if any rejected.
          */
-        bool recv_witness_reply_(int socket, sockaddr_in sin) {
-            uint blen;
-            char buffer;
-            recvfrom(socket, &buffer, 1,
-                     MSG_WAITALL, (struct sockaddr *) &sin,
-                     &blen);
-            TimeTrace::record("Received reply from a witness.");
-            return buffer == 0;
-        }
-
         bool receiveWitnessReply(const std::string& key) {
-            connection_data con = get_conn(key);
-
-            if (con.witnessSockets.size() < con.witnessIps.size()) {
+            connection_data & con = get_conn(key);
+            size_t count = con.witnessSockAddrs.size();
+            if (con.witnessIps.empty())
+                return true;
+            if (con.witnessSocket == -1) {
                 return false;
             }
 
-            bool accepted = true;
+            witness_replies_.assign(count, 1);
+            witness_iovs_.resize(count);
+            witness_msgs_.resize(count);
+            for (size_t idx = 0; idx < count; idx++) {
+                witness_iovs_[idx].iov_base = &witness_replies_[idx];
+                witness_iovs_[idx].iov_len = 1;
+                struct msghdr & hdr = witness_msgs_[idx].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_iov = &witness_iovs_[idx];
+                hdr.msg_iovlen = 1;
+            }
+            // Blocks until every witness replied.
+            size_t received = 0;
+            while (received < count) {
+                ++witness_syscalls_;
+                int n = recvmmsg(con.witnessSocket, &witness_msgs_[received], count - received, 0, NULL);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    perror("recvmmsg failed");
+                    return false;
+                }
+                received += n;
+            }
 
-            for (unsigned long idx = 0; idx < con.witnessSockets.size(); idx++) {
-                if (!recv_witness_reply_(con.witnessSockets.at(idx), con.witnessSockAddrs.at(idx))) {
+            bool accepted = true;
+            for (size_t idx = 0; idx < count; idx++) {
+                if (witness_replies_[idx] != 0) {
 //                    fprintf(stderr, "witness rejected! key: %s, socket: %d",
 //                            key.c_str(), socket);
                     accepted = false;
@@ -1054,7 +3126,8 @@ namespace redis {
             return accepted;
         }
 
-        void sendRecvOk(const string_type& key, fastcmd& request) {
+        template<typename REQUEST>
+        void sendRecvOk(const string_type& key, REQUEST& request, durability level) {
             TimeTrace::record("constructed request string.");
             bool reopenTcp = false;
             int tryCount = 0;
@@ -1067,21 +3140,37 @@ namespace redis {
                     }
                     socket = get_socket(key);
                     TimeTrace::record("found socket.");
-                    send_(socket, request.data(), request.size());
+                    if (level == durability_none) {
+                        send_request_(socket, reply_skip_cmd_(), request, empty_cmd_());
+                        break;
+                    }
+                    send_request_(socket, empty_cmd_(), request,
+                            level == durability_sync ? sync_cmd_ : empty_cmd_());
                     TimeTrace::record("Sent to master.");
                     // Temporary hack to remove overhead of CGAR-W from CGAR-C benchmark.
-                    if (connections_[0].witnessIps.size() > 0) { // If using witness..
+                    bool useWitness = level == durability_witness
+                            && connections_[0].witnessIps.size() > 0;
+                    if (useWitness) { // If using witness..
                         sendWitnessRecord(key, request);
                     }
 
                     bool shouldSync = false;
 
                     // uint64_t opNumInServer=0, syncNum=0;
-                    if (recv_single_line_reply_(socket) == REDIS_STATUS_REPLY_OK) {
+                    std::string status;
+                    try {
+                        status = recv_single_line_reply_(socket);
+                    } catch (connection_error &) {
+                        throw;
+                    } catch (redis_error &) {
+                        skip_sync_reply_(socket, level);
+                        throw;
+                    }
+                    if (status == REDIS_STATUS_REPLY_OK) {
 //Disable CGAR-C        if (recv_unsynced_ok_reply_(socket, &opNumInServer, &syncNum)) {
 //Disable CGAR-C            tracker.registerUnsynced(socket, get_conn(key).dbindex, request.data(), request.size(), opNumInServer, syncNum);
 //                        TimeTrace::record("Registered unsynced.");
-                        if (!receiveWitnessReply(key)) {
+                        if (useWitness && !receiveWitnessReply(key)) {
                             //TODO
                             //shouldSync = true;
                         }
@@ -1096,6 +3185,9 @@ namespace redis {
                     } else {
                         fprintf(stderr, "Short message or duplicate. Req: %s\n", request.c_str());
                     }
+                    if (level == durability_sync) {
+                        recv_sync_reply_(socket);
+                    }
                     break;
                 } catch (connection_error& e) {
                     fprintf(stderr, "connection error happened.. (trial count: %d) Req: %s\n", tryCount, request.c_str());
@@ -1110,7 +3202,7 @@ namespace redis {
             }
         }
 
-        int_type sendRecvInt(const string_type& key, fastcmd& request) {
+        int_type sendRecvInt(const string_type& key, cmd_encoder& request, durability level) {
             bool reopenTcp = false;
             int tryCount = 0;
             int socket;
@@ -1121,17 +3213,35 @@ namespace redis {
                         reopenTcp = false;
                     }
                     socket = get_socket(key);
-                    send_(socket, request.data(), request.size());
-                    sendWitnessRecord(key, request);
+                    if (level == durability_none) {
+                        send_request_(socket, reply_skip_cmd_(), request, empty_cmd_());
+                        return 0;
+                    }
+                    send_request_(socket, empty_cmd_(), request,
+                            level == durability_sync ? sync_cmd_ : empty_cmd_());
                     bool shouldSync = false;
-                    if (!receiveWitnessReply(key)) {
-                        //TODO
-                        //shouldSync = true;
+                    if (level == durability_witness) {
+                        sendWitnessRecord(key, request);
+                        if (!receiveWitnessReply(key)) {
+                            //TODO
+                            //shouldSync = true;
+                        }
                     }
                     //fprintf(stderr, "Sent Witness stuff\n");
                     int64_t value=0;
                     uint64_t opNumInServer=0, syncNum=0;
-                    if (recv_unsynced_int_reply_(socket, &value, &opNumInServer, &syncNum)) {
+                    bool unsynced;
+                    try {
+                        unsynced = recv_unsynced_int_reply_(socket, &value, &opNumInServer, &syncNum);
+                    } catch (connection_error &) {
+                        throw;
+                    } catch (redis_error &) {
+                        skip_sync_reply_(socket, level);
+                        throw;
+                    }
+                    if (level == durability_sync) {
+                        recv_sync_reply_(socket);
+                    } else if (unsynced) {
                         tracker.registerUnsynced(socket, get_conn(key).dbindex, request.data(), request.size(), opNumInServer, syncNum);
                         if (shouldSync) {
                             // TODO: send sync rpc?? well...
@@ -1156,95 +3266,99 @@ namespace redis {
         }
 
         int_type incr(const string_type & key) {
-            fastcmd request(4, "INCR");
-            request << key << clientId << ++lastRequestId;
-            return sendRecvInt(key, request);
+            return incr(key, durability_);
+        }
+
+        int_type incr(const string_type & key, durability level) {
+            cmd_encoder & request = write_cmd_(commands::INCR);
+            request << key;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return sendRecvInt(key, request, level);
         }
 
         template<typename INT_TYPE>
         INT_TYPE incr(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("INCR") << key);
+            send_(socket, cmd_("INCR") << key);
             return recv_int_reply_<INT_TYPE>(socket);
         }
 
         int_type incrby(const string_type & key, int_type by) {
             int socket = get_socket(key);
-            send_(socket, makecmd("INCRBY") << key << by);
+            send_(socket, cmd_(commands::INCRBY) << key << by);
             return recv_int_reply_(socket);
         }
 
         template<typename INT_TYPE>
         INT_TYPE incrby(const string_type & key, INT_TYPE by) {
             int socket = get_socket(key);
-            send_(socket, makecmd("INCRBY") << key << by);
+            send_(socket, cmd_(commands::INCRBY) << key << by);
             return recv_int_reply_<INT_TYPE>(socket);
         }
 
         int_type decr(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("DECR") << key);
+            send_(socket, cmd_(commands::DECR) << key);
             return recv_int_reply_(socket);
         }
 
         template<typename INT_TYPE>
         INT_TYPE decr(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("DECR") << key);
+            send_(socket, cmd_(commands::DECR) << key);
             return recv_int_reply_<INT_TYPE>(socket);
         }
 
         int_type decrby(const string_type & key, int_type by) {
             int socket = get_socket(key);
-            send_(socket, makecmd("DECRBY") << key << by);
+            send_(socket, cmd_(commands::DECRBY) << key << by);
             return recv_int_reply_(socket);
         }
 
         template<typename INT_TYPE>
         INT_TYPE decrby(const string_type & key, INT_TYPE by) {
             int socket = get_socket(key);
-            send_(socket, makecmd("DECRBY") << key << by);
+            send_(socket, cmd_(commands::DECRBY) << key << by);
             return recv_int_reply_<INT_TYPE>(socket);
         }
 
         bool exists(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("EXISTS") << key);
+            send_(socket, cmd_(commands::EXISTS) << key);
             return recv_int_reply_(socket) == 1;
         }
 
         bool del(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("DEL") << key);
+            send_(socket, cmd_(commands::DEL) << key);
             return recv_int_reply_(socket) != 0;
         }
 
         template<typename ITERATOR>
         bool del(ITERATOR begin, ITERATOR end) {
-            std::map<int, string_vector> sock_key_map;
-            while (begin != end) {
-                string_type key = *begin++;
-                sock_key_map[ get_socket(key) ].push_back(key);
-            }
-
-            typedef std::pair<const int, string_vector> sock_key_pair;
+            string_vector keys(begin, end);
+            if (keys.empty())
+                return false;
 
-            BOOST_FOREACH(const sock_key_pair & p, sock_key_map) {
-                send_(p.first, makecmd("DEL") << p.second);
-            }
+            shard_batch batch;
+            group_by_shard_(keys, batch);
+            shard_encoder<string_vector> encode("DEL", keys, batch);
+            encode_shards_(batch, keys.size(), encode);
+            send_shards_(batch);
 
-            int_type res = false;
+            int_type res = 0;
 
-            BOOST_FOREACH(const sock_key_pair & p, sock_key_map) {
-                res += recv_int_reply_(p.first);
-            }
+            fan_in f(batch.conns);
+            size_t slot;
+            while (next_reply_(f, slot))
+                res += recv_int_reply_(connections_[batch.conns[slot]].socket);
 
             return res;
         }
 
         datatype type(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("TYPE") << key);
+            send_(socket, cmd_(commands::TYPE) << key);
             std::string response = recv_single_line_reply_(socket);
 
             if (response == "none") return datatype_none;
@@ -1262,18 +3376,49 @@ namespace redis {
         }
 
         int_type keys(const string_type & pattern, string_vector & out) {
+            if (connections_.size() == 1) {
+                send_(connections_[0].socket, cmd_("KEYS") << pattern);
+                return recv_multi_bulk_reply_(connections_[0].socket, out);
+            }
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("KEYS") << pattern);
+                send_(con.socket, cmd_("KEYS") << pattern);
             }
 
+            // Parsed as they arrive, but appended in connection order.
+            std::vector<string_vector> parts(connections_.size());
+            fan_in f(all_conns_());
+            size_t slot;
+            while (next_reply_(f, slot))
+                recv_multi_bulk_reply_(connections_[slot].socket, parts[slot]);
+
             int_type res = 0;
+            for (size_t i = 0; i < parts.size(); i++) {
+                res += parts[i].size();
+                out.insert(out.end(), std::make_move_iterator(parts[i].begin()),
+                        std::make_move_iterator(parts[i].end()));
+            }
+
+            return res;
+        }
+
+        /**
+         * Lazy variant of keys(); see string_range. With several connections
+         * the range walks the keys of one server after the other.
+         */
+        string_range keys(const string_type & pattern) {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                res += recv_multi_bulk_reply_(con.socket, out);
+                send_(con.socket, cmd_("KEYS") << pattern);
             }
 
-            return res;
+            string_range range;
+
+            BOOST_FOREACH(const connection_data & con, connections_) {
+                recv_multi_bulk_range_(con.socket, range);
+            }
+
+            return range;
         }
 
         string_type randomkey() {
@@ -1293,7 +3438,7 @@ namespace redis {
                 socket = connections_[die()].socket;
             }
 
-            send_(socket, makecmd("RANDOMKEY"));
+            send_(socket, cmd_("RANDOMKEY"));
             return recv_bulk_reply_(socket);
         }
 
@@ -1342,7 +3487,7 @@ namespace redis {
                 return;
             }
 
-            send_(source_socket, makecmd("RENAME") << old_name << new_name);
+            send_(source_socket, cmd_(commands::RENAME) << old_name << new_name);
             recv_ok_reply_(source_socket);
         }
 
@@ -1360,7 +3505,7 @@ namespace redis {
                 return true;
             }
 
-            send_(source_socket, makecmd("RENAMENX") << old_name << new_name);
+            send_(source_socket, cmd_(commands::RENAMENX) << old_name << new_name);
             return recv_int_reply_(source_socket) == 1;
         }
 
@@ -1372,12 +3517,13 @@ namespace redis {
             int_type val = 0;
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("DBSIZE"));
+                send_(con.socket, cmd_("DBSIZE"));
             }
 
-            BOOST_FOREACH(const connection_data & con, connections_) {
-                val += recv_int_reply_(con.socket);
-            }
+            fan_in f(all_conns_());
+            size_t slot;
+            while (next_reply_(f, slot))
+                val += recv_int_reply_(connections_[slot].socket);
 
             return val;
         }
@@ -1386,42 +3532,48 @@ namespace redis {
          * @returns the number of keys in the currently selected database with the given connection.
          */
         int_type dbsize(const connection_data & con) {
-            send_(con.socket, makecmd("DBSIZE"));
+            send_(con.socket, cmd_("DBSIZE"));
             return recv_int_reply_(con.socket);
         }
 
         void expire(const string_type & key, unsigned int secs) {
             int socket = get_socket(key);
-            send_(socket, makecmd("EXPIRE") << key << secs);
+            send_(socket, cmd_(commands::EXPIRE) << key << secs);
             recv_int_ok_reply_(socket);
         }
 
         int ttl(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("TTL") << key);
+            send_(socket, cmd_(commands::TTL) << key);
             return recv_int_reply_(socket);
         }
 
         int_type rpush(const string_type & key,
                 const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("RPUSH") << key << value);
+            send_(socket, cmd_(commands::RPUSH) << key << value);
             return recv_int_reply_(socket);
         }
 
         int_type lpush(const string_type & key,
                 const string_type & value) {
-            fastcmd request(5, "LPUSH");
-            request << key << value << clientId << ++lastRequestId;
-            return sendRecvInt(key, request);
+            return lpush(key, value, durability_);
+        }
+
+        int_type lpush(const string_type & key,
+                const string_type & value, durability level) {
+            cmd_encoder & request = write_cmd_(commands::LPUSH);
+            request << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return sendRecvInt(key, request, level);
 //            int socket = get_socket(key);
-//            send_(socket, makecmd("LPUSH") << key << value);
+//            send_(socket, cmd_("LPUSH") << key << value);
 //            return recv_int_reply_(socket);
         }
 
         int_type llen(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LLEN") << key);
+            send_(socket, cmd_(commands::LLEN) << key);
             return recv_int_reply_(socket);
         }
 
@@ -1430,46 +3582,84 @@ namespace redis {
                 int_type end,
                 string_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LRANGE") << key << start << end);
+            send_(socket, cmd_(commands::LRANGE) << key << start << end);
+            return recv_multi_bulk_reply_(socket, out);
+        }
+
+        /**
+         * Zero-copy variant of lrange(); see get(key, string_ref &) for the
+         * lifetime of the returned views.
+         */
+        int_type lrange(const string_type & key,
+                int_type start,
+                int_type end,
+                string_ref_vector & out) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::LRANGE) << key << start << end);
             return recv_multi_bulk_reply_(socket, out);
         }
 
+        /**
+         * Lazy variant of lrange(); see string_range.
+         */
+        string_range lrange(const string_type & key,
+                int_type start,
+                int_type end) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::LRANGE) << key << start << end);
+            string_range range;
+            recv_multi_bulk_range_(socket, range);
+            return range;
+        }
+
         void ltrim(const string_type & key,
                 int_type start,
                 int_type end) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LTRIM") << key << start << end);
+            send_(socket, cmd_(commands::LTRIM) << key << start << end);
             recv_ok_reply_(socket);
         }
 
         string_type lindex(const string_type & key,
                 int_type index) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LINDEX") << key << index);
+            send_(socket, cmd_(commands::LINDEX) << key << index);
             return recv_bulk_reply_(socket);
         }
 
         void lset(const string_type & key, int_type index, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LSET") << key << index << value);
+            send_(socket, cmd_(commands::LSET) << key << index << value);
             recv_ok_reply_(socket);
         }
 
         int_type lrem(const string_type & key, int_type count, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LREM") << key << count << value);
+            send_(socket, cmd_(commands::LREM) << key << count << value);
             return recv_int_reply_(socket);
         }
 
         string_type lpop(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("LPOP") << key);
+            send_(socket, cmd_(commands::LPOP) << key);
             return recv_bulk_reply_(socket);
         }
 
+        /**
+         * Variant of lpop() that stores the element in out; see
+         * get(key, string_type &).
+         */
+        void lpop(const string_type & key, string_type & out) {
+            int socket = get_socket(key);
+            cmd_encoder & request = cmd_(commands::LPOP);
+            request << key;
+            send_(socket, request);
+            recv_bulk_reply_(socket, out);
+        }
+
         string_type rpop(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("RPOP") << key);
+            send_(socket, cmd_(commands::RPOP) << key);
             return recv_bulk_reply_(socket);
         }
 
@@ -1482,7 +3672,7 @@ namespace redis {
                 // How to do in cluster mode? Is reinserting of to much poped values a solution?
                 throw std::runtime_error("feature is not available in cluster mode");
 
-            send_(socket, makecmd("BLPOP") << keys << timeout_seconds);
+            send_(socket, cmd_("BLPOP") << keys << timeout_seconds);
             string_vector sv;
             try {
                 recv_multi_bulk_reply_(socket, sv);
@@ -1502,7 +3692,7 @@ namespace redis {
                 // How to do in cluster mode? Is reinserting of to much poped values a solution?
                 throw std::runtime_error("feature is not available in cluster mode");
 
-            send_(socket, makecmd("BLPOP") << key << timeout_seconds);
+            send_(socket, cmd_("BLPOP") << key << timeout_seconds);
             string_vector sv;
             try {
                 recv_multi_bulk_reply_(socket, sv);
@@ -1523,7 +3713,7 @@ namespace redis {
          */
         string_pair brpop(const string_vector & keys, int_type timeout_seconds) {
             int socket = get_socket(keys);
-            makecmd m("BRPOP");
+            cmd_encoder & m = cmd_("BRPOP");
             for (size_t i = 0; i < keys.size(); i++)
                 m << keys[i];
             m << timeout_seconds;
@@ -1544,7 +3734,7 @@ namespace redis {
 
         string_type brpop(const string_type & key, int_type timeout_seconds) {
             int socket = get_socket(key);
-            send_(socket, makecmd("BRPOP") << key << timeout_seconds);
+            send_(socket, cmd_("BRPOP") << key << timeout_seconds);
             string_vector sv;
             try {
                 recv_multi_bulk_reply_(socket, sv);
@@ -1563,7 +3753,7 @@ namespace redis {
         bool sadd(const string_type & key,
                 const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SADD") << key << value);
+            send_(socket, cmd_(commands::SADD) << key << value);
             return recv_int_reply_(socket) == 1;
         }
 
@@ -1591,13 +3781,13 @@ namespace redis {
         void srem(const string_type & key,
                 const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SREM") << key << value);
+            send_(socket, cmd_(commands::SREM) << key << value);
             recv_int_ok_reply_(socket);
         }
 
         string_type spop(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SPOP") << key);
+            send_(socket, cmd_(commands::SPOP) << key);
             return recv_bulk_reply_(socket);
         }
 
@@ -1610,20 +3800,20 @@ namespace redis {
                 return;
             }
 
-            send_(src_socket, makecmd("SMOVE") << srckey << dstkey << member);
+            send_(src_socket, cmd_(commands::SMOVE) << srckey << dstkey << member);
             recv_int_ok_reply_(src_socket);
         }
 
         int_type scard(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SCARD") << key);
+            send_(socket, cmd_(commands::SCARD) << key);
             return recv_int_reply_(socket);
         }
 
         bool sismember(const string_type & key,
                 const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SISMEMBER") << key << value);
+            send_(socket, cmd_(commands::SISMEMBER) << key << value);
             return recv_int_reply_(socket) == 1;
         }
 
@@ -1643,7 +3833,7 @@ namespace redis {
             typedef std::pair<const int, string_vector> per_server_pair;
 
             BOOST_FOREACH(const per_server_pair & p, per_server) {
-                send_(p.first, makecmd("SINTER") << p.second);
+                send_(p.first, cmd_("SINTER") << p.second);
             }
 
             BOOST_FOREACH(const per_server_pair & p, per_server) {
@@ -1686,7 +3876,7 @@ namespace redis {
                 return content.size();
             }
 
-            send_(socket, makecmd("SINTERSTORE") << dstkey << keys);
+            send_(socket, cmd_("SINTERSTORE") << dstkey << keys);
             return recv_int_reply_(socket);
         }
 
@@ -1714,7 +3904,7 @@ namespace redis {
                 return out.size();
             }
 
-            send_(socket, makecmd("SUNION") << keys);
+            send_(socket, cmd_("SUNION") << keys);
             return recv_multi_bulk_reply_(socket, out);
         }
 
@@ -1729,13 +3919,13 @@ namespace redis {
                 return sadd(dstkey, content.begin(), content.end());
             }
 
-            send_(socket, makecmd("SUNIONSTORE") << dstkey << keys);
+            send_(socket, cmd_("SUNIONSTORE") << dstkey << keys);
             return recv_int_reply_(socket);
         }
 
         int_type sdiff(const string_vector & keys, string_set & out) {
             int socket = get_socket(keys);
-            send_(socket, makecmd("SDIFF") << keys);
+            send_(socket, cmd_("SDIFF") << keys);
             return recv_multi_bulk_reply_(socket, out);
         }
 
@@ -1745,25 +3935,36 @@ namespace redis {
             if (socket != source_sockets)
                 throw std::runtime_error("not available in cluster mode");
 
-            send_(socket, makecmd("SDIFFSTORE") << dstkey << keys);
+            send_(socket, cmd_("SDIFFSTORE") << dstkey << keys);
             return recv_int_reply_(socket);
         }
 
         int_type smembers(const string_type & key, string_set & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SMEMBERS") << key);
+            send_(socket, cmd_(commands::SMEMBERS) << key);
             return recv_multi_bulk_reply_(socket, out);
         }
 
+        /**
+         * Lazy variant of smembers(); see string_range.
+         */
+        string_range smembers(const string_type & key) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::SMEMBERS) << key);
+            string_range range;
+            recv_multi_bulk_range_(socket, range);
+            return range;
+        }
+
         string_type srandmember(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("SPOP") << key);
+            send_(socket, cmd_(commands::SPOP) << key);
             return recv_bulk_reply_(socket);
         }
 
         void zadd(const string_type & key, double score, const string_type & member) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZADD") << key << score << member);
+            send_(socket, cmd_(commands::ZADD) << key << score << member);
             recv_int_ok_reply_(socket);
         }
 
@@ -1773,34 +3974,45 @@ namespace redis {
 
         void zrem(const string_type & key, const string_type & member) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREM") << key << member);
+            send_(socket, cmd_(commands::ZREM) << key << member);
             recv_int_ok_reply_(socket);
         }
 
         double zincrby(const string_type & key, const string_type & member, double increment) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZINCRBY") << key << increment << member);
-            return boost::lexical_cast<double>(recv_bulk_reply_(socket));
+            send_(socket, cmd_(commands::ZINCRBY) << key << increment << member);
+            return recv_double_reply_(socket);
         }
 
         int_type zrank(const string_type & key, const string_type & member) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZRANK") << key << member);
+            send_(socket, cmd_(commands::ZRANK) << key << member);
             return recv_int_reply_(socket);
         }
 
         int_type zrevrank(const string_type & key, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREVRANK") << key << value);
-            return boost::lexical_cast<int_type>(recv_int_reply_(socket));
+            send_(socket, cmd_(commands::ZREVRANK) << key << value);
+            return recv_int_reply_(socket);
         }
 
         void zrange(const string_type & key, int_type start, int_type end, string_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZRANGE") << key << start << end);
+            send_(socket, cmd_(commands::ZRANGE) << key << start << end);
             recv_multi_bulk_reply_(socket, out);
         }
 
+        /**
+         * Lazy variant of zrange(); see string_range.
+         */
+        string_range zrange(const string_type & key, int_type start, int_type end) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::ZRANGE) << key << start << end);
+            string_range range;
+            recv_multi_bulk_range_(socket, range);
+            return range;
+        }
+
     private:
 
         void convert(const string_vector & in, string_score_vector & out) {
@@ -1809,7 +4021,7 @@ namespace redis {
             for (size_t i = 0; i < in.size(); i += 2) {
                 const std::string & value = in[i];
                 const std::string & str_score = in[i + 1];
-                double score = boost::lexical_cast<double>(str_score);
+                double score = parse_reply_number_<double>(str_score.data(), str_score.size());
                 out.push_back(make_pair(value, score));
             }
         }
@@ -1819,7 +4031,7 @@ namespace redis {
 
         void zrange(const string_type & key, int_type start, int_type end, string_score_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZRANGE") << key << start << end << "WITHSCORES");
+            send_(socket, cmd_("ZRANGE") << key << start << end << "WITHSCORES");
             string_vector res;
             recv_multi_bulk_reply_(socket, res);
             convert(res, out);
@@ -1827,13 +4039,13 @@ namespace redis {
 
         void zrevrange(const string_type & key, int_type start, int_type end, string_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREVRANGE") << key << start << end);
+            send_(socket, cmd_(commands::ZREVRANGE) << key << start << end);
             recv_multi_bulk_reply_(socket, out);
         }
 
         void zrevrange(const string_type & key, int_type start, int_type end, string_score_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREVRANGE") << key << start << end << "WITHSCORES");
+            send_(socket, cmd_("ZREVRANGE") << key << start << end << "WITHSCORES");
             string_vector res;
             recv_multi_bulk_reply_(socket, res);
             convert(res, out);
@@ -1843,17 +4055,10 @@ namespace redis {
 
         void zrangebyscore_base(bool withscores, const string_type & key, double min, double max, string_vector & out, int_type offset, int_type max_count, int range_modification) {
             int socket = get_socket(key);
-            std::string min_str, max_str;
-            if (range_modification & exclude_min)
-                min_str = "(";
-            if (range_modification & exclude_max)
-                max_str = "(";
-
-            min_str += boost::lexical_cast<std::string>(min);
-            max_str += boost::lexical_cast<std::string>(max);
-
-            makecmd m("ZRANGEBYSCORE");
-            m << key << min_str << max_str;
+            cmd_encoder & m = cmd_("ZRANGEBYSCORE");
+            m << key;
+            append_score_bound_(m, min, range_modification & exclude_min);
+            append_score_bound_(m, max, range_modification & exclude_max);
 
             if (max_count != -1 || offset > 0) {
                 std::cerr << "Adding limit: " << offset << " " << max_count << std::endl;
@@ -1878,41 +4083,36 @@ namespace redis {
 
         int_type zcount(const string_type & key, double min, double max, int range_modification = 0) {
             int socket = get_socket(key);
-            std::string min_str, max_str;
-            if (range_modification & exclude_min)
-                min_str = "(";
-            if (range_modification & exclude_max)
-                max_str = "(";
-
-            min_str += boost::lexical_cast<std::string>(min);
-            max_str += boost::lexical_cast<std::string>(max);
-
-            send_(socket, makecmd("ZCOUNT") << key << min_str << max_str);
+            cmd_encoder & m = cmd_(commands::ZCOUNT);
+            m << key;
+            append_score_bound_(m, min, range_modification & exclude_min);
+            append_score_bound_(m, max, range_modification & exclude_max);
+            send_(socket, m);
             return recv_int_reply_(socket);
         }
 
         int_type zremrangebyrank(const string_type & key, int_type start, int_type end) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREMRANGEBYRANK") << key << start << end);
+            send_(socket, cmd_(commands::ZREMRANGEBYRANK) << key << start << end);
             return recv_int_reply_(socket);
         }
 
         int_type zremrangebyscore(const string_type& key, double min, double max) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZREMRANGEBYSCORE") << key << min << max);
+            send_(socket, cmd_(commands::ZREMRANGEBYSCORE) << key << min << max);
             return recv_int_reply_(socket);
         }
 
         int_type zcard(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZCARD") << key);
+            send_(socket, cmd_(commands::ZCARD) << key);
             return recv_int_reply_(socket);
         }
 
         double zscore(const string_type& key, const string_type& element) {
             int socket = get_socket(key);
-            send_(socket, makecmd("ZSCORE") << key << element);
-            return boost::lexical_cast<double>(recv_bulk_reply_(socket));
+            send_(socket, cmd_(commands::ZSCORE) << key << element);
+            return recv_double_reply_(socket);
         }
 
         int_type zunionstore(const string_type & dstkey, const string_vector & keys, const std::vector<double> & weights = std::vector<double>(), aggregate_type aggragate = aggregate_sum) {
@@ -1921,7 +4121,7 @@ namespace redis {
             if (socket != dst_socket)
                 throw std::runtime_error("feature is not available in cluster mode");
 
-            makecmd m("ZUNIONSTORE");
+            cmd_encoder & m = cmd_("ZUNIONSTORE");
             m << dstkey << keys.size() << keys;
 
             if (weights.size() > 0) {
@@ -1954,7 +4154,7 @@ namespace redis {
             if (socket != dst_socket)
                 throw std::runtime_error("feature is not available in cluster mode");
 
-            makecmd m("ZINTERSTORE");
+            cmd_encoder & m = cmd_("ZINTERSTORE");
             m << dstkey << keys.size() << keys;
             if (weights.size() > 0) {
                 assert(keys.size() == weights.size());
@@ -1982,97 +4182,175 @@ namespace redis {
 
         bool hset(const string_type & key, const string_type & field, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HSET") << key << field << value);
+            send_(socket, cmd_(commands::HSET) << key << field << value);
             return recv_int_reply_(socket) == 1;
         }
 
         string_type hget(const string_type & key, const string_type & field) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HGET") << key << field);
+            send_(socket, cmd_(commands::HGET) << key << field);
             return recv_bulk_reply_(socket);
         }
 
+        /**
+         * Variant of hget() that stores the value in out; see
+         * get(key, string_type &).
+         */
+        void hget(const string_type & key, const string_type & field, string_type & out) {
+            int socket = get_socket(key);
+            cmd_encoder & request = cmd_(commands::HGET);
+            request << key << field;
+            send_(socket, request);
+            recv_bulk_reply_(socket, out);
+        }
+
         bool hsetnx(const string_type & key, const string_type & field, const string_type & value) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HSETNX") << key << field << value);
+            send_(socket, cmd_(commands::HSETNX) << key << field << value);
             return recv_int_reply_(socket) == 1;
         }
 
         void hmset(const string_type & key, const string_vector & fields, const string_vector& values) {
             int socket = get_socket(key);
-            makecmd m("HMSET");
-            m << key;
             assert(fields.size() == values.size());
 
-            for (size_t i = 0; i < fields.size(); i++)
-                m << fields[i] << values[i];
+            size_t payload = 0;
+            for (size_t i = 0; i < values.size(); i++)
+                payload = std::max(payload, values[i].size());
 
-            send_(socket, m);
+            if (payload >= iovcmd::reference_threshold) {
+                iovcmd request(2 + 2 * fields.size(), "HMSET");
+                request << key;
+                for (size_t i = 0; i < fields.size(); i++)
+                    request << fields[i] << values[i];
+                send_(socket, request);
+            } else {
+                cmd_encoder & m = cmd_("HMSET");
+                m.expect(cmd_encoder::bulk_size(key.size()) + bulk_size_(fields) + bulk_size_(values));
+                m << key;
+                for (size_t i = 0; i < fields.size(); i++)
+                    m << fields[i] << values[i];
+                send_(socket, m);
+            }
             recv_ok_reply_(socket);
         }
 
         void hmset(const string_type & key, const string_pair_vector & field_value_pairs) {
-            fastcmd request(2 + 2 * field_value_pairs.size() + 2, "HMSET");
+            hmset(key, field_value_pairs, durability_);
+        }
+
+        void hmset(const string_type & key, const string_pair_vector & field_value_pairs, durability level) {
+            size_t payload = 0;
+            for (size_t i = 0; i < field_value_pairs.size(); i++)
+                payload = std::max(payload, field_value_pairs[i].second.size());
+            if (payload >= iovcmd::reference_threshold) {
+                iovcmd request(2 + 2 * field_value_pairs.size() + 2, "HMSET");
+                hmset_base(request, key, field_value_pairs, level);
+                return;
+            }
+            size_t bytes = cmd_encoder::bulk_size(key.size()) + 2 * cmd_encoder::bulk_size(11); // ids
+            for (size_t i = 0; i < field_value_pairs.size(); i++)
+                bytes += cmd_encoder::bulk_size(field_value_pairs[i].first.size())
+                    + cmd_encoder::bulk_size(field_value_pairs[i].second.size());
+            hmset_base(write_cmd_("HMSET").expect(bytes), key, field_value_pairs, level);
+        }
+
+    private:
+
+        template<typename REQUEST>
+        void hmset_base(REQUEST & request, const string_type & key, const string_pair_vector & field_value_pairs,
+                durability level) {
             request << key;
             for (size_t i = 0; i < field_value_pairs.size(); i++)
                 request << field_value_pairs[i].first << field_value_pairs[i].second;
-            request << clientId << ++lastRequestId;
-            sendRecvOk(key, request);
+            request.append_id(clientId).append_id(++lastRequestId);
+            sendRecvOk(key, request, level);
         }
 
+    public:
+
+        /**
+         * out is resized to one value per field, reusing the strings already in
+         * it; see mget().
+         */
         void hmget(const string_type & key, const string_vector & fields, string_vector & out) {
             int socket = get_socket(key);
-            makecmd m("HMGET");
-            m << key;
+            cmd_encoder & request = cmd_("HMGET");
+            request.expect(cmd_encoder::bulk_size(key.size()) + bulk_size_(fields));
+            request << key;
 
             for (size_t i = 0; i < fields.size(); i++)
-                m << fields[i];
+                request << fields[i];
 
-            send_(socket, m);
-            recv_multi_bulk_reply_(socket, out);
+            send_(socket, request);
+            recv_multi_bulk_reply_reuse_(socket, out);
         }
 
         int_type hincrby(const string_type & key, const string_type & field, int_type by) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HINCRBY") << key << field << by);
+            send_(socket, cmd_(commands::HINCRBY) << key << field << by);
             return recv_int_reply_(socket);
         }
 
         bool hexists(const string_type & key, const string_type & field) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HEXISTS") << key << field);
+            send_(socket, cmd_(commands::HEXISTS) << key << field);
             return recv_int_reply_(socket) == 1;
         }
 
         bool hdel(const string_type& key, const string_type& field) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HDEL") << key << field);
+            send_(socket, cmd_(commands::HDEL) << key << field);
             return recv_int_reply_(socket) == 1;
         }
 
         int_type hlen(const string_type & key) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HLEN") << key);
+            send_(socket, cmd_(commands::HLEN) << key);
             return recv_int_reply_(socket);
         }
 
         void hkeys(const string_type & key, string_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HKEYS") << key);
+            send_(socket, cmd_(commands::HKEYS) << key);
             recv_multi_bulk_reply_(socket, out);
         }
 
         void hvals(const string_type & key, string_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HVALS") << key);
+            send_(socket, cmd_(commands::HVALS) << key);
             recv_multi_bulk_reply_(socket, out);
         }
 
+        /**
+         * Lazy variant of hvals(); see string_range.
+         */
+        string_range hvals(const string_type & key) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::HVALS) << key);
+            string_range range;
+            recv_multi_bulk_range_(socket, range);
+            return range;
+        }
+
         void hgetall(const string_type & key, string_pair_vector & out) {
             int socket = get_socket(key);
-            send_(socket, makecmd("HGETALL") << key);
+            send_(socket, cmd_(commands::HGETALL) << key);
             string_vector s;
             recv_multi_bulk_reply_(socket, s);
+            for (size_t i = 0; i < s.size(); i += 2)
+                out.push_back(make_pair(std::move(s[i]), std::move(s[i + 1])));
+        }
+
+        /**
+         * Zero-copy variant of hgetall(); see get(key, string_ref &) for the
+         * lifetime of the returned views.
+         */
+        void hgetall(const string_type & key, string_ref_pair_vector & out) {
+            int socket = get_socket(key);
+            send_(socket, cmd_(commands::HGETALL) << key);
+            string_ref_vector s;
+            recv_multi_bulk_reply_(socket, s);
             for (size_t i = 0; i < s.size(); i += 2)
                 out.push_back(make_pair(s[i], s[i + 1]));
         }
@@ -2080,7 +4358,7 @@ namespace redis {
         void select(int_type dbindex) {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("SELECT") << dbindex);
+                send_(con.socket, cmd_(commands::SELECT) << dbindex);
             }
 
             BOOST_FOREACH(connection_data & con, connections_) {
@@ -2089,9 +4367,23 @@ namespace redis {
             }
         }
 
+        // Checks that every connection is alive; throws connection_error (or
+        // protocol_error) if one is not.
+        void ping() {
+
+            BOOST_FOREACH(const connection_data & con, connections_) {
+                send_(con.socket, cmd_("PING"));
+            }
+
+            BOOST_FOREACH(const connection_data & con, connections_) {
+                if (recv_single_line_reply_(con.socket) != "PONG")
+                    throw protocol_error("expected PONG response");
+            }
+        }
+
         void select(int_type dbindex, const connection_data & con) {
             int socket = con.socket;
-            send_(socket, makecmd("SELECT") << dbindex);
+            send_(socket, cmd_(commands::SELECT) << dbindex);
             recv_ok_reply_(socket);
 
             BOOST_FOREACH(connection_data & cur_con, connections_) {
@@ -2103,14 +4395,14 @@ namespace redis {
         void move(const string_type & key,
                 int_type dbindex) {
             int socket = get_socket(key);
-            send_(socket, makecmd("MOVE") << key << dbindex);
+            send_(socket, cmd_(commands::MOVE) << key << dbindex);
             recv_int_ok_reply_(socket);
         }
 
         void flushdb() {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("FLUSHDB"));
+                send_(con.socket, cmd_("FLUSHDB"));
             }
 
             BOOST_FOREACH(const connection_data & con, connections_) {
@@ -2120,7 +4412,7 @@ namespace redis {
 
         void flushdb(const connection_data & con) {
             int socket = con.socket;
-            send_(socket, makecmd("FLUSHDB"));
+            send_(socket, cmd_("FLUSHDB"));
             recv_ok_reply_(socket);
         }
 
@@ -2129,13 +4421,13 @@ namespace redis {
                 throw std::runtime_error("feature is not available in cluster mode");
 
             int socket = connections_[0].socket;
-            send_(socket, makecmd("FLUSHALL"));
+            send_(socket, cmd_("FLUSHALL"));
             recv_ok_reply_(socket);
         }
 
         void flushall(const connection_data & con) {
             int socket = con.socket;
-            send_(socket, makecmd("FLUSHALL"));
+            send_(socket, cmd_("FLUSHALL"));
             recv_ok_reply_(socket);
         }
 
@@ -2144,7 +4436,7 @@ namespace redis {
                 sort_order order = sort_order_ascending,
                 bool lexicographically = false) {
             int socket = get_socket(key);
-            makecmd m("SORT");
+            cmd_encoder & m = cmd_("SORT");
             m << key << (order == sort_order_ascending ? "ASC" : "DESC");
             if (lexicographically)
                 m << "ALPHA";
@@ -2153,13 +4445,31 @@ namespace redis {
             return recv_multi_bulk_reply_(socket, out);
         }
 
+        /**
+         * Lazy variant of sort(); see string_range.
+         */
+        string_range sort(const string_type & key,
+                sort_order order = sort_order_ascending,
+                bool lexicographically = false) {
+            int socket = get_socket(key);
+            cmd_encoder & m = cmd_("SORT");
+            m << key << (order == sort_order_ascending ? "ASC" : "DESC");
+            if (lexicographically)
+                m << "ALPHA";
+
+            send_(socket, m);
+            string_range range;
+            recv_multi_bulk_range_(socket, range);
+            return range;
+        }
+
         int_type sort(const string_type & key,
                 string_vector & out,
                 int_type limit_start,
                 int_type limit_end,
                 sort_order order = sort_order_ascending,
                 bool lexicographically = false) {
-            makecmd m("SORT");
+            cmd_encoder & m = cmd_("SORT");
             m << key
                     << "LIMIT"
                     << limit_start
@@ -2182,7 +4492,7 @@ namespace redis {
                 sort_order order = sort_order_ascending,
                 bool lexicographically = false) {
             int socket = get_socket(key);
-            makecmd m("SORT");
+            cmd_encoder & m = cmd_("SORT");
 
             m << key
                     << "BY" << by_pattern
@@ -2203,7 +4513,7 @@ namespace redis {
         void save() {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("SAVE"));
+                send_(con.socket, cmd_("SAVE"));
             }
 
             BOOST_FOREACH(const connection_data & con, connections_) {
@@ -2212,14 +4522,14 @@ namespace redis {
         }
 
         void save(const connection_data & con) {
-            send_(con.socket, makecmd("SAVE"));
+            send_(con.socket, cmd_("SAVE"));
             recv_ok_reply_(con.socket);
         }
 
         void bgsave() {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
-                send_(con.socket, makecmd("BGSAVE"));
+                send_(con.socket, cmd_("BGSAVE"));
             }
 
             BOOST_FOREACH(const connection_data & con, connections_) {
@@ -2230,7 +4540,7 @@ namespace redis {
         }
 
         void bgsave(const connection_data & con) {
-            send_(con.socket, makecmd("BGSAVE"));
+            send_(con.socket, cmd_("BGSAVE"));
             std::string reply = recv_single_line_reply_(con.socket);
             if (reply != REDIS_STATUS_REPLY_OK && reply != "Background saving started")
                 throw protocol_error("Unexpected response on bgsave: '" + reply + "'");
@@ -2241,7 +4551,7 @@ namespace redis {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
                 int socket = con.socket;
-                send_(socket, makecmd("LASTSAVE"));
+                send_(socket, cmd_("LASTSAVE"));
                 time_t cur = recv_int_reply_(socket);
                 if (res > 0)
                     res = std::min(cur, res);
@@ -2252,7 +4562,7 @@ namespace redis {
         }
 
         time_t lastsave(const connection_data & con) {
-            send_(con.socket, makecmd("LASTSAVE"));
+            send_(con.socket, cmd_("LASTSAVE"));
             return recv_int_reply_(con.socket);
         }
 
@@ -2260,7 +4570,7 @@ namespace redis {
 
             BOOST_FOREACH(const connection_data & con, connections_) {
                 int socket = con.socket;
-                send_(socket, makecmd("SHUTDOWN"));
+                send_(socket, cmd_("SHUTDOWN"));
 
                 // we expected to get a connection_error as redis closes the connection on shutdown command.
 
@@ -2272,7 +4582,7 @@ namespace redis {
         }
 
         void shutdown(const connection_data & con) {
-            send_(con.socket, makecmd("SHUTDOWN"));
+            send_(con.socket, cmd_("SHUTDOWN"));
 
             // we expected to get a connection_error as redis closes the connection on shutdown command.
 
@@ -2284,7 +4594,7 @@ namespace redis {
 
         void info(const connection_data & con, server_info & out) {
             int socket = con.socket;
-            send_(socket, makecmd("INFO"));
+            send_(socket, cmd_("INFO"));
             std::string response = recv_bulk_reply_(socket);
 
             if (response.empty())
@@ -2312,29 +4622,29 @@ namespace redis {
                 if (key == "redis_version")
                     out.version = val;
                 else if (key == "bgsave_in_progress")
-                    out.bgsave_in_progress = boost::lexical_cast<unsigned long>(val) == 1;
+                    out.bgsave_in_progress = parse_reply_number_<unsigned long>(val.data(), val.size()) == 1;
                 else if (key == "connected_clients")
-                    out.connected_clients = boost::lexical_cast<unsigned long>(val);
+                    out.connected_clients = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "connected_slaves")
-                    out.connected_slaves = boost::lexical_cast<unsigned long>(val);
+                    out.connected_slaves = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "used_memory")
-                    out.used_memory = boost::lexical_cast<unsigned long>(val);
+                    out.used_memory = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "changes_since_last_save")
-                    out.changes_since_last_save = boost::lexical_cast<unsigned long>(val);
+                    out.changes_since_last_save = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "last_save_time")
-                    out.last_save_time = boost::lexical_cast<unsigned long>(val);
+                    out.last_save_time = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "total_connections_received")
-                    out.total_connections_received = boost::lexical_cast<unsigned long>(val);
+                    out.total_connections_received = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "total_commands_processed")
-                    out.total_commands_processed = boost::lexical_cast<unsigned long>(val);
+                    out.total_commands_processed = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "uptime_in_seconds")
-                    out.uptime_in_seconds = boost::lexical_cast<unsigned long>(val);
+                    out.uptime_in_seconds = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "uptime_in_days")
-                    out.uptime_in_days = boost::lexical_cast<unsigned long>(val);
+                    out.uptime_in_days = parse_reply_number_<unsigned long>(val.data(), val.size());
                 else if (key == "role")
                     out.role = val == "master" ? role_master : role_slave;
                 else if (key == "arch_bits")
-                    out.arch_bits = boost::lexical_cast<unsigned short>(val);
+                    out.arch_bits = parse_reply_number_<unsigned short>(val.data(), val.size());
                 else if (key == "multiplexing_api")
                     out.multiplexing_api = val;
 #ifndef NDEBUG // Ignore new/unknown keys in release mode
@@ -2350,7 +4660,7 @@ namespace redis {
 
         int_type publish(const string_type & channel, const string_type & message) {
             int socket = get_socket(channel);
-            send_(socket, makecmd("PUBLISH") << channel << message);
+            send_(socket, cmd_("PUBLISH") << channel << message);
             return recv_int_reply_(socket);
         }
 
@@ -2358,17 +4668,163 @@ namespace redis {
         base_client(const base_client &);
         base_client & operator=(const base_client &);
 
+        // Sending a command releases the views handed out for earlier replies
+        // on the same connection and skips what is left of a lazily read reply.
+
         void send_(int socket, const std::string & msg) {
+            release_replies_(socket);
             if (anetWrite(socket, const_cast<char *> (msg.data()), msg.size()) == -1)
                 throw connection_error(strerror(errno));
 //            handle_connection_error(socket);
         }
         void send_(int socket, const char* data, int size) {
+            release_replies_(socket);
             if (anetWrite(socket, const_cast<char *>(data), size) == -1)
                 throw connection_error(strerror(errno));
 //            handle_connection_error(socket);
         }
 
+        void release_replies_(int socket) {
+            recv_buffer & rbuf = get_rbuf(socket);
+            rbuf.unpin();
+            rbuf.skip_unread(socket);
+        }
+
+        // A score range bound as ZRANGEBYSCORE and ZCOUNT take it, with a
+        // leading '(' if it is exclusive.
+        static void append_score_bound_(cmd_encoder & request, double score, bool exclusive) {
+            char buf[32];
+            char * p = buf;
+            if (exclusive)
+                *p++ = '(';
+            request.append(buf, format_number(p, score) - buf);
+        }
+
+        // Encoded size of args; see cmd_encoder::expect().
+        static size_t bulk_size_(const string_vector & args) {
+            size_t bytes = 0;
+            for (size_t i = 0; i < args.size(); i++)
+                bytes += cmd_encoder::bulk_size(args[i].size());
+            return bytes;
+        }
+
+        void send_(int socket, cmd_encoder & request) {
+            send_(socket, request.data(), request.size());
+        }
+
+        // Starts a command in the client's request buffer, which is reused by
+        // every command; see cmd_encoder. A command must be sent before the
+        // next one is started.
+        template<size_t N>
+        cmd_encoder & cmd_(const char (&cmd_name)[N]) {
+            return request_buf_.begin(cmd_name, N - 1);
+        }
+
+        template<size_t N>
+        cmd_encoder & cmd_(const command_spec<N> & spec) {
+            return request_buf_.begin(spec);
+        }
+
+        // Same for writes that go through sendRecvOk() and sendRecvInt(). They
+        // have a buffer of their own as they are sent again after reconnecting,
+        // which sends commands of its own (SELECT).
+        template<size_t N>
+        cmd_encoder & write_cmd_(const char (&cmd_name)[N]) {
+            return write_buf_.begin(cmd_name, N - 1);
+        }
+
+        template<size_t N>
+        cmd_encoder & write_cmd_(const command_spec<N> & spec) {
+            return write_buf_.begin(spec);
+        }
+
+        // Writes a scatter-gather command without flattening it.
+        void send_(int socket, iovcmd & request) {
+            release_replies_(socket);
+            if (!request.write_to(socket))
+                throw connection_error(strerror(errno));
+        }
+
+        // Makes sure a file holds the announced number of bytes, as a short
+        // read could not be recovered from once the header was sent.
+        void check_file_range_(int fd, off_t offset, size_t len) {
+            struct stat st;
+            if (fstat(fd, &st) == -1)
+                throw value_error(std::string("fstat failed: ") + strerror(errno));
+            if (!S_ISREG(st.st_mode))
+                throw value_error("not a regular file");
+            if (offset < 0 || static_cast<size_t> (st.st_size) < offset + len)
+                throw value_error("file is shorter than offset + len");
+        }
+
+        void send_request_(int socket, cmd_encoder & request) {
+            send_(socket, request);
+        }
+
+        void send_request_(int socket, iovcmd & request) {
+            send_(socket, request);
+        }
+
+        // Sends request between two plain commands, e.g. CLIENT REPLY SKIP
+        // or WAIT, in a single writev(); either may be empty.
+        void send_request_(int socket, const std::string & prefix, cmd_encoder & request,
+                const std::string & suffix) {
+            if (prefix.empty() && suffix.empty()) {
+                send_(socket, request);
+                return;
+            }
+            release_replies_(socket);
+            struct iovec iov[3];
+            int count = 0;
+            if (!prefix.empty()) {
+                iov[count].iov_base = const_cast<char *> (prefix.data());
+                iov[count++].iov_len = prefix.size();
+            }
+            iov[count].iov_base = const_cast<char *> (request.data());
+            iov[count++].iov_len = request.size();
+            if (!suffix.empty()) {
+                iov[count].iov_base = const_cast<char *> (suffix.data());
+                iov[count++].iov_len = suffix.size();
+            }
+            if (anetWritev(socket, iov, count) == -1)
+                throw connection_error(strerror(errno));
+        }
+
+        void send_request_(int socket, const std::string & prefix, iovcmd & request,
+                const std::string & suffix) {
+            if (!prefix.empty())
+                send_(socket, prefix);
+            send_(socket, request);
+            if (!suffix.empty())
+                send_(socket, suffix);
+        }
+
+        static const std::string & empty_cmd_() {
+            static const std::string cmd;
+            return cmd;
+        }
+
+        // Suppresses the reply to the command that follows it.
+        static const std::string & reply_skip_cmd_() {
+            static const std::string cmd = makecmd("CLIENT") << "REPLY" << "SKIP";
+            return cmd;
+        }
+
+        // Reads the reply to the WAIT sent after a durability_sync write.
+        void recv_sync_reply_(int socket) {
+            int_type acked = recv_int_reply_(socket);
+            if (acked < sync_backups_)
+                throw timeout_error("write acknowledged by " + boost::lexical_cast<std::string>(acked)
+                    + " of " + boost::lexical_cast<std::string>(sync_backups_) + " backups");
+        }
+
+        // Keeps the connection in step when a durability_sync write failed:
+        // its WAIT was sent all the same.
+        void skip_sync_reply_(int socket, durability level) {
+            if (level == durability_sync)
+                recv_int_reply_(socket);
+        }
+
         void handle_connection_error(int socket) {
             connection_data conn = connections_[get_connIdx(socket)];
             tracker.flushSession(socket, conn.host, conn.replayPort);
@@ -2548,333 +5004,2750 @@ namespace redis {
         }
 
         int_type recv_bulk_reply_(int socket, char prefix) {
-            std::string line = read_line(socket);
-
-            if (line[0] != prefix) {
+            long long length;
+            if (!get_rbuf(socket).read_header(socket, prefix, length)) {
+                // Consume the unexpected reply (e.g. an error) to stay in sync.
+                std::string line = read_line(socket);
 #ifndef NDEBUG
                 std::cerr << "unexpected prefix for bulk reply (expected '" << prefix << "' but got '" << line << "')" << std::endl;
 #endif // NDEBUG
                 throw protocol_error("unexpected prefix for bulk reply");
             }
 
-            return boost::lexical_cast<int_type>(line.substr(1));
+            return length;
+        }
+
+        std::string recv_bulk_reply_(int socket) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+
+            if (length == -1)
+                return missing_value();
+
+            if (length < 0)
+                throw protocol_error("invalid bulk reply data; negative length");
+
+            std::string data = read_n(socket, length);
+            recv_crlf_(socket);
+            return data;
+        }
+
+        // Stores a bulk reply in out, reusing its capacity.
+        void recv_bulk_reply_(int socket, string_type & out) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+
+            if (length == -1) {
+                out.assign(missing_value_view().data(), missing_value_view().size());
+                return;
+            }
+
+            if (length < 0)
+                throw protocol_error("invalid bulk reply data; negative length");
+
+            out.resize(length);
+            if (length > 0)
+                get_rbuf(socket).read_n(socket, &out[0], length);
+            recv_crlf_(socket);
+        }
+
+        // Parses the whole of [data, data + len) as a NUMBER; see parse_number().
+        template<typename NUMBER>
+        static NUMBER parse_reply_number_(const char * data, size_t len) {
+            NUMBER value;
+            if (!parse_number(data, data + len, value))
+                throw protocol_error("invalid number in reply");
+            return value;
+        }
+
+        // Parses a bulk reply holding a double, such as a score, in place.
+        double recv_double_reply_(int socket) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            if (length < 0)
+                throw protocol_error("invalid bulk reply data; negative length");
+
+            const char * data = get_rbuf(socket).read_view(socket, length + 2); // CRLF
+            if (data[length] != '\r' || data[length + 1] != '\n')
+                throw protocol_error("invalid bulk reply data; data of unexpected length");
+
+            return parse_reply_number_<double>(data, length);
+        }
+
+        string_ref recv_bulk_reply_view_(int socket) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+
+            if (length == -1)
+                return missing_value_view();
+
+            if (length < 0)
+                throw protocol_error("invalid bulk reply data; negative length");
+
+            const char * data = get_rbuf(socket).read_view(socket, length + 2); // CRLF
+            if (data[length] != '\r' || data[length + 1] != '\n')
+                throw protocol_error("invalid bulk reply data; data of unexpected length");
+
+            return string_ref(data, length);
+        }
+
+        // Passes a bulk value to sink in chunks; see get_to().
+        template<typename SINK>
+        bool recv_bulk_reply_to_(int socket, SINK & sink) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+
+            if (length == -1)
+                return false;
+
+            if (length < 0)
+                throw protocol_error("invalid bulk reply data; negative length");
+
+            get_rbuf(socket).read_chunks(socket, length, sink);
+            recv_crlf_(socket);
+            return true;
+        }
+
+        struct fd_sink {
+
+            explicit fd_sink(int fd) : fd(fd), error(0) {
+            }
+
+            void operator()(const char * data, size_t len) {
+                // Keep draining the reply after a failure.
+                if (error == 0 && anetWrite(fd, const_cast<char *> (data), len) == -1)
+                    error = errno;
+            }
+
+            int fd;
+            int error;
+        };
+
+        struct buffer_sink {
+
+            buffer_sink(char * buf, size_t size) : buf(buf), size(size), length(0) {
+            }
+
+            void operator()(const char * data, size_t len) {
+                if (length < size)
+                    memcpy(buf + length, data, std::min(len, size - length));
+                length += len;
+            }
+
+            char * buf;
+            size_t size;
+            size_t length;
+        };
+
+        void recv_crlf_(int socket) {
+            char crlf[2];
+            get_rbuf(socket).read_n(socket, crlf, 2);
+            if (crlf[0] != '\r' || crlf[1] != '\n')
+                throw protocol_error("invalid bulk reply data; data of unexpected length");
+        }
+
+        static string_ref missing_value_view() {
+            static const string_type missing = missing_value();
+            return missing;
+        }
+
+        int_type recv_multi_bulk_reply_(int socket, string_vector & out) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            out.reserve(out.size() + length);
+
+            for (int_type i = 0; i < length; ++i)
+                out.push_back(recv_bulk_reply_(socket));
+
+            return length;
+        }
+
+        int_type recv_multi_bulk_reply_(int socket, string_ref_vector & out) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            out.reserve(out.size() + length);
+
+            for (int_type i = 0; i < length; ++i)
+                out.push_back(recv_bulk_reply_view_(socket));
+
+            return length;
+        }
+
+        // Resizes out to the number of elements and reads each of them into
+        // the string already at its position.
+        void recv_multi_bulk_reply_reuse_(int socket, string_vector & out) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            out.resize(length);
+            for (int_type i = 0; i < length; ++i)
+                recv_bulk_reply_(socket, out[i]);
+        }
+
+        // Reads the header of a multi bulk reply and leaves its elements to be
+        // received as the returned range is iterated.
+        void recv_multi_bulk_range_(int socket, string_range & range) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            typename string_range::part p;
+            p.socket = socket;
+            p.rbuf = get_rbuf_ptr(socket);
+            p.lazy_id = p.rbuf->start_lazy(length);
+            range.parts_.push_back(p);
+            range.size_ += length;
+        }
+
+        int_type recv_multi_bulk_reply_(int socket, string_set & out) {
+            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+
+            if (length == -1)
+                throw key_error("no such key");
+
+            for (int_type i = 0; i < length; ++i)
+                out.insert(recv_bulk_reply_(socket));
+
+            return length;
+        }
+
+        template<typename INT_TYPE>
+        INT_TYPE recv_int_reply_(int socket) {
+            long long value = recv_int_reply_(socket);
+            if (value < static_cast<long long> (std::numeric_limits<INT_TYPE>::min())
+                    || (value > 0 && static_cast<unsigned long long> (value)
+                        > static_cast<unsigned long long> (std::numeric_limits<INT_TYPE>::max())))
+                throw protocol_error("integer reply out of range");
+            return static_cast<INT_TYPE> (value);
+        }
+
+        int_type recv_int_reply_(int socket) {
+            long long value;
+            if (!get_rbuf(socket).read_header(socket, REDIS_PREFIX_INT_REPLY, value)) {
+                // Consume the unexpected reply (e.g. an error) to stay in sync.
+                read_line(socket);
+                throw protocol_error("unexpected prefix for integer reply");
+            }
+
+            return value;
+        }
+
+        void recv_int_ok_reply_(int socket) {
+            if (recv_int_reply_(socket) != 1)
+                throw protocol_error("expecting int reply of 1");
+        }
+
+        connection_data& get_conn(const string_type & key) {
+            size_t con_count = connections_.size();
+            if (con_count == 1)
+                return connections_[0];
+            size_t idx = hasher_(key, static_cast<const std::vector<connection_data> &> (connections_));
+            return connections_[idx];
+        }
+
+        // Replaces the connection of socket, whose stream is not in step any
+        // more, and returns the new socket. That is ANET_ERR if the server
+        // can't be reached; the next command to it throws then.
+        int reconnect_(int socket) {
+            connection_data & con = connections_[get_connIdx(socket)];
+            if (con.socket != ANET_ERR)
+                close(con.socket);
+            try {
+                init(con);
+            } catch (const connection_error &) {
+            }
+            return con.socket;
+        }
+
+        int get_connIdx(int socket) {
+            for (uint i = 0; i < connections_.size(); ++i) {
+                if (connections_[i].socket == socket) {
+                    return static_cast<int>(i);
+                }
+            }
+            fprintf(stderr, "connIdx not found. socket: %d\n", socket);
+            throw redis_error("Something wrong.. get_connIdx failed.");
+        }
+
+        inline int get_socket(const string_type & key) {
+            size_t con_count = connections_.size();
+            if (con_count == 1)
+                return connections_[0].socket;
+            size_t idx = hasher_(key, static_cast<const std::vector<connection_data> &> (connections_));
+            return connections_[idx].socket;
+        }
+
+        int get_socket(const string_vector & keys) {
+            assert(!keys.empty());
+
+            if (connections_.size() == 1)
+                return connections_[0].socket;
+
+            int socket = -1;
+            for (size_t i = 0; i < keys.size(); i++) {
+                int cur_socket = get_socket(keys[i]);
+                if (i > 0 && socket != cur_socket)
+                    return -1;
+                //throw std::runtime_error("not possible in cluster mode");
+
+                socket = cur_socket;
+            }
+
+            return socket;
+        }
+
+        // Index into connections_ of the server the key is hashed to.
+        size_t get_conn_index_(const string_type & key) {
+            if (connections_.size() == 1)
+                return 0;
+            return hasher_(key, static_cast<const std::vector<connection_data> &> (connections_));
+        }
+
+        // Batches of at least this many keys spread over several servers are
+        // encoded on one thread per server; below it a thread costs more than
+        // it saves.
+        static const size_t parallel_encode_threshold = 4096;
+
+        // The keys of a multi-key command grouped by server, in the order the
+        // servers were first hit, with one request per server.
+        struct shard_batch {
+            std::vector<size_t> conns; // Index into connections_.
+            std::vector< std::vector<size_t> > indices; // Positions of the server's keys.
+            std::vector<cmd_encoder> requests;
+        };
+
+        static const string_type & key_of_(const string_type & key) {
+            return key;
+        }
+
+        static const string_type & key_of_(const string_pair & key_value) {
+            return key_value.first;
+        }
+
+        template<typename SEQ>
+        void group_by_shard_(const SEQ & items, shard_batch & batch) {
+            const size_t none = size_t(-1);
+            std::vector<size_t> slot_of(connections_.size(), none);
+            for (size_t i = 0; i < items.size(); i++) {
+                size_t conn = get_conn_index_(key_of_(items[i]));
+                if (slot_of[conn] == none) {
+                    slot_of[conn] = batch.conns.size();
+                    batch.conns.push_back(conn);
+                    batch.indices.push_back(std::vector<size_t>());
+                }
+                batch.indices[slot_of[conn]].push_back(i);
+            }
+            batch.requests.resize(batch.conns.size());
+        }
+
+        // Encodes one request per server: the command name followed by the
+        // server's items, and by their values if there is a separate vector.
+        template<typename SEQ>
+        struct shard_encoder {
+
+            shard_encoder(const char * name, const SEQ & items, shard_batch & batch,
+                    const string_vector * values = NULL)
+            : name(name), items(items), batch(batch), values(values) {
+            }
+
+            void operator()(size_t slot) {
+                const std::vector<size_t> & indices = batch.indices[slot];
+                cmd_encoder & request = batch.requests[slot];
+                request.begin(name, strlen(name));
+                for (size_t i = 0; i < indices.size(); i++) {
+                    append(request, items[indices[i]]);
+                    if (values)
+                        request << (*values)[indices[i]];
+                }
+            }
+
+            static void append(cmd_encoder & request, const string_type & key) {
+                request << key;
+            }
+
+            static void append(cmd_encoder & request, const string_pair & key_value) {
+                request << key_value.first << key_value.second;
+            }
+
+            const char * name;
+            const SEQ & items;
+            shard_batch & batch;
+            const string_vector * values;
+        };
+
+        // Appends an EXPIRE per key to each server's MSET.
+        struct msetex_encoder : shard_encoder<string_pair_vector> {
+
+            msetex_encoder(const string_pair_vector & key_value_pairs, shard_batch & batch, int_type seconds)
+            : shard_encoder<string_pair_vector>("MSET", key_value_pairs, batch), seconds(seconds),
+            expire_cmds(batch.conns.size()) {
+            }
+
+            void operator()(size_t slot) {
+                shard_encoder<string_pair_vector>::operator()(slot);
+
+                const std::vector<size_t> & indices = this->batch.indices[slot];
+                cmd_encoder expire;
+                for (size_t i = 0; i < indices.size(); i++) {
+                    expire.begin(commands::EXPIRE) << this->items[indices[i]].first << seconds;
+                    expire.append_to(expire_cmds[slot]);
+                }
+            }
+
+            int_type seconds;
+            string_vector expire_cmds;
+        };
+
+        template<typename ENCODER>
+        struct encode_task {
+
+            encode_task(ENCODER & encode, size_t slot, std::exception_ptr & error)
+            : encode(encode), slot(slot), error(error) {
+            }
+
+            void operator()() {
+                try {
+                    encode(slot);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            ENCODER & encode;
+            size_t slot;
+            std::exception_ptr & error;
+        };
+
+        // Calls encode(slot) for every server of the batch, concurrently when
+        // the batch is large.
+        template<typename ENCODER>
+        void encode_shards_(shard_batch & batch, size_t items, ENCODER & encode) {
+            size_t shards = batch.conns.size();
+            if (shards < 2 || items < parallel_encode_threshold) {
+                for (size_t slot = 0; slot < shards; slot++)
+                    encode(slot);
+                return;
+            }
+
+            std::vector<std::exception_ptr> errors(shards);
+            boost::thread_group workers;
+            for (size_t slot = 1; slot < shards; slot++)
+                workers.create_thread(encode_task<ENCODER>(encode, slot, errors[slot]));
+            encode_task<ENCODER>(encode, 0, errors[0])();
+            workers.join_all();
+
+            for (size_t slot = 0; slot < shards; slot++) {
+                if (errors[slot])
+                    std::rethrow_exception(errors[slot]);
+            }
+        }
+
+        // Replies owed by several servers, handed out by next_reply_() in the
+        // order they arrive rather than server by server, so that one slow
+        // server does not hold up parsing the replies of the others.
+        struct fan_in {
+
+            // replies is the number of replies per server, e.g. for
+            // pipelined commands.
+            fan_in(const std::vector<size_t> & conns, size_t replies = 1)
+            : conns(conns), owed(conns.size(), replies), remaining(conns.size() * replies) {
+            }
+
+            std::vector<size_t> conns; // Index into connections_.
+            std::vector<size_t> owed; // Replies still expected per server.
+            size_t remaining;
+            std::vector<size_t> readable; // Found readable by the last poll().
+            std::vector<pollfd> fds;
+        };
+
+        // Sets slot to the server whose next reply is to be read, or returns
+        // false once every owed reply was handed out. Servers with buffered
+        // data come first, then those poll() found readable. A reply is read
+        // with the blocking calls once its first bytes arrived.
+        bool next_reply_(fan_in & f, size_t & slot) {
+            if (f.remaining == 0)
+                return false;
+
+            size_t last = f.owed.size();
+            size_t waiting = 0;
+            for (size_t s = 0; s < f.owed.size(); s++) {
+                if (f.owed[s] == 0)
+                    continue;
+                if (connections_[f.conns[s]].rbuf->size() > 0)
+                    return take_reply_(f, s, slot);
+                last = s;
+                waiting++;
+            }
+
+            while (!f.readable.empty()) {
+                size_t s = f.readable.back();
+                f.readable.pop_back();
+                if (f.owed[s] > 0)
+                    return take_reply_(f, s, slot);
+            }
+
+            if (waiting == 1)
+                return take_reply_(f, last, slot);
+
+            f.fds.clear();
+            for (size_t s = 0; s < f.owed.size(); s++) {
+                if (f.owed[s] == 0)
+                    continue;
+                pollfd pfd;
+                pfd.fd = connections_[f.conns[s]].socket;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                f.fds.push_back(pfd);
+                f.readable.push_back(s);
+            }
+
+            int n;
+            do
+                n = ::poll(f.fds.data(), f.fds.size(), -1); while (n < 0 && errno == EINTR);
+            if (n < 0)
+                throw connection_error(std::string("poll error: ") + strerror(errno));
+
+            // Errors and hangups are readable too; the read reports them.
+            size_t kept = 0;
+            for (size_t i = 0; i < f.fds.size(); i++) {
+                if (f.fds[i].revents != 0)
+                    f.readable[kept++] = f.readable[i];
+            }
+            f.readable.resize(kept);
+
+            size_t s = f.readable.back();
+            f.readable.pop_back();
+            return take_reply_(f, s, slot);
+        }
+
+        bool take_reply_(fan_in & f, size_t s, size_t & slot) {
+            // The server's readiness is used up by reading from it.
+            f.readable.erase(std::remove(f.readable.begin(), f.readable.end(), s), f.readable.end());
+            --f.owed[s];
+            --f.remaining;
+            slot = s;
+            return true;
+        }
+
+        // Sends each server its request of the batch.
+        void send_shards_(shard_batch & batch) {
+            for (size_t slot = 0; slot < batch.conns.size(); slot++)
+                send_(connections_[batch.conns[slot]].socket, batch.requests[slot]);
+        }
+
+        std::vector<size_t> all_conns_() const {
+            std::vector<size_t> conns(connections_.size());
+            for (size_t i = 0; i < conns.size(); i++)
+                conns[i] = i;
+            return conns;
+        }
+
+        struct bulk_load_state {
+
+            struct shard {
+
+                shard() : unsent(0), in_flight(0) {
+                }
+
+                std::string out; // Encoded, not yet written.
+                size_t unsent;
+                size_t in_flight;
+            };
+
+            bulk_load_state(size_t conns, size_t window, const bulk_load_callback & progress)
+            : shards(conns), window(window), batch((window + 1) / 2), progress(progress),
+            start(boost::posix_time::microsec_clock::universal_time()), last_report(0) {
+            }
+
+            // Calls progress if a second passed since the last call, or if
+            // final is set.
+            void report(bool final) {
+                stats.seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+                if (!progress || (!final && stats.seconds < last_report + 1))
+                    return;
+                last_report = stats.seconds;
+                progress(stats);
+            }
+
+            std::vector<shard> shards; // Per connection.
+            size_t window;
+            size_t batch;
+            bulk_load_callback progress;
+            boost::posix_time::ptime start;
+            double last_report;
+            bulk_load_stats stats;
+            std::string first_error;
+        };
+
+        void bulk_encode_(cmd_encoder & request, const string_pair & key_value) {
+            request.begin(commands::SET) << key_value.first << key_value.second;
+            request.append_id(clientId).append_id(++lastRequestId);
+        }
+
+        void bulk_encode_(cmd_encoder & request, const std::pair<string_type, string_pair_vector> & hash) {
+            request.begin("HMSET", 5) << hash.first;
+            for (size_t i = 0; i < hash.second.size(); i++)
+                request << hash.second[i].first << hash.second[i].second;
+            request.append_id(clientId).append_id(++lastRequestId);
+        }
+
+        // Writes the unsent commands of a connection once the replies read
+        // made room for them in the window.
+        void bulk_flush_(bulk_load_state & st, size_t conn) {
+            typename bulk_load_state::shard & shard = st.shards[conn];
+            while (shard.in_flight > 0 && shard.in_flight + shard.unsent > st.window)
+                bulk_reap_(st, conn);
+
+            send_(connections_[conn].socket, shard.out);
+            shard.out.clear();
+            shard.in_flight += shard.unsent;
+            st.stats.sent += shard.unsent;
+            shard.unsent = 0;
+            st.report(false);
+        }
+
+        void bulk_reap_(bulk_load_state & st, size_t conn) {
+            // A status other than OK, as for a duplicate request id, is no
+            // error; see sendRecvOk.
+            try {
+                recv_single_line_reply_(connections_[conn].socket);
+            } catch (protocol_error & e) {
+                if (st.stats.failed++ == 0)
+                    st.first_error = e.what();
+            } catch (retry_error &) {
+                if (st.stats.failed++ == 0)
+                    st.first_error = "retry";
+            }
+            --st.shards[conn].in_flight;
+            ++st.stats.acked;
+        }
+
+#ifndef NDEBUG
+
+        void output_proto_debug(const std::string & data, bool is_received = true) {
+            std::string escaped_data(data);
+            size_t pos;
+            while ((pos = escaped_data.find("\n")) != std::string::npos)
+                escaped_data.replace(pos, 1, "\\n");
+            while ((pos = escaped_data.find("\r")) != std::string::npos)
+                escaped_data.replace(pos, 1, "\\r");
+
+            std::cerr << time(NULL) << ": "
+                    << (is_received ? "RECV '" : "SEND '")
+                    << escaped_data
+                    << "'"
+                    << std::endl;
+        }
+#endif
+
+        std::vector<std::string>::size_type split(const std::string & str, char delim, std::vector<std::string> & elems) {
+            std::stringstream ss(str);
+            std::string item;
+            std::vector<std::string>::size_type n = 0;
+            while (getline(ss, item, delim)) {
+                elems.push_back(item);
+                ++n;
+            }
+            return n;
+        }
+
+        inline std::string & rtrim(std::string & str, const std::string & ws = REDIS_WHITESPACE) {
+            std::string::size_type pos = str.find_last_not_of(ws);
+            str.erase(pos + 1);
+            return str;
+        }
+
+        inline void split_lines(const std::string & str, std::vector<std::string> & elems) {
+            split(str, '\n', elems);
+            for (std::vector<std::string>::iterator it = elems.begin(); it != elems.end(); ++it)
+                rtrim(*it);
+        }
+        // Reads N bytes from given blocking socket.
+
+        std::string read_n(int socket, ssize_t n) {
+            std::string data(n, '\0');
+            if (n > 0)
+                get_rbuf(socket).read_n(socket, &data[0], n);
+            return data;
+        }
+
+        reply_data_t recv_generic_reply_(int socket) {
+            reply_parser parser;
+            get_rbuf(socket).read_reply(socket, parser);
+            reply r = parser.take();
+
+            reply_data_t res;
+            res.first = r.type;
+            switch (r.type) {
+                case status_code_reply:
+                    res.second = std::move(r.str);
+                    break;
+                case error_reply:
+                {
+                    // The parser already dropped the leading '-'.
+                    const char * prefix = REDIS_PREFIX_STATUS_REPLY_ERROR + 1;
+                    if (r.str.compare(0, strlen(prefix), prefix) == 0)
+                        r.str.erase(0, strlen(prefix));
+                    res.second = std::move(r.str);
+                    break;
+                }
+                case int_reply:
+                    res.second = static_cast<int> (r.integer);
+                    break;
+                case bulk_reply:
+                    res.second = r.nil ? missing_value() : std::move(r.str);
+                    break;
+                case multi_bulk_reply:
+                {
+                    if (r.nil)
+                        throw key_error("no such key");
+                    string_vector v;
+                    v.reserve(r.elements.size());
+                    for (size_t i = 0; i < r.elements.size(); ++i) {
+                        reply & e = r.elements[i];
+                        if (e.type != bulk_reply)
+                            throw protocol_error("unexpected reply type in multi bulk reply");
+                        v.push_back(e.nil ? missing_value() : std::move(e.str));
+                    }
+                    res.second = std::move(v);
+                    break;
+                }
+                case no_reply:
+                    assert(false);
+            }
+            return res;
+        }
+
+        // Reads a single line of character data from the given blocking socket.
+        // Returns the line that was read, not including EOL delimiter(s).  Both LF
+        // ('\n') and CRLF ("\r\n") delimiters are supported.  If there was an I/O
+        // error reading from the socket, connection_error is raised.
+
+        std::string read_line(int socket) {
+            assert(socket > 0);
+
+            size_t len;
+            const char * line = get_rbuf(socket).read_line(socket, len);
+            return std::string(line, len);
+        }
+
+        recv_buffer & get_rbuf(int socket) {
+            return *get_rbuf_ptr(socket);
+        }
+
+        const boost::shared_ptr<recv_buffer> & get_rbuf_ptr(int socket) {
+            if (connections_.size() == 1)
+                return connections_[0].rbuf;
+            return connections_[get_connIdx(socket)].rbuf;
+        }
+
+    private:
+        std::vector<connection_data> connections_;
+        //int socket_;
+        CONSISTENT_HASHER hasher_;
+    public:
+        cmd_encoder request_buf_;
+        cmd_encoder write_buf_;
+        uint64_t clientId; // Must not be 0. either random or assigned by server.
+        uint64_t lastRequestId;
+        durability durability_; // For writes that do not name one.
+        int sync_backups_;
+        int sync_timeout_ms_;
+        std::string sync_cmd_; // WAIT sync_backups_ sync_timeout_ms_
+        uint64_t witness_writes_;
+        uint64_t witness_syscalls_;
+        // Scratch space of sendWitnessRecord() and receiveWitnessReply().
+        std::vector<mmsghdr> witness_msgs_;
+        std::vector<iovec> witness_iovs_;
+        std::vector<char> witness_replies_;
+        RAMCloud::UnsyncedRpcTracker tracker;
+    };
+
+    struct default_hasher {
+
+        inline size_t operator()(const std::string & key, const std::vector<connection_data> & connections) {
+            return boost::hash<std::string>()(key) % connections.size();
+        }
+    };
+
+    typedef base_client<default_hasher> client;
+
+    // Typed access to a reply of the expected type, shared by the clients
+    // that hand out parsed replies (pipeline, async and coroutine clients).
+    // Errors are thrown as the blocking calls throw them.
+
+    struct reply_cast {
+
+        // Throws the error in an error reply, or connection_error for a
+        // command that was dropped without a reply (see base_async_client).
+        static void check(const reply & r) {
+            if (r.type == error_reply)
+                throw_error(r.str);
+            if (r.type == no_reply)
+                throw connection_error(r.str.empty() ? "no reply" : r.str);
+        }
+
+        static void throw_error(const std::string & line) {
+            if (line.compare(0, strlen(REDIS_PREFIX_STATUS_REPLY_RETRY) - 1, REDIS_PREFIX_STATUS_REPLY_RETRY + 1) == 0)
+                throw retry_error();
+            // The parser already dropped the leading '-'.
+            const char * prefix = REDIS_PREFIX_STATUS_REPLY_ERROR + 1;
+            if (line.compare(0, strlen(prefix), prefix) == 0)
+                throw protocol_error(line.substr(strlen(prefix)));
+            throw protocol_error(line.empty() ? "unknown error" : line);
+        }
+
+        static void get(reply & r, std::string & out) {
+            if (r.type == bulk_reply)
+                out = r.nil ? client::missing_value() : std::move(r.str);
+            else if (r.type == status_code_reply)
+                out = std::move(r.str);
+            else
+                throw protocol_error("unexpected reply type; expected bulk or status reply");
+        }
+
+        static void get(reply & r, long & out) {
+            if (r.type != int_reply)
+                throw protocol_error("unexpected reply type; expected integer reply");
+            out = r.integer;
+        }
+
+        static void get(reply & r, bool & out) {
+            long value;
+            get(r, value);
+            out = value != 0;
+        }
+
+        static void get(reply & r, double & out) {
+            if (r.type != bulk_reply)
+                throw protocol_error("unexpected reply type; expected bulk reply");
+            if (r.nil)
+                throw key_error("no such key");
+            if (!parse_number(r.str.data(), r.str.data() + r.str.size(), out))
+                throw protocol_error("invalid number in reply");
+        }
+
+        static void get(reply & r, std::vector<std::string> & out) {
+            if (r.type != multi_bulk_reply)
+                throw protocol_error("unexpected reply type; expected multi bulk reply");
+            if (r.nil)
+                throw key_error("no such key");
+            out.clear();
+            out.reserve(r.elements.size());
+            for (size_t i = 0; i < r.elements.size(); ++i) {
+                reply & e = r.elements[i];
+                if (e.type != bulk_reply)
+                    throw protocol_error("unexpected reply type in multi bulk reply");
+                out.push_back(e.nil ? client::missing_value() : std::move(e.str));
+            }
+        }
+    };
+
+    // Reply to a command queued on a pipeline, filled in by the pipeline's
+    // execute(). get() returns it, or throws what the direct call would have
+    // thrown for it, e.g. protocol_error for an error reply. Copies share the
+    // same reply.
+
+    template<typename T>
+    class pipeline_result {
+    public:
+
+        pipeline_result() {
+        }
+
+        bool ready() const {
+            return slot_ && slot_->ready;
+        }
+
+        const T & get() const {
+            if (!ready())
+                throw std::logic_error("pipeline not executed yet");
+            if (slot_->error)
+                std::rethrow_exception(slot_->error);
+            return slot_->value;
+        }
+
+    private:
+
+        struct slot {
+
+            slot() : ready(false), value() {
+            }
+
+            bool ready;
+            std::exception_ptr error;
+            T value;
+        };
+
+        explicit pipeline_result(const boost::shared_ptr<slot> & s) : slot_(s) {
+        }
+
+        boost::shared_ptr<slot> slot_;
+
+        template<typename CONSISTENT_HASHER>
+        friend class base_pipeline;
+    };
+
+    /**
+     * Queues commands for a client and sends them with one write per server
+     * when execute() is called, then reads all replies. Each command is
+     * hashed to its server once, when it is queued, and hands back a typed
+     * pipeline_result that execute() resolves:
+     *
+     *   redis::pipeline p(c);
+     *   redis::pipeline_result<std::string> v = p.get("foo");
+     *   redis::pipeline_result<redis::client::int_type> n = p.incr("bar");
+     *   p.execute();
+     *   std::cout << v.get() << n.get();
+     *
+     * Writes that carry client and request ids (SET, INCR, LPUSH) get them
+     * as the direct calls do, but are not recorded on witnesses. A pipeline
+     * can be executed again; its buffers are reused. It must not be used
+     * together with other calls on the same client until executed.
+     */
+    template<typename CONSISTENT_HASHER>
+    class base_pipeline {
+    public:
+        typedef base_client<CONSISTENT_HASHER> client_type;
+        typedef typename client_type::string_type string_type;
+        typedef typename client_type::string_vector string_vector;
+        typedef typename client_type::int_type int_type;
+
+        explicit base_pipeline(client_type & client) : client_(client), queued_(0) {
+        }
+
+        // Number of commands queued since the last execute().
+        size_t size() const {
+            return queued_;
+        }
+
+        // Queues any command, sent to the server of its key (see
+        // makecmd::key_name()). T is one of the types of the typed calls.
+        template<typename T>
+        pipeline_result<T> queue(const makecmd & cmd) {
+            batch & b = batch_for(client_.get_socket(cmd.key_name()));
+            std::string request = cmd;
+            b.requests.append(request);
+            return add<T>(b);
+        }
+
+        pipeline_result<string_type> get(const string_type & key) {
+            return add<string_type>(key, request(commands::GET) << key);
+        }
+
+        // Status reply ("OK").
+        pipeline_result<string_type> set(const string_type & key, const string_type & value) {
+            cmd_encoder & r = request(commands::SET) << key << value;
+            r.append_id(client_.clientId).append_id(++client_.lastRequestId);
+            return add<string_type>(key, r);
+        }
+
+        pipeline_result<string_type> getset(const string_type & key, const string_type & value) {
+            return add<string_type>(key, request(commands::GETSET) << key << value);
+        }
+
+        pipeline_result<bool> exists(const string_type & key) {
+            return add<bool>(key, request(commands::EXISTS) << key);
+        }
+
+        pipeline_result<bool> del(const string_type & key) {
+            return add<bool>(key, request(commands::DEL) << key);
+        }
+
+        pipeline_result<bool> expire(const string_type & key, unsigned int secs) {
+            return add<bool>(key, request(commands::EXPIRE) << key << secs);
+        }
+
+        pipeline_result<int_type> incr(const string_type & key) {
+            cmd_encoder & r = request(commands::INCR) << key;
+            r.append_id(client_.clientId).append_id(++client_.lastRequestId);
+            return add<int_type>(key, r);
+        }
+
+        pipeline_result<int_type> incrby(const string_type & key, int_type by) {
+            return add<int_type>(key, request(commands::INCRBY) << key << by);
+        }
+
+        pipeline_result<int_type> decr(const string_type & key) {
+            return add<int_type>(key, request(commands::DECR) << key);
+        }
+
+        pipeline_result<int_type> decrby(const string_type & key, int_type by) {
+            return add<int_type>(key, request(commands::DECRBY) << key << by);
+        }
+
+        pipeline_result<int_type> lpush(const string_type & key, const string_type & value) {
+            cmd_encoder & r = request(commands::LPUSH) << key << value;
+            r.append_id(client_.clientId).append_id(++client_.lastRequestId);
+            return add<int_type>(key, r);
+        }
+
+        pipeline_result<int_type> rpush(const string_type & key, const string_type & value) {
+            return add<int_type>(key, request(commands::RPUSH) << key << value);
+        }
+
+        pipeline_result<int_type> llen(const string_type & key) {
+            return add<int_type>(key, request(commands::LLEN) << key);
+        }
+
+        pipeline_result<string_vector> lrange(const string_type & key, int_type start, int_type end) {
+            return add<string_vector>(key, request(commands::LRANGE) << key << start << end);
+        }
+
+        pipeline_result<bool> sadd(const string_type & key, const string_type & member) {
+            return add<bool>(key, request(commands::SADD) << key << member);
+        }
+
+        pipeline_result<bool> srem(const string_type & key, const string_type & member) {
+            return add<bool>(key, request(commands::SREM) << key << member);
+        }
+
+        pipeline_result<bool> sismember(const string_type & key, const string_type & member) {
+            return add<bool>(key, request(commands::SISMEMBER) << key << member);
+        }
+
+        pipeline_result<string_vector> smembers(const string_type & key) {
+            return add<string_vector>(key, request(commands::SMEMBERS) << key);
+        }
+
+        // True if member was added, false if only its score was updated.
+        pipeline_result<bool> zadd(const string_type & key, double score, const string_type & member) {
+            return add<bool>(key, request(commands::ZADD) << key << score << member);
+        }
+
+        pipeline_result<double> zincrby(const string_type & key, const string_type & member, double increment) {
+            return add<double>(key, request(commands::ZINCRBY) << key << increment << member);
+        }
+
+        // get() throws key_error if member is not in the set.
+        pipeline_result<double> zscore(const string_type & key, const string_type & member) {
+            return add<double>(key, request(commands::ZSCORE) << key << member);
+        }
+
+        pipeline_result<string_vector> zrange(const string_type & key, int_type start, int_type end) {
+            return add<string_vector>(key, request(commands::ZRANGE) << key << start << end);
+        }
+
+        pipeline_result<bool> hset(const string_type & key, const string_type & field, const string_type & value) {
+            return add<bool>(key, request(commands::HSET) << key << field << value);
+        }
+
+        pipeline_result<string_type> hget(const string_type & key, const string_type & field) {
+            return add<string_type>(key, request(commands::HGET) << key << field);
+        }
+
+        pipeline_result<bool> hdel(const string_type & key, const string_type & field) {
+            return add<bool>(key, request(commands::HDEL) << key << field);
+        }
+
+        pipeline_result<int_type> hincrby(const string_type & key, const string_type & field, int_type by) {
+            return add<int_type>(key, request(commands::HINCRBY) << key << field << by);
+        }
+
+        // Fields and values, alternating.
+        pipeline_result<string_vector> hgetall(const string_type & key) {
+            return add<string_vector>(key, request(commands::HGETALL) << key);
+        }
+
+        /**
+         * Sends the queued commands, one write per server, and resolves their
+         * results in order. Error replies to single commands only fail their
+         * own result. A connection or protocol error fails the results of
+         * its server that were not read yet, and that server is reconnected;
+         * the replies of the other servers are all read before the first
+         * such error is thrown from here, so the client stays in step.
+         */
+        void execute() {
+            std::exception_ptr error;
+            for (size_t i = 0; i < batches_.size(); ++i) {
+                batch & b = batches_[i];
+                b.resolved = 0;
+                if (b.pending.empty())
+                    continue;
+                try {
+                    client_.send_(b.socket, b.requests);
+                } catch (...) {
+                    fail(b, error);
+                }
+            }
+            for (size_t i = 0; i < batches_.size(); ++i) {
+                batch & b = batches_[i];
+                try {
+                    recv_buffer & rbuf = client_.get_rbuf(b.socket);
+                    for (; b.resolved < b.pending.size(); ++b.resolved) {
+                        reply_parser parser;
+                        rbuf.read_reply(b.socket, parser);
+                        reply r = parser.take();
+                        b.pending[b.resolved]->resolve(r);
+                    }
+                } catch (...) {
+                    fail(b, error);
+                }
+            }
+            clear();
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        // Drops the queued commands without sending them.
+        void clear() {
+            for (size_t i = 0; i < batches_.size(); ++i) {
+                batches_[i].requests.clear();
+                batches_[i].pending.clear();
+            }
+            queued_ = 0;
+        }
+
+    private:
+
+        struct pending_base {
+
+            virtual ~pending_base() {
+            }
+
+            virtual void resolve(reply & r) = 0;
+        };
+
+        template<typename T>
+        struct pending : pending_base {
+            typedef typename pipeline_result<T>::slot slot_type;
+
+            explicit pending(const boost::shared_ptr<slot_type> & s) : slot(s) {
+            }
+
+            void resolve(reply & r) {
+                try {
+                    reply_cast::check(r);
+                    reply_cast::get(r, slot->value);
+                } catch (const redis_error &) {
+                    slot->error = std::current_exception();
+                }
+                slot->ready = true;
+            }
+
+            boost::shared_ptr<slot_type> slot;
+        };
+
+        // Commands for one server, in the order they were queued.
+        struct batch {
+            int socket;
+            std::string requests;
+            std::vector< boost::shared_ptr<pending_base> > pending;
+            size_t resolved; // Replies read by execute() so far.
+        };
+
+        // Called from a catch block of execute() for the server of b: keeps
+        // the first error, fails the results that got no reply and replaces
+        // the connection, whose stream is not in step any more.
+        void fail(batch & b, std::exception_ptr & error) {
+            std::string what = "connection error";
+            try {
+                throw;
+            } catch (const std::exception & e) {
+                what = e.what();
+            } catch (...) {
+            }
+            if (!error)
+                error = std::current_exception();
+            for (; b.resolved < b.pending.size(); ++b.resolved) {
+                reply r; // no_reply: resolve() fails the result.
+                r.str = what;
+                b.pending[b.resolved]->resolve(r);
+            }
+            b.socket = client_.reconnect_(b.socket);
+        }
+
+        template<size_t N>
+        cmd_encoder & request(const command_spec<N> & spec) {
+            return encoder_.begin(spec);
+        }
+
+        template<typename T>
+        pipeline_result<T> add(const string_type & key, cmd_encoder & r) {
+            batch & b = batch_for(client_.get_socket(key));
+            b.requests.append(r.data(), r.size());
+            return add<T>(b);
+        }
+
+        template<typename T>
+        pipeline_result<T> add(batch & b) {
+            boost::shared_ptr<typename pipeline_result<T>::slot> s(new typename pipeline_result<T>::slot());
+            b.pending.push_back(boost::shared_ptr<pending_base> (new pending<T>(s)));
+            ++queued_;
+            return pipeline_result<T>(s);
+        }
+
+        // There are few servers, so a linear search beats a map.
+        batch & batch_for(int socket) {
+            for (size_t i = 0; i < batches_.size(); ++i) {
+                if (batches_[i].socket == socket)
+                    return batches_[i];
+            }
+            batches_.push_back(batch());
+            batches_.back().socket = socket;
+            return batches_.back();
+        }
+
+        base_pipeline(const base_pipeline &);
+        base_pipeline & operator=(const base_pipeline &);
+
+        client_type & client_;
+        cmd_encoder encoder_;
+        std::vector<batch> batches_;
+        size_t queued_;
+    };
+
+    typedef base_pipeline<default_hasher> pipeline;
+
+    /**
+     * Client that keeps many commands in flight on each connection from a
+     * single thread, for load generation and fan-out. Sockets are
+     * non-blocking and driven by an epoll loop: commands are encoded into a
+     * per-connection output buffer and written by poll(), all that were
+     * queued since the last write in one go, and replies are parsed as they
+     * arrive and handed to each command's callback in order.
+     *
+     *   redis::async_client ac("127.0.0.1");
+     *   ac.set("foo", "bar", [](redis::reply & r) { ... });
+     *   ac.get("foo", [](redis::reply & r) { ... });
+     *   ac.run(); // Until every callback ran.
+     *
+     * Callbacks run on the thread calling poll() or run() and may queue more
+     * commands. Error replies reach the callback as error_reply. A connection
+     * error is thrown from poll() once, after the callbacks of the commands
+     * in flight on that connection got a no_reply with the error in str;
+     * later commands for it throw from send(). Writes
+     * that carry client and request ids (SET, INCR, LPUSH) get them as with
+     * base_client, but are not recorded on witnesses.
+     */
+    template<typename CONSISTENT_HASHER>
+    class base_async_client {
+    public:
+        typedef std::string string_type;
+        typedef long int_type;
+        typedef boost::function<void (reply &) > callback;
+
+        explicit base_async_client(const string_type & host = "localhost",
+                uint16_t port = 6379, int_type dbindex = 0) {
+            connection_data con;
+            con.host = host;
+            con.port = port;
+            con.dbindex = dbindex;
+            init(&con, &con + 1);
+        }
+
+        template<typename CON_ITERATOR>
+        base_async_client(CON_ITERATOR begin, CON_ITERATOR end) {
+            init(begin, end);
+        }
+
+        ~base_async_client() {
+            for (size_t i = 0; i < connections_.size(); ++i)
+                close(connections_[i].fd);
+            close(epoll_fd_);
+        }
+
+        // Queues a command built by the caller, sent to the server of
+        // hash_key. request may be reused as soon as this returns.
+        void send(const string_type & hash_key, cmd_encoder & request, const callback & done) {
+            connection & con = connection_for(hash_key);
+            if (!con.error.empty())
+                throw connection_error(con.error);
+            enqueue(con, request, done);
+        }
+
+        void get(const string_type & key, const callback & done) {
+            send(key, encoder_.begin(commands::GET) << key, done);
+        }
+
+        void set(const string_type & key, const string_type & value, const callback & done) {
+            cmd_encoder & request = encoder_.begin(commands::SET) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            send(key, request, done);
+        }
+
+        void incr(const string_type & key, const callback & done) {
+            cmd_encoder & request = encoder_.begin(commands::INCR) << key;
+            request.append_id(clientId).append_id(++lastRequestId);
+            send(key, request, done);
+        }
+
+        void lpush(const string_type & key, const string_type & value, const callback & done) {
+            cmd_encoder & request = encoder_.begin(commands::LPUSH) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            send(key, request, done);
+        }
+
+        void del(const string_type & key, const callback & done) {
+            send(key, encoder_.begin(commands::DEL) << key, done);
+        }
+
+        void hset(const string_type & key, const string_type & field, const string_type & value, const callback & done) {
+            send(key, encoder_.begin(commands::HSET) << key << field << value, done);
+        }
+
+        void hget(const string_type & key, const string_type & field, const callback & done) {
+            send(key, encoder_.begin(commands::HGET) << key << field, done);
+        }
+
+        void zadd(const string_type & key, double score, const string_type & member, const callback & done) {
+            send(key, encoder_.begin(commands::ZADD) << key << score << member, done);
+        }
+
+        // Commands sent or queued whose callback has not run yet.
+        size_t pending() const {
+            return pending_;
+        }
+
+        /**
+         * Writes what was queued, waits up to timeout_ms (-1 for no limit) for
+         * sockets to become ready and runs the callbacks of the replies that
+         * arrived. Returns the number of callbacks run.
+         */
+        size_t poll(int timeout_ms = -1) {
+            size_t completed = 0;
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                connection & con = connections_[i];
+                if (!con.error.empty())
+                    continue;
+                try {
+                    flush(con);
+                } catch (connection_error & e) {
+                    completed += drop(con, e.what());
+                    throw;
+                }
+            }
+
+            epoll_event events[max_events];
+            int n = epoll_wait(epoll_fd_, events, max_events, timeout_ms);
+            if (n == -1) {
+                if (errno == EINTR)
+                    return completed;
+                throw connection_error(std::string("epoll_wait failed: ") + strerror(errno));
+            }
+
+            std::exception_ptr callback_error;
+            for (int i = 0; i < n; ++i) {
+                connection & con = connections_[events[i].data.u32];
+                if (!con.error.empty())
+                    continue; // Dropped by a callback of an earlier event.
+                try {
+                    // Replies that arrived before a hangup are still read.
+                    if (events[i].events & EPOLLIN)
+                        completed += read_replies(con, callback_error);
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        std::string err = socket_error(con);
+                        throw connection_error(err.empty() ? "connection was closed" : err);
+                    }
+                    if (events[i].events & EPOLLOUT) {
+                        if (con.connecting) {
+                            std::string err = socket_error(con);
+                            if (!err.empty())
+                                throw connection_error(err);
+                            con.connecting = false;
+                        }
+                        flush(con);
+                    }
+                } catch (connection_error & e) {
+                    completed += drop(con, e.what());
+                    throw;
+                }
+            }
+            if (callback_error)
+                std::rethrow_exception(callback_error);
+            return completed;
+        }
+
+        // Polls until every queued command completed.
+        void run() {
+            while (pending_ > 0)
+                poll(-1);
+        }
+
+        uint64_t clientId; // Must not be 0; see base_client.
+        uint64_t lastRequestId;
+
+    private:
+        static const int max_events = 64;
+        static const size_t read_size = 64 * 1024;
+
+        struct connection {
+            int fd;
+            bool connecting; // Non-blocking connect not confirmed yet.
+            bool writable_armed; // Registered for EPOLLOUT.
+            std::string out; // Encoded commands, written from out_pos on.
+            size_t out_pos;
+            std::deque<callback> callbacks; // One per command in flight.
+            reply_parser parser;
+            std::string error; // Why the connection was dropped, if it was.
+        };
+
+        template<typename CON_ITERATOR>
+        void init(CON_ITERATOR begin, CON_ITERATOR end) {
+            clientId = rand() + 1; // Must not be 0.
+            lastRequestId = 0;
+            pending_ = 0;
+            epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd_ == -1)
+                throw connection_error(std::string("epoll_create1 failed: ") + strerror(errno));
+
+            for (; begin != end; ++begin)
+                hosts_.push_back(*begin);
+            if (hosts_.empty())
+                throw std::runtime_error("No connections given!");
+            connections_.resize(hosts_.size());
+
+            for (size_t i = 0; i < hosts_.size(); ++i) {
+                char err[ANET_ERR_LEN];
+                connection & con = connections_[i];
+                con.fd = anetTcpNonBlockConnect(err, const_cast<char *> (hosts_[i].host.c_str()), hosts_[i].port);
+                if (con.fd == ANET_ERR) {
+                    std::ostringstream os;
+                    os << err << " (redis://" << hosts_[i].host << ':' << hosts_[i].port << ")";
+                    throw connection_error(os.str());
+                }
+                anetTcpNoDelay(NULL, con.fd);
+                con.connecting = true;
+                con.writable_armed = true;
+                con.out_pos = 0;
+
+                epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.u64 = 0;
+                ev.data.u32 = static_cast<uint32_t> (i);
+                if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, con.fd, &ev) == -1)
+                    throw connection_error(std::string("epoll_ctl failed: ") + strerror(errno));
+
+                if (hosts_[i].dbindex != 0)
+                    enqueue(con, encoder_.begin(commands::SELECT) << hosts_[i].dbindex, &ignore_reply);
+            }
+        }
+
+        static void ignore_reply(reply &) {
+        }
+
+        connection & connection_for(const string_type & key) {
+            if (connections_.size() == 1)
+                return connections_[0];
+            return connections_[hasher_(key, static_cast<const std::vector<connection_data> &> (hosts_))];
+        }
+
+        void enqueue(connection & con, cmd_encoder & request, const callback & done) {
+            con.out.append(request.data(), request.size());
+            con.callbacks.push_back(done);
+            ++pending_;
+        }
+
+        // Writes as much of the output buffer as the socket takes, and waits
+        // for EPOLLOUT only while some of it is left.
+        void flush(connection & con) {
+            if (con.connecting)
+                return;
+            while (con.out_pos < con.out.size()) {
+                ssize_t n = ::send(con.fd, con.out.data() + con.out_pos,
+                        con.out.size() - con.out_pos, MSG_NOSIGNAL);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    throw connection_error(strerror(errno));
+                }
+                con.out_pos += n;
+            }
+            if (con.out_pos == con.out.size()) {
+                con.out.clear();
+                con.out_pos = 0;
+            }
+            bool blocked = !con.out.empty();
+            if (blocked != con.writable_armed) {
+                epoll_event ev;
+                ev.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+                ev.data.u64 = 0;
+                ev.data.u32 = static_cast<uint32_t> (&con - &connections_[0]);
+                if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, con.fd, &ev) == -1)
+                    throw connection_error(std::string("epoll_ctl failed: ") + strerror(errno));
+                con.writable_armed = blocked;
+            }
+        }
+
+        // Stops watching con and hands error to the callbacks of the commands
+        // in flight on it. Returns the number of callbacks run.
+        size_t drop(connection & con, const std::string & error) {
+            con.error = error;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, con.fd, NULL);
+            con.out.clear();
+            con.out_pos = 0;
+            std::deque<callback> callbacks;
+            callbacks.swap(con.callbacks);
+            pending_ -= callbacks.size();
+            for (size_t i = 0; i < callbacks.size(); ++i) {
+                reply r;
+                r.str = error;
+                try {
+                    callbacks[i](r);
+                } catch (...) {
+                    // The connection error is what poll() reports.
+                }
+            }
+            return callbacks.size();
+        }
+
+        // Reads what the socket has and runs the callback of every reply
+        // completed by it. What a callback throws is kept in callback_error,
+        // the first of it, so that the rest of what was read is still parsed.
+        size_t read_replies(connection & con, std::exception_ptr & callback_error) {
+            size_t completed = 0;
+            while (true) {
+                ssize_t n = ::recv(con.fd, read_buf_, read_size, 0);
+                if (n == 0)
+                    throw connection_error("connection was closed");
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    throw connection_error(std::string("recv error: ") + strerror(errno));
+                }
+
+                const char * p = read_buf_;
+                const char * end = read_buf_ + n;
+                while (p < end) {
+                    p += con.parser.feed(p, end - p);
+                    if (!con.parser.has_reply())
+                        break;
+                    reply r = con.parser.take();
+                    if (con.callbacks.empty())
+                        throw protocol_error("reply without a command");
+                    callback done;
+                    done.swap(con.callbacks.front());
+                    con.callbacks.pop_front();
+                    --pending_;
+                    ++completed;
+                    try {
+                        done(r);
+                    } catch (...) {
+                        if (!callback_error)
+                            callback_error = std::current_exception();
+                    }
+                }
+                if (static_cast<size_t> (n) < read_size)
+                    break;
+            }
+            return completed;
+        }
+
+        static std::string socket_error(const connection & con) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(con.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+                err = errno;
+            return err == 0 ? std::string() : std::string("socket error: ") + strerror(err);
+        }
+
+        base_async_client(const base_async_client &);
+        base_async_client & operator=(const base_async_client &);
+
+        std::vector<connection_data> hosts_;
+        std::vector<connection> connections_;
+        CONSISTENT_HASHER hasher_;
+        cmd_encoder encoder_;
+        int epoll_fd_;
+        size_t pending_;
+        char read_buf_[read_size];
+    };
+
+    typedef base_async_client<default_hasher> async_client;
+
+    /**
+     * Client that any number of threads share, with one connection per
+     * server. Callers block as with base_client, but their commands are
+     * pipelined with those of the other threads: they are pushed onto a
+     * lock-free queue, a writer thread per connection sends whatever is
+     * queued with one write, and a reader thread hands the replies back in
+     * the order the commands were written.
+     *
+     * Writes that carry client and request ids (SET, INCR, LPUSH) get them
+     * from an atomic counter, but are not recorded on witnesses. Once a
+     * connection failed, its pending and later commands throw
+     * connection_error.
+     */
+    template<typename CONSISTENT_HASHER>
+    class base_multiplexed_client {
+    public:
+        typedef std::string string_type;
+        typedef std::vector<string_type> string_vector;
+        typedef long int_type;
+
+        explicit base_multiplexed_client(const string_type & host = "localhost",
+                uint16_t port = 6379, int_type dbindex = 0) {
+            connection_data con;
+            con.host = host;
+            con.port = port;
+            con.dbindex = dbindex;
+            init(&con, &con + 1);
+        }
+
+        template<typename CON_ITERATOR>
+        base_multiplexed_client(CON_ITERATOR begin, CON_ITERATOR end) {
+            init(begin, end);
+        }
+
+        ~base_multiplexed_client() {
+            for (size_t i = 0; i < connections_.size(); ++i)
+                connections_[i]->stop();
+        }
+
+        // Sends a command built by the caller, routed by hash_key, and
+        // returns its reply, which may be an error reply.
+        reply send(const string_type & hash_key, cmd_encoder & request) {
+            request_node node(request.data(), request.size());
+            connection_for(hash_key).submit(node);
+            return node.wait();
+        }
+
+        string_type get(const string_type & key) {
+            return call<string_type>(key, encoder().begin(commands::GET) << key);
+        }
+
+        void set(const string_type & key, const string_type & value) {
+            cmd_encoder & request = encoder().begin(commands::SET) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            call<string_type>(key, request);
+        }
+
+        int_type incr(const string_type & key) {
+            cmd_encoder & request = encoder().begin(commands::INCR) << key;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return call<int_type>(key, request);
+        }
+
+        int_type incrby(const string_type & key, int_type by) {
+            return call<int_type>(key, encoder().begin(commands::INCRBY) << key << by);
+        }
+
+        bool exists(const string_type & key) {
+            return call<bool>(key, encoder().begin(commands::EXISTS) << key);
+        }
+
+        bool del(const string_type & key) {
+            return call<bool>(key, encoder().begin(commands::DEL) << key);
+        }
+
+        bool hset(const string_type & key, const string_type & field, const string_type & value) {
+            return call<bool>(key, encoder().begin(commands::HSET) << key << field << value);
+        }
+
+        string_type hget(const string_type & key, const string_type & field) {
+            return call<string_type>(key, encoder().begin(commands::HGET) << key << field);
+        }
+
+        int_type lpush(const string_type & key, const string_type & value) {
+            cmd_encoder & request = encoder().begin(commands::LPUSH) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return call<int_type>(key, request);
+        }
+
+        int_type rpush(const string_type & key, const string_type & value) {
+            return call<int_type>(key, encoder().begin(commands::RPUSH) << key << value);
+        }
+
+        string_vector lrange(const string_type & key, int_type start, int_type end) {
+            return call<string_vector>(key, encoder().begin(commands::LRANGE) << key << start << end);
+        }
+
+        bool zadd(const string_type & key, double score, const string_type & member) {
+            return call<bool>(key, encoder().begin(commands::ZADD) << key << score << member);
+        }
+
+        double zscore(const string_type & key, const string_type & member) {
+            return call<double>(key, encoder().begin(commands::ZSCORE) << key << member);
+        }
+
+        // Number of writes, and of commands they carried, over all
+        // connections; commands / writes is the pipelining achieved.
+        void write_stats(uint64_t & writes, uint64_t & commands) const {
+            writes = commands = 0;
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                writes += connections_[i]->writes.load(std::memory_order_relaxed);
+                commands += connections_[i]->commands.load(std::memory_order_relaxed);
+            }
+        }
+
+        uint64_t clientId; // Must not be 0; see base_client.
+        std::atomic<uint64_t> lastRequestId;
+
+    private:
+
+        // A command waiting to be written or for its reply. It lives on the
+        // stack of the calling thread, which blocks in wait() until the
+        // reader or a failing connection completes it.
+        struct request_node {
+
+            request_node(const char * data, size_t size)
+            : next(NULL), data(data), size(size), done(false) {
+            }
+
+            reply wait() {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!done)
+                    cond.wait(lock);
+                if (error)
+                    std::rethrow_exception(error);
+                return std::move(result);
+            }
+
+            void complete(reply & r) {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                result = std::move(r);
+                done = true;
+                cond.notify_one();
+            }
+
+            void fail(const std::exception_ptr & e) {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                error = e;
+                done = true;
+                cond.notify_one();
+            }
+
+            request_node * next;
+            const char * data;
+            size_t size;
+            bool done;
+            reply result;
+            std::exception_ptr error;
+            boost::mutex mutex;
+            boost::condition_variable cond;
+        };
+
+        class connection {
+        public:
+
+            connection(const connection_data & con)
+            : writes(0), commands(0), head_(NULL), stopping_(false), in_flight_(NULL), in_flight_tail_(NULL) {
+                char err[ANET_ERR_LEN];
+                socket_ = anetTcpConnect(err, const_cast<char *> (con.host.c_str()), con.port);
+                if (socket_ == ANET_ERR) {
+                    std::ostringstream os;
+                    os << err << " (redis://" << con.host << ':' << con.port << ")";
+                    throw connection_error(os.str());
+                }
+                anetTcpNoDelay(NULL, socket_);
+                if (con.dbindex != 0) {
+                    try {
+                        select(con.dbindex);
+                    } catch (...) {
+                        close(socket_);
+                        throw;
+                    }
+                }
+                writer_ = boost::thread(&connection::write_loop, this);
+                reader_ = boost::thread(&connection::read_loop, this);
+            }
+
+            ~connection() {
+                stop();
+                close(socket_);
+            }
+
+            void stop() {
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex_);
+                    if (stopping_)
+                        return;
+                    stopping_ = true;
+                    wake_.notify_all();
+                }
+                shutdown(socket_, SHUT_RDWR); // Unblocks the reader.
+                writer_.join();
+                reader_.join();
+            }
+
+            // Lock-free push; only the push onto an empty queue wakes the
+            // writer, which drains everything queued in one go.
+            void submit(request_node & node) {
+                request_node * head = head_.load(std::memory_order_relaxed);
+                do {
+                    if (head == closed())
+                        throw connection_error("connection is closed");
+                    node.next = head;
+                } while (!head_.compare_exchange_weak(head, &node,
+                        std::memory_order_release, std::memory_order_relaxed));
+                if (head == NULL) {
+                    boost::lock_guard<boost::mutex> lock(mutex_);
+                    wake_.notify_one();
+                }
+            }
+
+            std::atomic<uint64_t> writes;
+            std::atomic<uint64_t> commands;
+
+        private:
+
+            void select(int_type dbindex) {
+                cmd_encoder request;
+                request.begin(commands::SELECT) << dbindex;
+                if (anetWrite(socket_, const_cast<char *> (request.data()), request.size()) == -1)
+                    throw connection_error(strerror(errno));
+                reply_parser parser;
+                rbuf_.read_reply(socket_, parser);
+                reply r = parser.take();
+                reply_cast::check(r);
+            }
+
+            void write_loop() {
+                std::string batch;
+                while (true) {
+                    request_node * nodes = head_.exchange(NULL, std::memory_order_acquire);
+                    if (nodes == NULL) {
+                        boost::unique_lock<boost::mutex> lock(mutex_);
+                        while (!stopping_ && head_.load(std::memory_order_acquire) == NULL)
+                            wake_.wait(lock);
+                        if (stopping_)
+                            break;
+                        continue;
+                    }
+
+                    // The queue holds the newest node first.
+                    request_node * first = NULL;
+                    size_t count = 0;
+                    while (nodes != NULL) {
+                        request_node * next = nodes->next;
+                        nodes->next = first;
+                        first = nodes;
+                        nodes = next;
+                        ++count;
+                    }
+
+                    batch.clear();
+                    for (request_node * n = first; n != NULL; n = n->next)
+                        batch.append(n->data, n->size);
+
+                    // Queued for the reader before they are written, as
+                    // replies may come back before anetWrite() returns.
+                    if (!push_in_flight(first)) {
+                        fail_all(first, std::make_exception_ptr(connection_error("connection is closed")));
+                        continue;
+                    }
+                    if (anetWrite(socket_, const_cast<char *> (batch.data()), batch.size()) == -1) {
+                        fail(std::make_exception_ptr(connection_error(strerror(errno))));
+                        continue;
+                    }
+                    writes.fetch_add(1, std::memory_order_relaxed);
+                    commands.fetch_add(count, std::memory_order_relaxed);
+                }
+                // Later submit() calls see closed() and throw.
+                fail(std::make_exception_ptr(connection_error("connection is closed")));
+                request_node * rest = head_.exchange(closed(), std::memory_order_acquire);
+                fail_all(rest, std::make_exception_ptr(connection_error("connection is closed")));
+            }
+
+            // Queue head once the writer stopped.
+            static request_node * closed() {
+                static request_node marker(NULL, 0);
+                return &marker;
+            }
+
+            void read_loop() {
+                try {
+                    while (true) {
+                        reply_parser parser;
+                        rbuf_.read_reply(socket_, parser);
+                        reply r = parser.take();
+                        request_node * node = pop_in_flight();
+                        if (node == NULL)
+                            throw protocol_error("reply without a command");
+                        node->complete(r);
+                    }
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+            }
+
+            bool push_in_flight(request_node * first) {
+                boost::lock_guard<boost::mutex> lock(in_flight_mutex_);
+                if (failed_)
+                    return false;
+                request_node * last = first;
+                while (last->next != NULL)
+                    last = last->next;
+                if (in_flight_tail_ != NULL)
+                    in_flight_tail_->next = first;
+                else
+                    in_flight_ = first;
+                in_flight_tail_ = last;
+                return true;
+            }
+
+            request_node * pop_in_flight() {
+                boost::lock_guard<boost::mutex> lock(in_flight_mutex_);
+                request_node * node = in_flight_;
+                if (node != NULL) {
+                    in_flight_ = node->next;
+                    if (in_flight_ == NULL)
+                        in_flight_tail_ = NULL;
+                }
+                return node;
+            }
+
+            // Fails the commands in flight and every later one.
+            void fail(const std::exception_ptr & e) {
+                request_node * nodes;
+                {
+                    boost::lock_guard<boost::mutex> lock(in_flight_mutex_);
+                    if (!failed_)
+                        failed_ = e;
+                    nodes = in_flight_;
+                    in_flight_ = in_flight_tail_ = NULL;
+                }
+                fail_all(nodes, e);
+            }
+
+            static void fail_all(request_node * nodes, const std::exception_ptr & e) {
+                while (nodes != NULL) {
+                    request_node * next = nodes->next; // nodes is gone after fail().
+                    nodes->fail(e);
+                    nodes = next;
+                }
+            }
+
+            int socket_;
+            recv_buffer rbuf_; // Used by the reader only.
+            std::atomic<request_node *> head_;
+            boost::mutex mutex_; // Guards stopping_ and the writer's sleep.
+            boost::condition_variable wake_;
+            bool stopping_;
+            boost::mutex in_flight_mutex_;
+            request_node * in_flight_; // Written, oldest first.
+            request_node * in_flight_tail_;
+            std::exception_ptr failed_;
+            boost::thread writer_;
+            boost::thread reader_;
+        };
+
+        template<typename CON_ITERATOR>
+        void init(CON_ITERATOR begin, CON_ITERATOR end) {
+            clientId = rand() + 1; // Must not be 0.
+            lastRequestId = 0;
+            for (; begin != end; ++begin)
+                hosts_.push_back(*begin);
+            if (hosts_.empty())
+                throw std::runtime_error("No connections given!");
+            for (size_t i = 0; i < hosts_.size(); ++i)
+                connections_.push_back(boost::shared_ptr<connection> (new connection(hosts_[i])));
+        }
+
+        // Each thread encodes into a buffer of its own; see cmd_encoder.
+        static cmd_encoder & encoder() {
+            static thread_local cmd_encoder request;
+            return request;
+        }
+
+        template<typename T>
+        T call(const string_type & key, cmd_encoder & request) {
+            reply r = send(key, request);
+            reply_cast::check(r);
+            T value;
+            reply_cast::get(r, value);
+            return value;
+        }
+
+        connection & connection_for(const string_type & key) {
+            if (connections_.size() == 1)
+                return *connections_[0];
+            return *connections_[hasher_(key, static_cast<const std::vector<connection_data> &> (hosts_))];
+        }
+
+        base_multiplexed_client(const base_multiplexed_client &);
+        base_multiplexed_client & operator=(const base_multiplexed_client &);
+
+        std::vector<connection_data> hosts_;
+        std::vector< boost::shared_ptr<connection> > connections_;
+        CONSISTENT_HASHER hasher_;
+    };
+
+    typedef base_multiplexed_client<default_hasher> multiplexed_client;
+
+    /**
+     * Pool of base_client objects for threads that each need a blocking
+     * client for a while. A lease hands one client to one thread and gives
+     * it back when it goes out of scope. A thread gets the client it had
+     * last if that one is idle, so it keeps its sockets warm.
+     *
+     * The pool grows on demand up to max_size clients. Past that, acquire()
+     * waits for a lease to end. A maintenance thread closes clients that
+     * stayed idle longer than idle_timeout, keeping min_idle of them. It
+     * also PINGs clients idle for check_interval and drops those that fail.
+     * A lease whose client saw a connection error should be discard()ed so
+     * that the client is not reused.
+     */
+    template<typename CONSISTENT_HASHER>
+    class base_client_pool {
+    public:
+        typedef base_client<CONSISTENT_HASHER> client_type;
+        typedef boost::function<client_type * ()> factory_type;
+
+        struct options {
+
+            options()
+            : max_size(64), min_idle(1),
+            idle_timeout(boost::posix_time::seconds(60)),
+            check_interval(boost::posix_time::seconds(10)) {
+            }
+
+            size_t max_size;
+            size_t min_idle;
+            boost::posix_time::time_duration idle_timeout;
+            // Also how often maintenance runs; zero disables the thread,
+            // leaving maintain() to the caller.
+            boost::posix_time::time_duration check_interval;
+        };
+
+        class lease {
+        public:
+
+            lease() : pool_(NULL) {
+            }
+
+            lease(lease && other) : pool_(other.pool_), client_(std::move(other.client_)) {
+                other.pool_ = NULL;
+            }
+
+            lease & operator=(lease && other) {
+                if (this != &other) {
+                    release();
+                    pool_ = other.pool_;
+                    client_ = std::move(other.client_);
+                    other.pool_ = NULL;
+                }
+                return *this;
+            }
+
+            ~lease() {
+                release();
+            }
+
+            client_type & operator*() const {
+                return *client_;
+            }
+
+            client_type * operator->() const {
+                return client_.get();
+            }
+
+            // Closes the client instead of returning it to the pool.
+            void discard() {
+                if (pool_ != NULL)
+                    pool_->drop(client_);
+                pool_ = NULL;
+                client_.reset();
+            }
+
+            void release() {
+                if (pool_ != NULL)
+                    pool_->give_back(client_);
+                pool_ = NULL;
+                client_.reset();
+            }
+
+        private:
+
+            lease(base_client_pool * pool, const boost::shared_ptr<client_type> & client)
+            : pool_(pool), client_(client) {
+            }
+
+            lease(const lease &);
+            lease & operator=(const lease &);
+
+            base_client_pool * pool_;
+            boost::shared_ptr<client_type> client_;
+
+            friend class base_client_pool;
+        };
+
+        explicit base_client_pool(const factory_type & factory, const options & opts = options())
+        : factory_(factory), options_(opts), size_(0), stopping_(false) {
+            if (!options_.check_interval.is_special() && options_.check_interval.total_microseconds() > 0)
+                maintainer_ = boost::thread(&base_client_pool::maintain_loop, this);
+        }
+
+        // Leases must not outlive the pool.
+        ~base_client_pool() {
+            {
+                boost::lock_guard<boost::mutex> lock(mutex_);
+                stopping_ = true;
+                stop_.notify_all();
+            }
+            if (maintainer_.joinable())
+                maintainer_.join();
+        }
+
+        lease acquire() {
+            boost::shared_ptr<client_type> client;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex_);
+                while (idle_.empty() && size_ >= options_.max_size)
+                    changed_.wait(lock);
+                if (!idle_.empty()) {
+                    client = take_idle();
+                } else {
+                    ++size_; // Reserved while the client connects.
+                }
+            }
+            if (!client) {
+                try {
+                    client.reset(factory_());
+                } catch (...) {
+                    boost::lock_guard<boost::mutex> lock(mutex_);
+                    --size_;
+                    changed_.notify_one();
+                    throw;
+                }
+            }
+            last_client() = client.get();
+            return lease(this, client);
+        }
+
+        // Clients in the pool, leased or idle.
+        size_t size() const {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            return size_;
+        }
+
+        size_t idle() const {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            return idle_.size();
+        }
+
+        /**
+         * Closes clients idle for longer than idle_timeout beyond min_idle,
+         * and PINGs those idle for check_interval, dropping the ones that
+         * fail. Health checks run without holding the pool's lock.
+         */
+        void maintain() {
+            boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+            std::vector<idle_client> to_check;
+            std::vector<idle_client> expired;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex_);
+                // Oldest first, so that the newest min_idle are kept.
+                size_t kept = 0;
+                for (size_t i = 0; i < idle_.size(); ++i) {
+                    idle_client & c = idle_[i];
+                    size_t left = idle_.size() - i - 1 + kept + to_check.size();
+                    if (now - c.since > options_.idle_timeout && left >= options_.min_idle)
+                        expired.push_back(c);
+                    else if (now - c.checked > options_.check_interval)
+                        to_check.push_back(c);
+                    else
+                        idle_[kept++] = c;
+                }
+                idle_.resize(kept);
+                // Clients being checked still count towards max_size.
+                size_ -= expired.size();
+            }
+            expired.clear(); // Closes their sockets outside the lock.
+
+            for (size_t i = 0; i < to_check.size(); ++i) {
+                try {
+                    to_check[i].client->ping();
+                } catch (const redis_error &) {
+                    to_check[i].client.reset();
+                    continue;
+                }
+                to_check[i].checked = now;
+            }
+
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            for (size_t i = 0; i < to_check.size(); ++i) {
+                if (to_check[i].client)
+                    idle_.push_back(to_check[i]);
+                else
+                    --size_;
+            }
+            std::stable_sort(idle_.begin(), idle_.end(), released_before);
+            changed_.notify_all();
         }
 
-        std::string recv_bulk_reply_(int socket) {
-            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+    private:
 
-            if (length == -1)
-                return missing_value();
+        struct idle_client {
+            boost::shared_ptr<client_type> client;
+            boost::posix_time::ptime since; // Released at.
+            boost::posix_time::ptime checked; // Last known to be alive.
+        };
 
-            int_type real_length = length + 2; // CRLF
+        static bool released_before(const idle_client & a, const idle_client & b) {
+            return a.since < b.since;
+        }
 
-            std::string data = read_n(socket, real_length);
+        // The client the calling thread leased last, which it gets again if
+        // that one is idle.
+        static client_type * & last_client() {
+            static thread_local client_type * client = NULL;
+            return client;
+        }
 
-            if (data.empty())
-                throw protocol_error("invalid bulk reply data; empty");
+        boost::shared_ptr<client_type> take_idle() {
+            size_t pick = idle_.size() - 1; // Most recently used.
+            for (size_t i = 0; i < idle_.size(); ++i) {
+                if (idle_[i].client.get() == last_client()) {
+                    pick = i;
+                    break;
+                }
+            }
+            boost::shared_ptr<client_type> client = idle_[pick].client;
+            idle_.erase(idle_.begin() + pick);
+            return client;
+        }
 
-            if (data.length() != static_cast<std::string::size_type> (real_length))
-                throw protocol_error("invalid bulk reply data; data of unexpected length");
+        void give_back(const boost::shared_ptr<client_type> & client) {
+            boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            idle_client c;
+            c.client = client;
+            c.since = now;
+            c.checked = now; // It was in use until now.
+            idle_.push_back(c);
+            changed_.notify_one();
+        }
 
-            data.erase(data.size() - 2);
+        void drop(boost::shared_ptr<client_type> & client) {
+            client.reset();
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            --size_;
+            changed_.notify_one();
+        }
 
-            return data;
+        void maintain_loop() {
+            while (true) {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex_);
+                    boost::system_time deadline = boost::get_system_time() + options_.check_interval;
+                    while (!stopping_ && stop_.timed_wait(lock, deadline))
+                        ;
+                    if (stopping_)
+                        return;
+                }
+                maintain();
+            }
         }
 
-        int_type recv_multi_bulk_reply_(int socket, string_vector & out) {
-            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+        base_client_pool(const base_client_pool &);
+        base_client_pool & operator=(const base_client_pool &);
+
+        factory_type factory_;
+        options options_;
+        mutable boost::mutex mutex_;
+        boost::condition_variable changed_; // Client released or dropped.
+        // Wakes the maintenance thread only, so that a release wakes a
+        // thread waiting in acquire() rather than the maintainer.
+        boost::condition_variable stop_;
+        std::vector<idle_client> idle_; // Oldest first.
+        size_t size_;
+        bool stopping_;
+        boost::thread maintainer_;
+    };
 
-            if (length == -1)
-                throw key_error("no such key");
+    typedef base_client_pool<default_hasher> client_pool;
 
-            out.reserve(out.size() + length);
+    /**
+     * Client for write-heavy threads that do not need each reply right away.
+     * set(), hmset(), incr() and lpush() return a std::future at once. The
+     * commands are held per server and written as one batch when max_batch
+     * commands or max_bytes bytes are held, or when the first of them has
+     * waited max_delay. A reader thread per server fulfils the futures. A
+     * command thus waits up to max_delay longer, and each batch costs a
+     * single write.
+     *
+     * Size-triggered batches are written by the thread that filled them.
+     * Deadline-triggered ones are written by a timer thread. flush() writes
+     * what is held right away. The destructor flushes and waits for all
+     * replies. stats() counts batches by size and by what triggered them.
+     *
+     * The writes carry client and request ids like base_client's, but are
+     * not recorded on witnesses. Once a connection failed, its pending
+     * futures hold connection_error and later calls throw it.
+     */
+    template<typename CONSISTENT_HASHER>
+    class base_batching_client {
+    public:
+        typedef std::string string_type;
+        typedef std::pair<string_type, string_type> string_pair;
+        typedef std::vector<string_pair> string_pair_vector;
+        typedef long int_type;
 
-            for (int_type i = 0; i < length; ++i)
-                out.push_back(recv_bulk_reply_(socket));
+        struct options {
 
-            return length;
-        }
+            options()
+            : max_batch(128), max_bytes(64 * 1024),
+            max_delay(boost::posix_time::microseconds(200)) {
+            }
 
-        int_type recv_multi_bulk_reply_(int socket, string_set & out) {
-            int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+            size_t max_batch; // Commands per server and batch.
+            size_t max_bytes; // Encoded bytes per server and batch.
+            boost::posix_time::time_duration max_delay;
+        };
 
-            if (length == -1)
-                throw key_error("no such key");
+        enum flush_reason {
+            flush_size, // max_batch or max_bytes reached.
+            flush_deadline, // max_delay passed.
+            flush_explicit, // flush() or the destructor.
+            flush_reasons
+        };
 
-            for (int_type i = 0; i < length; ++i)
-                out.insert(recv_bulk_reply_(socket));
+        // Batch sizes are counted in power-of-two buckets: bucket i holds
+        // batches of [2^i, 2^(i+1)) commands, the last one all larger ones.
+        static const size_t size_buckets = 16;
 
-            return length;
-        }
+        struct batch_stats {
 
-        template<typename INT_TYPE>
-        INT_TYPE recv_int_reply_(int socket) {
-            std::string line = read_line(socket);
+            batch_stats() : commands(0) {
+                std::fill(flushes, flushes + flush_reasons, 0);
+                std::fill(sizes, sizes + size_buckets, 0);
+            }
 
-#ifndef NDEBUG
-            //output_proto_debug(line);
-#endif
+            uint64_t batches() const {
+                uint64_t n = 0;
+                for (size_t i = 0; i < flush_reasons; ++i)
+                    n += flushes[i];
+                return n;
+            }
 
-            if (line.empty())
-                throw protocol_error("invalid integer reply; empty");
+            uint64_t flushes[flush_reasons];
+            uint64_t sizes[size_buckets];
+            uint64_t commands;
+        };
 
-            if (line[0] != REDIS_PREFIX_INT_REPLY)
-                throw protocol_error("unexpected prefix for integer reply");
+        explicit base_batching_client(const string_type & host = "localhost",
+                uint16_t port = 6379, int_type dbindex = 0, const options & opts = options())
+        : options_(opts), stopping_(false) {
+            connection_data con;
+            con.host = host;
+            con.port = port;
+            con.dbindex = dbindex;
+            init(&con, &con + 1);
+        }
 
-            return boost::lexical_cast<INT_TYPE>(line.substr(1));
+        template<typename CON_ITERATOR>
+        base_batching_client(CON_ITERATOR begin, CON_ITERATOR end, const options & opts = options())
+        : options_(opts), stopping_(false) {
+            init(begin, end);
         }
 
-        int_type recv_int_reply_(int socket) {
-            std::string line = read_line(socket);
+        ~base_batching_client() {
+            {
+                boost::lock_guard<boost::mutex> lock(timer_mutex_);
+                stopping_ = true;
+                timer_wake_.notify_all();
+            }
+            timer_.join();
+            flush();
+            for (size_t i = 0; i < connections_.size(); ++i)
+                connections_[i]->stop();
+        }
 
-#ifndef NDEBUG
-            //output_proto_debug(line);
-#endif
+        // Holds a command built by the caller, routed by hash_key.
+        template<typename T>
+        std::future<T> send(const string_type & hash_key, cmd_encoder & request) {
+            completion_ptr c(new typed_completion<T>());
+            std::future<T> result = static_cast<typed_completion<T> &> (*c).promise.get_future();
+            submit(connection_for(hash_key), request, c);
+            return result;
+        }
 
-            if (line.empty())
-                throw protocol_error("invalid integer reply; empty");
+        std::future<void> set(const string_type & key, const string_type & value) {
+            cmd_encoder & request = encoder().begin(commands::SET) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return send<void>(key, request);
+        }
 
-            if (line[0] != REDIS_PREFIX_INT_REPLY)
-                throw protocol_error("unexpected prefix for integer reply");
+        std::future<void> hmset(const string_type & key, const string_pair_vector & field_value_pairs) {
+            cmd_encoder & request = encoder().begin("HMSET", 5) << key;
+            for (size_t i = 0; i < field_value_pairs.size(); i++)
+                request << field_value_pairs[i].first << field_value_pairs[i].second;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return send<void>(key, request);
+        }
 
-            return boost::lexical_cast<int_type>(line.substr(1));
+        std::future<int_type> incr(const string_type & key) {
+            cmd_encoder & request = encoder().begin(commands::INCR) << key;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return send<int_type>(key, request);
         }
 
-        void recv_int_ok_reply_(int socket) {
-            if (recv_int_reply_(socket) != 1)
-                throw protocol_error("expecting int reply of 1");
+        std::future<int_type> lpush(const string_type & key, const string_type & value) {
+            cmd_encoder & request = encoder().begin(commands::LPUSH) << key << value;
+            request.append_id(clientId).append_id(++lastRequestId);
+            return send<int_type>(key, request);
         }
 
-        connection_data& get_conn(const string_type & key) {
-            size_t con_count = connections_.size();
-            if (con_count == 1)
-                return connections_[0];
-            size_t idx = hasher_(key, static_cast<const std::vector<connection_data> &> (connections_));
-            return connections_[idx];
+        // Writes the commands held for every server without waiting for
+        // their deadline.
+        void flush() {
+            for (size_t i = 0; i < connections_.size(); ++i)
+                connections_[i]->flush(flush_explicit);
         }
 
-        int get_connIdx(int socket) {
-            for (uint i = 0; i < connections_.size(); ++i) {
-                if (connections_[i].socket == socket) {
-                    return static_cast<int>(i);
-                }
+        batch_stats stats() const {
+            batch_stats s;
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                const connection & c = *connections_[i];
+                for (size_t r = 0; r < flush_reasons; ++r)
+                    s.flushes[r] += c.flushes[r].load(std::memory_order_relaxed);
+                for (size_t b = 0; b < size_buckets; ++b)
+                    s.sizes[b] += c.sizes[b].load(std::memory_order_relaxed);
+                s.commands += c.commands.load(std::memory_order_relaxed);
             }
-            fprintf(stderr, "connIdx not found. socket: %d\n", socket);
-            throw redis_error("Something wrong.. get_connIdx failed.");
+            return s;
         }
 
-        inline int get_socket(const string_type & key) {
-            size_t con_count = connections_.size();
-            if (con_count == 1)
-                return connections_[0].socket;
-            size_t idx = hasher_(key, static_cast<const std::vector<connection_data> &> (connections_));
-            return connections_[idx].socket;
+        const options & get_options() const {
+            return options_;
         }
 
-        int get_socket(const string_vector & keys) {
-            assert(!keys.empty());
+        uint64_t clientId; // Must not be 0; see base_client.
+        std::atomic<uint64_t> lastRequestId;
 
-            if (connections_.size() == 1)
-                return connections_[0].socket;
+    private:
 
-            int socket = -1;
-            for (size_t i = 0; i < keys.size(); i++) {
-                int cur_socket = get_socket(keys[i]);
-                if (i > 0 && socket != cur_socket)
-                    return -1;
-                //throw std::runtime_error("not possible in cluster mode");
+        // Fulfils the future of a command with its reply.
+        struct completion {
 
-                socket = cur_socket;
+            virtual ~completion() {
             }
 
-            return socket;
-        }
-
-#ifndef NDEBUG
+            virtual void complete(reply & r) = 0;
+            virtual void fail(const std::exception_ptr & e) = 0;
+        };
 
-        void output_proto_debug(const std::string & data, bool is_received = true) {
-            std::string escaped_data(data);
-            size_t pos;
-            while ((pos = escaped_data.find("\n")) != std::string::npos)
-                escaped_data.replace(pos, 1, "\\n");
-            while ((pos = escaped_data.find("\r")) != std::string::npos)
-                escaped_data.replace(pos, 1, "\\r");
+        typedef boost::shared_ptr<completion> completion_ptr;
 
-            std::cerr << time(NULL) << ": "
-                    << (is_received ? "RECV '" : "SEND '")
-                    << escaped_data
-                    << "'"
-                    << std::endl;
-        }
-#endif
+        template<typename T>
+        struct typed_completion : completion {
 
-        std::vector<std::string>::size_type split(const std::string & str, char delim, std::vector<std::string> & elems) {
-            std::stringstream ss(str);
-            std::string item;
-            std::vector<std::string>::size_type n = 0;
-            while (getline(ss, item, delim)) {
-                elems.push_back(item);
-                ++n;
+            void complete(reply & r) {
+                try {
+                    reply_cast::check(r);
+                    set_value(promise, r);
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
             }
-            return n;
-        }
 
-        inline std::string & rtrim(std::string & str, const std::string & ws = REDIS_WHITESPACE) {
-            std::string::size_type pos = str.find_last_not_of(ws);
-            str.erase(pos + 1);
-            return str;
-        }
+            void fail(const std::exception_ptr & e) {
+                promise.set_exception(e);
+            }
 
-        inline void split_lines(const std::string & str, std::vector<std::string> & elems) {
-            split(str, '\n', elems);
-            for (std::vector<std::string>::iterator it = elems.begin(); it != elems.end(); ++it)
-                rtrim(*it);
-        }
-        // Reads N bytes from given blocking socket.
+            template<typename U>
+            static void set_value(std::promise<U> & p, reply & r) {
+                U value;
+                reply_cast::get(r, value);
+                p.set_value(std::move(value));
+            }
 
-        std::string read_n(int socket, ssize_t n) {
-            // changed char* to vector<char> buffer to don't leak memory on exceptions (and also because I hate this delete stuff)
-            // C++0x TODO: use a std::string here and it's non-const data() member instead of the vector<char> indirection
-            std::vector<char> buffer(n);
+            static void set_value(std::promise<void> & p, reply &) {
+                p.set_value();
+            }
 
-            char* buf_start = &buffer[0];
-            char* bp = buf_start;
-            ssize_t bytes_read = 0;
+            std::promise<T> promise;
+        };
 
-            while (bytes_read != n) {
-                ssize_t bytes_received = recv_or_throw(socket, bp, n - (bp - buf_start), 0);
+        class connection {
+        public:
+
+            explicit connection(const connection_data & con)
+            : commands(0), held_count_(0), failed_(false) {
+                for (size_t r = 0; r < flush_reasons; ++r)
+                    flushes[r] = 0;
+                for (size_t b = 0; b < size_buckets; ++b)
+                    sizes[b] = 0;
+                char err[ANET_ERR_LEN];
+                socket_ = anetTcpConnect(err, const_cast<char *> (con.host.c_str()), con.port);
+                if (socket_ == ANET_ERR) {
+                    std::ostringstream os;
+                    os << err << " (redis://" << con.host << ':' << con.port << ")";
+                    throw connection_error(os.str());
+                }
+                anetTcpNoDelay(NULL, socket_);
+                if (con.dbindex != 0) {
+                    try {
+                        select(con.dbindex);
+                    } catch (...) {
+                        close(socket_);
+                        throw;
+                    }
+                }
+                reader_ = boost::thread(&connection::read_loop, this);
+            }
 
-                bytes_read += bytes_received;
-                bp += bytes_received;
+            ~connection() {
+                if (reader_.joinable()) {
+                    shutdown(socket_, SHUT_RDWR); // Unblocks the reader.
+                    reader_.join();
+                }
+                close(socket_);
             }
 
-            return std::string(buf_start, n);
-        }
+            // Waits for the replies in flight, then stops the reader.
+            void stop() {
+                {
+                    boost::unique_lock<boost::mutex> lock(in_flight_mutex_);
+                    while (!in_flight_.empty() && !failed_)
+                        drained_.wait(lock);
+                }
+                shutdown(socket_, SHUT_RDWR);
+                reader_.join();
+            }
 
-        reply_t next_reply_type(int socket) {
-            char reply_prefix[1];
-            recv_or_throw(socket, reply_prefix, 1, MSG_PEEK);
+            // Adds a command to the held batch. Returns true if the batch
+            // just started, so that its deadline must be watched, and sets
+            // full if it reached a size limit.
+            bool hold(const char * data, size_t size, const completion_ptr & c,
+                    const options & opts, bool & full) {
+                boost::lock_guard<boost::mutex> lock(held_mutex_);
+                if (failed_)
+                    throw connection_error("connection is closed");
+                bool started = held_count_ == 0;
+                if (started)
+                    deadline_ = boost::get_system_time() + opts.max_delay;
+                held_.append(data, size);
+                held_completions_.push_back(c);
+                ++held_count_;
+                full = held_count_ >= opts.max_batch || held_.size() >= opts.max_bytes;
+                return started;
+            }
 
-            switch (reply_prefix[0]) {
-                case REDIS_PREFIX_STATUS_REPLY_VALUE:
-                    return status_code_reply;
-                case REDIS_PREFIX_STATUS_REPLY_ERR_C:
-                    return error_reply;
-                case REDIS_PREFIX_INT_REPLY:
-                    return int_reply;
-                case REDIS_PREFIX_SINGLE_BULK_REPLY:
-                    return bulk_reply;
-                case REDIS_PREFIX_MULTI_BULK_REPLY:
-                    return multi_bulk_reply;
+            // When the held batch is due, or boost::posix_time::pos_infin if
+            // none is held.
+            boost::system_time deadline() {
+                boost::lock_guard<boost::mutex> lock(held_mutex_);
+                return held_count_ > 0 ? deadline_ : boost::system_time(boost::posix_time::pos_infin);
             }
 
-            throw std::runtime_error("invalid/unknown rely type from redis server");
-        }
+            // Writes the held batch, if any.
+            void flush(flush_reason reason) {
+                boost::lock_guard<boost::mutex> write_lock(write_mutex_);
+                size_t count;
+                {
+                    boost::lock_guard<boost::mutex> lock(held_mutex_);
+                    if (held_count_ == 0)
+                        return;
+                    batch_.swap(held_);
+                    held_.clear();
+                    completions_.swap(held_completions_);
+                    count = held_count_;
+                    held_count_ = 0;
+                }
 
-        reply_data_t recv_generic_reply_(int socket) {
-            reply_data_t res;
-            res.first = next_reply_type(socket);
-            switch (res.first) {
-                case status_code_reply:
-                    res.second = read_line(socket).substr(1);
-                    break;
-                case error_reply:
-                    res.second = read_line(socket).substr(strlen(REDIS_PREFIX_STATUS_REPLY_ERROR));
-                    break;
-                case int_reply:
-                    res.second = recv_int_reply_(socket);
-                    break;
-                case bulk_reply:
-                    res.second = recv_bulk_reply_(socket);
-                    break;
-                case multi_bulk_reply:
+                // Counted before the replies can complete anything, so that
+                // stats() include the batch of every resolved future.
+                flushes[reason].fetch_add(1, std::memory_order_relaxed);
+                sizes[size_bucket(count)].fetch_add(1, std::memory_order_relaxed);
+                commands.fetch_add(count, std::memory_order_relaxed);
+
+                // Queued for the reader before they are written, as replies
+                // may come back before anetWrite() returns.
+                bool failed;
                 {
-                    string_vector v;
-                    recv_multi_bulk_reply_(socket, v);
-                    res.second = v;
-                    break;
+                    boost::lock_guard<boost::mutex> lock(in_flight_mutex_);
+                    failed = failed_;
+                    if (!failed)
+                        in_flight_.insert(in_flight_.end(), completions_.begin(), completions_.end());
                 }
-                case no_reply:
-                    assert(false);
+                if (failed)
+                    fail_all(completions_, std::make_exception_ptr(connection_error("connection is closed")));
+                else if (anetWrite(socket_, const_cast<char *> (batch_.data()), batch_.size()) == -1)
+                    fail(std::make_exception_ptr(connection_error(strerror(errno))));
+                completions_.clear();
             }
-            return res;
-        }
 
-        // Reads a single line of character data from the given blocking socket.
-        // Returns the line that was read, not including EOL delimiter(s).  Both LF
-        // ('\n') and CRLF ("\r\n") delimiters are supported.  If there was an I/O
-        // error reading from the socket, connection_error is raised.  If max_size
-        // bytes are read before finding an EOL delimiter, a blank string is
-        // returned.
+            std::atomic<uint64_t> flushes[flush_reasons];
+            std::atomic<uint64_t> sizes[size_buckets];
+            std::atomic<uint64_t> commands;
 
-        std::string read_line(int socket, ssize_t max_size = 2048) {
-            assert(socket > 0);
-            assert(max_size > 0);
+        private:
 
-            std::ostringstream oss;
+            static size_t size_bucket(size_t count) {
+                size_t bucket = 0;
+                while (count > 1 && bucket + 1 < size_buckets) {
+                    count >>= 1;
+                    ++bucket;
+                }
+                return bucket;
+            }
 
-            enum {
-                buffer_size = 64
-            };
-            char buffer[buffer_size];
-            memset(buffer, 0, buffer_size);
+            void select(int_type dbindex) {
+                cmd_encoder request;
+                request.begin(commands::SELECT) << dbindex;
+                if (anetWrite(socket_, const_cast<char *> (request.data()), request.size()) == -1)
+                    throw connection_error(strerror(errno));
+                reply_parser parser;
+                rbuf_.read_reply(socket_, parser);
+                reply r = parser.take();
+                reply_cast::check(r);
+            }
 
-            ssize_t total_bytes_read = 0;
-            bool found_delimiter = false;
+            void read_loop() {
+                try {
+                    while (true) {
+                        reply_parser parser;
+                        rbuf_.read_reply(socket_, parser);
+                        reply r = parser.take();
+                        completion_ptr c;
+                        {
+                            boost::lock_guard<boost::mutex> lock(in_flight_mutex_);
+                            if (in_flight_.empty())
+                                throw protocol_error("reply without a command");
+                            c = in_flight_.front();
+                            in_flight_.pop_front();
+                            if (in_flight_.empty())
+                                drained_.notify_all();
+                        }
+                        c->complete(r);
+                    }
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+            }
+
+            // Fails the commands held and in flight, and every later one.
+            void fail(const std::exception_ptr & e) {
+                std::deque<completion_ptr> in_flight;
+                std::vector<completion_ptr> held;
+                {
+                    boost::lock_guard<boost::mutex> lock(held_mutex_);
+                    boost::lock_guard<boost::mutex> in_flight_lock(in_flight_mutex_);
+                    failed_ = true;
+                    in_flight.swap(in_flight_);
+                    held.swap(held_completions_);
+                    held_.clear();
+                    held_count_ = 0;
+                    drained_.notify_all();
+                }
+                fail_all(in_flight, e);
+                fail_all(held, e);
+            }
 
-            while (total_bytes_read < max_size && !found_delimiter) {
-                // Peek at what's available.
+            template<typename SEQ>
+            static void fail_all(SEQ & completions, const std::exception_ptr & e) {
+                for (typename SEQ::iterator i = completions.begin(); i != completions.end(); ++i)
+                    (*i)->fail(e);
+            }
 
-                ssize_t bytes_received = recv_or_throw(socket, buffer, buffer_size, MSG_PEEK);
+            int socket_;
+            recv_buffer rbuf_; // Used by the reader only.
 
-                // Some data is available; Length might be < buffer_size.
-                // Look for newline in whatever was read though.
+            boost::mutex held_mutex_; // Guards the held batch.
+            std::string held_;
+            std::vector<completion_ptr> held_completions_;
+            size_t held_count_;
+            boost::system_time deadline_;
 
-                char * eol = static_cast<char *> (memchr(buffer, '\n', bytes_received));
+            boost::mutex write_mutex_; // Orders batches; guards the two below.
+            std::string batch_;
+            std::vector<completion_ptr> completions_;
 
-                // If found, write data from the buffer to the output string.
-                // Else, write the entire buffer and continue reading more data.
+            boost::mutex in_flight_mutex_; // Locked after held_mutex_.
+            std::deque<completion_ptr> in_flight_; // Written, oldest first.
+            bool failed_; // Guarded by both mutexes.
+            boost::condition_variable drained_;
 
-                ssize_t to_read = bytes_received;
+            boost::thread reader_;
+        };
 
-                if (eol) {
-                    to_read = eol - buffer + 1;
-                    oss.write(buffer, to_read);
-                    found_delimiter = true;
-                } else
-                    oss.write(buffer, bytes_received);
+        template<typename CON_ITERATOR>
+        void init(CON_ITERATOR begin, CON_ITERATOR end) {
+            clientId = rand() + 1; // Must not be 0.
+            lastRequestId = 0;
+            for (; begin != end; ++begin)
+                hosts_.push_back(*begin);
+            if (hosts_.empty())
+                throw std::runtime_error("No connections given!");
+            for (size_t i = 0; i < hosts_.size(); ++i)
+                connections_.push_back(boost::shared_ptr<connection> (new connection(hosts_[i])));
+            timer_ = boost::thread(&base_batching_client::timer_loop, this);
+        }
 
-                // Now read from the socket to remove the peeked data from the socket's
-                // read buffer.  This will not block since we've peeked already and know
-                // there's data waiting.  It might fail if we were interrupted however.
+        // Each thread encodes into a buffer of its own; see cmd_encoder.
+        static cmd_encoder & encoder() {
+            static thread_local cmd_encoder request;
+            return request;
+        }
 
-                bytes_received = recv_or_throw(socket, buffer, to_read, 0);
+        void submit(connection & con, cmd_encoder & request, const completion_ptr & c) {
+            bool full;
+            if (con.hold(request.data(), request.size(), c, options_, full)) {
+                // Taking the lock orders this with the timer's check for
+                // held batches, so the wakeup cannot be lost.
+                boost::lock_guard<boost::mutex> lock(timer_mutex_);
+                timer_wake_.notify_one();
             }
+            if (full)
+                con.flush(flush_size);
+        }
+
+        // Writes the batches whose deadline passed and sleeps until the
+        // next deadline, or until a batch is started. Batches are written
+        // without the lock, and checked again before sleeping.
+        void timer_loop() {
+            std::vector<connection *> due;
+            boost::unique_lock<boost::mutex> lock(timer_mutex_);
+            while (!stopping_) {
+                boost::system_time now = boost::get_system_time();
+                boost::system_time next(boost::posix_time::pos_infin);
+                due.clear();
+                for (size_t i = 0; i < connections_.size(); ++i) {
+                    boost::system_time deadline = connections_[i]->deadline();
+                    if (deadline <= now)
+                        due.push_back(connections_[i].get());
+                    else
+                        next = std::min(next, deadline);
+                }
 
-            // Construct final line string. Remove trailing CRLF-based whitespace.
+                if (!due.empty()) {
+                    lock.unlock();
+                    for (size_t i = 0; i < due.size(); ++i)
+                        due[i]->flush(flush_deadline);
+                    lock.lock();
+                } else if (next.is_pos_infinity()) {
+                    timer_wake_.wait(lock);
+                } else {
+                    timer_wake_.timed_wait(lock, next);
+                }
+            }
+        }
 
-            std::string line = oss.str();
-            return rtrim(line, REDIS_LBR);
+        connection & connection_for(const string_type & key) {
+            if (connections_.size() == 1)
+                return *connections_[0];
+            return *connections_[hasher_(key, static_cast<const std::vector<connection_data> &> (hosts_))];
         }
 
-    private:
-        std::vector<connection_data> connections_;
-        //int socket_;
-        CONSISTENT_HASHER hasher_;
-    public:
-        uint64_t clientId; // Must not be 0. either random or assigned by server.
-        uint64_t lastRequestId;
-        RAMCloud::UnsyncedRpcTracker tracker;
-    };
+        base_batching_client(const base_batching_client &);
+        base_batching_client & operator=(const base_batching_client &);
 
-    struct default_hasher {
+        options options_;
+        std::vector<connection_data> hosts_;
+        std::vector< boost::shared_ptr<connection> > connections_;
+        CONSISTENT_HASHER hasher_;
 
-        inline size_t operator()(const std::string & key, const std::vector<connection_data> & connections) {
-            return boost::hash<std::string>()(key) % connections.size();
-        }
+        boost::mutex timer_mutex_;
+        boost::condition_variable timer_wake_;
+        bool stopping_; // Guarded by timer_mutex_.
+        boost::thread timer_;
     };
 
-    typedef base_client<default_hasher> client;
+    typedef base_batching_client<default_hasher> batching_client;
 
     class distributed_value {
     protected:
@@ -3072,11 +7945,10 @@ namespace redis {
     private:
 
         static int_type to_int_type(const client::string_type & val) {
-            try {
-                return boost::lexical_cast<int_type>(val);
-            } catch (boost::bad_lexical_cast & e) {
+            int_type value;
+            if (!parse_number(val.data(), val.data() + val.size(), value))
                 throw value_error("value is not of integer type");
-            }
+            return value;
         }
     };
 
@@ -3193,7 +8065,9 @@ namespace redis {
             std::string timeout_tstamp_str;
             while (true) {
                 timeout_tstamp_str = con_->get(name_);
-                boost::int32_t timeout_tstamp = boost::lexical_cast<boost::int32_t>(timeout_tstamp_str);
+                boost::int32_t timeout_tstamp;
+                if (!parse_number(timeout_tstamp_str.data(), timeout_tstamp_str.data() + timeout_tstamp_str.size(), timeout_tstamp))
+                    throw value_error("mutex timestamp is not of integer type");
                 boost::int32_t diff = tstamp_val(boost::posix_time::seconds(TIMEOUT_SEC)) - timeout_tstamp;
                 if (diff < 1)
                     diff = 1;
@@ -0,0 +1,386 @@
+/* rediscoroclient.h -- C++20 coroutine layer on top of redis::async_client.
+ *
+ * Application code stays sequential while many commands overlap on each
+ * connection:
+ *
+ *   redis::coro_client c("127.0.0.1");
+ *
+ *   redis::task<> work(redis::coro_client & c) {
+ *       co_await c.set("foo", "bar");
+ *       std::string v = co_await c.get("foo");
+ *   }
+ *
+ *   c.spawn(work(c));
+ *   c.run(); // Until every spawned task finished.
+ *
+ * Only available when built as C++20 (e.g. -std=c++20); otherwise this
+ * header is empty and REDIS_HAS_COROUTINES is left undefined.
+ */
+
+#ifndef REDISCOROCLIENT_H
+#define REDISCOROCLIENT_H
+
+#include "redisclient.h"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define REDIS_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef REDIS_HAS_COROUTINES
+
+#include <coroutine>
+#include <utility>
+
+namespace redis {
+
+    template<typename T = void>
+    class task;
+
+    template<typename T>
+    struct task_promise_base {
+
+        // Resumes the awaiting coroutine, if any, once the task finished.
+        struct final_awaiter {
+
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            template<typename PROMISE>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<PROMISE> h) noexcept {
+                std::coroutine_handle<> next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {
+            }
+        };
+
+        std::suspend_always initial_suspend() noexcept {
+            return std::suspend_always();
+        }
+
+        final_awaiter final_suspend() noexcept {
+            return final_awaiter();
+        }
+
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+    };
+
+    template<typename T>
+    struct task_promise : task_promise_base<T> {
+
+        task<T> get_return_object();
+
+        void return_value(T v) {
+            value = std::move(v);
+        }
+
+        T result() {
+            if (this->error)
+                std::rethrow_exception(this->error);
+            return std::move(value);
+        }
+
+        T value;
+    };
+
+    template<>
+    struct task_promise<void> : task_promise_base<void> {
+
+        task<void> get_return_object();
+
+        void return_void() {
+        }
+
+        void result() {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+
+    /**
+     * Lazily started coroutine returning T. It runs when awaited, or when
+     * handed to coro_client::spawn(), and owns its frame.
+     */
+    template<typename T>
+    class task {
+    public:
+        typedef task_promise<T> promise_type;
+        typedef std::coroutine_handle<promise_type> handle_type;
+
+        explicit task(handle_type h) : handle_(h) {
+        }
+
+        task(task && other) noexcept : handle_(std::exchange(other.handle_, handle_type())) {
+        }
+
+        task & operator=(task && other) noexcept {
+            if (this != &other) {
+                if (handle_)
+                    handle_.destroy();
+                handle_ = std::exchange(other.handle_, handle_type());
+            }
+            return *this;
+        }
+
+        ~task() {
+            if (handle_)
+                handle_.destroy();
+        }
+
+        task(const task &) = delete;
+        task & operator=(const task &) = delete;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle_.promise().continuation = awaiting;
+            return handle_;
+        }
+
+        T await_resume() {
+            return handle_.promise().result();
+        }
+
+    private:
+        handle_type handle_;
+
+        friend class coro_client;
+    };
+
+    template<typename T>
+    task<T> task_promise<T>::get_return_object() {
+        return task<T>(task<T>::handle_type::from_promise(*this));
+    }
+
+    inline task<void> task_promise<void>::get_return_object() {
+        return task<void>(task<void>::handle_type::from_promise(*this));
+    }
+
+    /**
+     * A command in flight; co_await yields its reply as a T. The reply is
+     * kept until then, so commands may be awaited in any order.
+     */
+    template<typename T>
+    class coro_command {
+    public:
+
+        bool await_ready() const noexcept {
+            return state_->done;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            state_->waiting = h;
+        }
+
+        T await_resume() {
+            reply_cast::check(state_->r);
+            T value;
+            reply_cast::get(state_->r, value);
+            return value;
+        }
+
+    private:
+
+        struct state {
+
+            state() : done(false) {
+            }
+
+            bool done;
+            reply r;
+            std::coroutine_handle<> waiting;
+        };
+
+        explicit coro_command(const boost::shared_ptr<state> & s) : state_(s) {
+        }
+
+        boost::shared_ptr<state> state_;
+
+        friend class coro_client;
+    };
+
+    /**
+     * Coroutine client: an async_client plus a scheduler for the tasks that
+     * use it. Commands are sent as soon as they are called, so several can
+     * be started before awaiting any of them:
+     *
+     *   auto a = c.get("a");
+     *   auto b = c.get("b");
+     *   std::string va = co_await a, vb = co_await b;
+     *
+     * Awaiting a command yields its typed reply (see reply_cast) or throws
+     * what the blocking client would. Tasks are resumed from run() or
+     * step(), never from within the event loop.
+     */
+    class coro_client {
+    public:
+        typedef std::string string_type;
+        typedef std::vector<string_type> string_vector;
+        typedef long int_type;
+
+        explicit coro_client(const string_type & host = "localhost",
+                uint16_t port = 6379, int_type dbindex = 0)
+        : client_(host, port, dbindex) {
+        }
+
+        template<typename CON_ITERATOR>
+        coro_client(CON_ITERATOR begin, CON_ITERATOR end) : client_(begin, end) {
+        }
+
+        ~coro_client() {
+            for (size_t i = 0; i < tasks_.size(); ++i)
+                tasks_[i].destroy();
+        }
+
+        coro_client(const coro_client &) = delete;
+        coro_client & operator=(const coro_client &) = delete;
+
+        // Sends a command built by the caller, routed by hash_key.
+        template<typename T>
+        coro_command<T> send(const string_type & hash_key, cmd_encoder & request);
+
+        coro_command<string_type> get(const string_type & key) {
+            return send<string_type>(key, encoder_.begin(commands::GET) << key);
+        }
+
+        // Status reply ("OK").
+        coro_command<string_type> set(const string_type & key, const string_type & value) {
+            cmd_encoder & request = encoder_.begin(commands::SET) << key << value;
+            request.append_id(client_.clientId).append_id(++client_.lastRequestId);
+            return send<string_type>(key, request);
+        }
+
+        coro_command<int_type> incr(const string_type & key) {
+            cmd_encoder & request = encoder_.begin(commands::INCR) << key;
+            request.append_id(client_.clientId).append_id(++client_.lastRequestId);
+            return send<int_type>(key, request);
+        }
+
+        coro_command<int_type> incrby(const string_type & key, int_type by) {
+            return send<int_type>(key, encoder_.begin(commands::INCRBY) << key << by);
+        }
+
+        coro_command<bool> del(const string_type & key) {
+            return send<bool>(key, encoder_.begin(commands::DEL) << key);
+        }
+
+        coro_command<bool> exists(const string_type & key) {
+            return send<bool>(key, encoder_.begin(commands::EXISTS) << key);
+        }
+
+        coro_command<bool> hset(const string_type & key, const string_type & field, const string_type & value) {
+            return send<bool>(key, encoder_.begin(commands::HSET) << key << field << value);
+        }
+
+        coro_command<string_type> hget(const string_type & key, const string_type & field) {
+            return send<string_type>(key, encoder_.begin(commands::HGET) << key << field);
+        }
+
+        coro_command<string_vector> lrange(const string_type & key, int_type start, int_type end) {
+            return send<string_vector>(key, encoder_.begin(commands::LRANGE) << key << start << end);
+        }
+
+        coro_command<bool> zadd(const string_type & key, double score, const string_type & member) {
+            return send<bool>(key, encoder_.begin(commands::ZADD) << key << score << member);
+        }
+
+        coro_command<double> zscore(const string_type & key, const string_type & member) {
+            return send<double>(key, encoder_.begin(commands::ZSCORE) << key << member);
+        }
+
+        // Takes over t and starts it from the next run() or step().
+        void spawn(task<void> t) {
+            task<void>::handle_type h = std::exchange(t.handle_, task<void>::handle_type());
+            tasks_.push_back(h);
+            ready_.push_back(h);
+        }
+
+        // Tasks spawned and not finished yet.
+        size_t tasks() const {
+            return tasks_.size();
+        }
+
+        /**
+         * Resumes the tasks whose commands completed, then waits up to
+         * timeout_ms for more replies if nothing is ready. The first
+         * exception that escapes a spawned task is rethrown here.
+         */
+        void step(int timeout_ms = -1) {
+            // Tasks that are ready only get their new commands written.
+            if (client_.pending() > 0)
+                client_.poll(ready_.empty() ? timeout_ms : 0);
+            while (!ready_.empty()) {
+                std::coroutine_handle<> h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+            reap();
+        }
+
+        // Steps until every spawned task finished.
+        void run() {
+            while (!tasks_.empty()) {
+                if (ready_.empty() && client_.pending() == 0)
+                    throw std::logic_error("tasks wait for something other than a command");
+                step(-1);
+            }
+        }
+
+        async_client & async() {
+            return client_;
+        }
+
+    private:
+
+        // Destroys finished tasks and rethrows what escaped from them.
+        void reap() {
+            std::exception_ptr error;
+            size_t kept = 0;
+            for (size_t i = 0; i < tasks_.size(); ++i) {
+                if (!tasks_[i].done()) {
+                    tasks_[kept++] = tasks_[i];
+                    continue;
+                }
+                if (!error)
+                    error = tasks_[i].promise().error;
+                tasks_[i].destroy();
+            }
+            tasks_.resize(kept);
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        async_client client_;
+        cmd_encoder encoder_;
+        std::vector<task<void>::handle_type> tasks_;
+        std::deque<std::coroutine_handle<> > ready_;
+    };
+
+    template<typename T>
+    coro_command<T> coro_client::send(const string_type & hash_key, cmd_encoder & request) {
+        boost::shared_ptr<typename coro_command<T>::state> state(new typename coro_command<T>::state());
+        std::deque<std::coroutine_handle<> > & ready = ready_;
+        client_.send(hash_key, request, [state, &ready](reply & r) {
+            state->r = std::move(r);
+            state->done = true;
+            if (state->waiting)
+                ready.push_back(state->waiting);
+        });
+        return coro_command<T>(state);
+    }
+}
+
+#endif // REDIS_HAS_COROUTINES
+
+#endif // REDISCOROCLIENT_H
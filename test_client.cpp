@@ -122,6 +122,134 @@ int main()
       ASSERT_EQUAL(c.get(foo), bar);
     }
 
+    test("set, set_from_fd, incr, lpush (durability)");
+    {
+      FILE * file = tmpfile();
+      fputs("fd", file);
+      fflush(file);
+      int fd = fileno(file);
+
+      c.set("durable", "1", redis::durability_none);
+      c.set_from_fd("durablefd", fd, 0, 2, redis::durability_none);
+      ASSERT_EQUAL(c.incr("durablecount", redis::durability_none), 0L);
+      ASSERT_EQUAL(c.get("durable"), string("1"));
+      ASSERT_EQUAL(c.get("durablefd"), string("fd"));
+      ASSERT_EQUAL(c.incr("durablecount"), 2L);
+
+      c.set_sync_backups(0, 100); // No backups in the test setup.
+      c.set_durability(redis::durability_sync);
+      c.set("durable", "2");
+      c.set_from_fd("durablefd", fd, 1, 1);
+      ASSERT_EQUAL(c.lpush("durablelist", "a"), 1L);
+      c.set_durability(redis::durability_witness);
+      c.set_sync_backups(1, 1000); // The client's default.
+      ASSERT_EQUAL(c.get("durable"), string("2"));
+      ASSERT_EQUAL(c.get("durablefd"), string("d"));
+
+      fclose(file);
+      c.del("durable");
+      c.del("durablefd");
+      c.del("durablecount");
+      c.del("durablelist");
+    }
+
+    test("get, mget (views)");
+    {
+      redis::client::string_ref val;
+      c.get(foo, val);
+      ASSERT_EQUAL(val, redis::client::string_ref(bar));
+      c.get("nonexistent", val);
+      ASSERT_EQUAL(val, redis::client::string_ref(redis::client::missing_value()));
+
+      redis::client::string_vector keys;
+      keys.push_back(foo);
+      keys.push_back("nonexistent");
+      redis::client::string_ref_vector vals;
+      c.mget(keys, vals);
+      ASSERT_EQUAL(vals.size(), size_t(2));
+      ASSERT_EQUAL(vals[0], redis::client::string_ref(bar));
+      ASSERT_EQUAL(vals[1], redis::client::string_ref(redis::client::missing_value()));
+    }
+
+    test("get, getset, substr, mget (reused strings)");
+    {
+      string val(100, 'x');
+      c.get(foo, val);
+      ASSERT_EQUAL(val, bar);
+      c.get("nonexistent", val);
+      ASSERT_EQUAL(val, redis::client::missing_value());
+      c.substr(foo, 1, -1, val);
+      ASSERT_EQUAL(val, bar.substr(1));
+      c.getset(foo, baz, val);
+      ASSERT_EQUAL(val, bar);
+      c.getset(foo, bar, val);
+      ASSERT_EQUAL(val, baz);
+
+      redis::client::string_vector keys, vals(5, "stale");
+      keys.push_back(foo);
+      keys.push_back("nonexistent");
+      c.mget(keys, vals);
+      ASSERT_EQUAL(vals.size(), (size_t) 2);
+      ASSERT_EQUAL(vals[0], bar);
+      ASSERT_EQUAL(vals[1], redis::client::missing_value());
+    }
+
+    test("set, append (large values)");
+    {
+      // Sent by reference with writev().
+      string large(256 * 1024, 'v');
+      c.set("large", large);
+      ASSERT_EQUAL(c.get("large"), large);
+      ASSERT_EQUAL(c.append("large", large), large.size() * 2);
+      ASSERT_EQUAL(c.get("large"), large + large);
+      c.del("large");
+    }
+
+    test("set_from_fd, append_from_fd");
+    {
+      string content(64 * 1024, 'c');
+      content[0] = 'x';
+      FILE * file = tmpfile();
+      fwrite(content.data(), 1, content.size(), file);
+      fflush(file);
+      int fd = fileno(file);
+
+      c.set_from_fd("fromfd", fd, 0, content.size());
+      ASSERT_EQUAL(c.get("fromfd"), content);
+      c.set_from_fd("fromfd", fd, 1, 10);
+      ASSERT_EQUAL(c.get("fromfd"), content.substr(1, 10));
+      ASSERT_EQUAL(c.append_from_fd("fromfd", fd, 0, 2), (size_t) 12);
+      ASSERT_EQUAL(c.get("fromfd"), content.substr(1, 10) + content.substr(0, 2));
+
+      fclose(file);
+      c.del("fromfd");
+    }
+
+    test("get_to");
+    {
+      // Larger than the receive buffer, so the value arrives in pieces.
+      string big(100 * 1024, 'x');
+      for (size_t i = 0; i < big.size(); i += 1000)
+        big[i] = 'a' + (i / 1000) % 26;
+      c.append("big", big);
+
+      string streamed;
+      redis::client::chunk_sink sink = [&](const char * data, size_t len) {
+        streamed.append(data, len);
+      };
+      ASSERT_EQUAL(c.get_to("big", sink), true);
+      ASSERT_EQUAL(streamed, big);
+      ASSERT_EQUAL(c.get_to("nonexistent", sink), false);
+      ASSERT_EQUAL(streamed, big);
+
+      std::vector<char> buf(10);
+      ASSERT_EQUAL(c.get_to("big", &buf[0], buf.size()), redis::client::int_type(big.size()));
+      ASSERT_EQUAL(string(&buf[0], buf.size()), big.substr(0, 10));
+      ASSERT_EQUAL(c.get_to("nonexistent", &buf[0], buf.size()), redis::client::int_type(-1));
+      ASSERT_EQUAL(c.get(foo), bar);
+      c.del("big");
+    }
+
     test("getset");
     {
       ASSERT_EQUAL(c.getset(foo, baz), bar);
@@ -143,6 +271,154 @@ int main()
       ASSERT_EQUAL(vals[1], y_val);
     }
 
+    test("mset, mget, del (large batch)");
+    {
+      redis::client::string_vector keys, values;
+      for (int i = 0; i < 5000; i++)
+      {
+        keys.push_back("batch" + boost::lexical_cast<string>(i));
+        values.push_back(boost::lexical_cast<string>(i));
+      }
+      c.mset(keys, values);
+      redis::client::string_vector vals;
+      c.mget(keys, vals);
+      ASSERT_EQUAL(vals.size(), keys.size());
+      ASSERT_EQUAL(vals[0], values[0]);
+      ASSERT_EQUAL(vals[4999], values[4999]);
+      ASSERT_EQUAL(c.del(keys.begin(), keys.end()), true);
+      ASSERT_EQUAL(c.exists(keys[0]), false);
+    }
+
+    test("bulk_load");
+    {
+      redis::client::string_pair_vector items;
+      for (int i = 0; i < 1000; i++)
+        items.push_back(make_pair("bulk" + boost::lexical_cast<string>(i), string("v")));
+      redis::client::bulk_load_stats stats = c.bulk_load(items.begin(), items.end(), 16);
+      ASSERT_EQUAL(stats.acked, items.size());
+      ASSERT_EQUAL(stats.failed, size_t(0));
+      ASSERT_EQUAL(c.get("bulk999"), string("v"));
+      redis::client::string_vector keys;
+      for (size_t i = 0; i < items.size(); i++)
+        keys.push_back(items[i].first);
+      c.del(keys.begin(), keys.end());
+    }
+
+    test("pipeline");
+    {
+      redis::pipeline p(c);
+      redis::pipeline_result<string> ok = p.set("pipe1", "one");
+      redis::pipeline_result<string> one = p.get("pipe1");
+      redis::pipeline_result<string> none = p.get("pipe2");
+      redis::pipeline_result<redis::client::int_type> n = p.incrby("pipe2", 5);
+      redis::pipeline_result<bool> added = p.hset("pipe3", "f", "v");
+      redis::pipeline_result<redis::client::string_vector> all = p.hgetall("pipe3");
+      redis::pipeline_result<string> bad = p.hget("pipe1", "f"); // Wrong type.
+      ASSERT_EQUAL(p.size(), (size_t) 7);
+      ASSERT_EQUAL(one.ready(), false);
+      p.execute();
+      ASSERT_EQUAL(p.size(), (size_t) 0);
+      ASSERT_EQUAL(ok.get(), string("OK"));
+      ASSERT_EQUAL(one.get(), string("one"));
+      ASSERT_EQUAL(none.get(), redis::client::missing_value());
+      ASSERT_EQUAL(n.get(), 5L);
+      ASSERT_EQUAL(added.get(), true);
+      ASSERT_EQUAL(all.get().size(), (size_t) 2);
+      ASSERT_EQUAL(all.get()[1], string("v"));
+      bool thrown = false;
+      try {
+        bad.get();
+      } catch (redis::protocol_error &) {
+        thrown = true;
+      }
+      ASSERT_EQUAL(thrown, true);
+      c.del("pipe1");
+      c.del("pipe2");
+      c.del("pipe3");
+    }
+
+    test("multiplexed_client");
+    {
+      const char* c_host = getenv("REDIS_HOST");
+      redis::multiplexed_client mc(c_host ? c_host : "localhost", 6379, 15);
+      boost::thread_group threads;
+      for (int t = 0; t < 8; ++t)
+        threads.create_thread([&mc] {
+          for (int i = 0; i < 100; ++i)
+            mc.incr("muxcount");
+        });
+      threads.join_all();
+      ASSERT_EQUAL(mc.get("muxcount"), string("800"));
+      uint64_t writes, commands;
+      mc.write_stats(writes, commands);
+      ASSERT_EQUAL(commands, (uint64_t) 801);
+      mc.del("muxcount");
+    }
+
+    test("client_pool");
+    {
+      redis::client_pool::options options;
+      options.max_size = 2;
+      redis::client_pool pool(boost::bind(&redis::client::clone, &c), options);
+      redis::client* leased;
+      {
+        redis::client_pool::lease l = pool.acquire();
+        leased = &*l;
+        l->set("pooled", "x");
+      }
+      redis::client_pool::lease again = pool.acquire();
+      ASSERT_EQUAL(&*again == leased, true); // Same thread, same client.
+      ASSERT_EQUAL(again->get("pooled"), string("x"));
+      ASSERT_EQUAL(pool.size(), (size_t) 1);
+      again->del("pooled");
+    }
+
+    test("client_pool (waiting for a lease)");
+    {
+      redis::client_pool::options options;
+      options.max_size = 1;
+      redis::client_pool pool(boost::bind(&redis::client::clone, &c), options);
+      redis::client_pool::lease held = pool.acquire();
+      boost::posix_time::ptime leased;
+      boost::thread waiter([&pool, &leased] {
+        redis::client_pool::lease l = pool.acquire();
+        leased = boost::posix_time::microsec_clock::universal_time();
+      });
+      boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+      boost::posix_time::ptime released = boost::posix_time::microsec_clock::universal_time();
+      held.release();
+      waiter.join();
+      // Well within check_interval, so the waiter was woken by the release.
+      ASSERT_EQUAL(leased - released < boost::posix_time::seconds(1), true);
+      ASSERT_EQUAL(pool.size(), (size_t) 1);
+    }
+
+    test("batching_client");
+    {
+      const char* c_host = getenv("REDIS_HOST");
+      redis::batching_client::options options;
+      options.max_batch = 10;
+      // Far off, so that only max_batch and flush() write the batches.
+      options.max_delay = boost::posix_time::seconds(60);
+      redis::batching_client bc(c_host ? c_host : "localhost", 6379, 15, options);
+      std::vector< std::future<long> > counts;
+      for (int i = 0; i < 25; ++i)
+        counts.push_back(bc.incr("batchcount"));
+      std::future<long> pushed = bc.lpush("batchlist", "x"); // Held until flush().
+      bc.flush();
+      ASSERT_EQUAL(counts[24].get(), 25L);
+      ASSERT_EQUAL(pushed.get(), 1L);
+      redis::batching_client::batch_stats stats = bc.stats();
+      ASSERT_EQUAL(stats.commands, (uint64_t) 26);
+      ASSERT_EQUAL(stats.flushes[redis::batching_client::flush_size], (uint64_t) 2);
+      ASSERT_EQUAL(stats.flushes[redis::batching_client::flush_explicit], (uint64_t) 1);
+      ASSERT_EQUAL(stats.flushes[redis::batching_client::flush_deadline], (uint64_t) 0);
+      ASSERT_EQUAL(stats.sizes[3], (uint64_t) 2); // Two batches of 10.
+      redis::multiplexed_client mc(c_host ? c_host : "localhost", 6379, 15);
+      mc.del("batchcount");
+      mc.del("batchlist");
+    }
+
     test("setnx");
     {
       ASSERT_EQUAL(c.setnx(foo, bar), false);
@@ -168,6 +444,12 @@ int main()
       ASSERT_EQUAL(c.incrby("goo", 2L), 5L);test("3->5");
     }
 
+    test("incrby (negative)");
+    {
+      ASSERT_EQUAL(c.incrby("goo", -7L), -2L);test("5->-2");
+      ASSERT_EQUAL(c.incrby("goo", 7L), 5L);test("-2->5");
+    }
+
     test("exists");
     {
       ASSERT_EQUAL(c.exists("goo"), true);
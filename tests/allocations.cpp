@@ -0,0 +1,136 @@
+// Counts the heap allocations of the read paths that reuse caller-owned
+// strings. A binary of its own, as it replaces the global operator new;
+// redis_benchmark keeps the default allocator.
+//
+//   make allocations && REDIS_HOST=127.0.0.1 ./allocations
+
+#include "functions.h"
+
+#include "../redisclient.h"
+
+#include <new>
+
+// Heap allocations made by the calling thread, counted by the replacement
+// operator new below so that allocations per call can be reported.
+static thread_local size_t allocations = 0;
+
+void * operator new(size_t size)
+{
+  ++allocations;
+  void * p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+// Not inlined, so that the compiler does not pair the free() below with the
+// new expressions of the callers.
+__attribute__((noinline)) void operator delete(void * p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void * p, size_t) noexcept
+{
+  free(p);
+}
+
+class allocation_count
+{
+public:
+  allocation_count(const std::string & job_name, size_t count)
+  : start_(allocations), job_name_(job_name), count_(count)
+  {
+  }
+
+  ~allocation_count()
+  {
+    size_t made = allocations - start_;
+    cerr << job_name_ << ": " << made << " allocations, "
+         << (double)made/count_ << " per item" << endl;
+  }
+
+private:
+  size_t start_;
+  std::string job_name_;
+  size_t count_;
+};
+
+// Compares GET returning a new string with GET into a reused one. Keys are
+// built up front so that only the client's allocations are counted.
+void allocations_get(redis::client & c, const redis::client::string_vector & keys)
+{
+  {
+    block_duration b("Reading keys with GET", keys.size());
+    allocation_count a("Reading keys with GET", keys.size());
+    for(size_t i=0; i < keys.size(); i++)
+      string val = c.get( keys[i] );
+  }
+
+  {
+    block_duration b("Reading keys with GET into a reused string", keys.size());
+    string val;
+    c.get( keys[0], val );
+    allocation_count a("Reading keys with GET into a reused string", keys.size());
+    for(size_t i=0; i < keys.size(); i++)
+      c.get( keys[i], val );
+  }
+}
+
+// Compares MGET into a new vector per batch with MGET into a reused one.
+void allocations_mget(redis::client & c, const redis::client::string_vector & all_keys)
+{
+  const size_t BATCH = 250;
+  redis::client::string_vector keys(all_keys.begin(),
+      all_keys.begin() + std::min(BATCH, all_keys.size()));
+  size_t batches = all_keys.size() / BATCH + 1;
+
+  {
+    block_duration b("Reading keys with MGET", batches * keys.size());
+    allocation_count a("Reading keys with MGET", batches * keys.size());
+    for(size_t i=0; i < batches; i++)
+    {
+      redis::client::string_vector out;
+      c.mget( keys, out );
+    }
+  }
+
+  {
+    block_duration b("Reading keys with MGET into a reused vector", batches * keys.size());
+    redis::client::string_vector out;
+    c.mget( keys, out );
+    allocation_count a("Reading keys with MGET into a reused vector", batches * keys.size());
+    for(size_t i=0; i < batches; i++)
+      c.mget( keys, out );
+  }
+}
+
+int main()
+{
+  const int TEST_SIZE = 10000;
+  try
+  {
+    const char* c_host = getenv("REDIS_HOST");
+    redis::client c(c_host ? c_host : "localhost");
+    c.select(14);
+    c.flushdb();
+
+    redis::client::string_vector keys;
+    for(int i=0; i < TEST_SIZE; i++)
+    {
+      keys.push_back( "key_" + boost::lexical_cast<string>(i) );
+      c.set( keys.back(), boost::lexical_cast<string>(i) );
+    }
+
+    allocations_get(c, keys);
+    allocations_mget(c, keys);
+
+    c.flushdb();
+  }
+  catch(redis::redis_error & e)
+  {
+    cerr << "got exception: " << e.what() << endl << "FAIL" << endl;
+    return 1;
+  }
+  return 0;
+}
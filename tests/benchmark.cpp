@@ -37,6 +37,19 @@ void benchmark_get(redis::client & c, int TEST_SIZE)
   }
 }
 
+void benchmark_get_to(redis::client & c, int TEST_SIZE)
+{
+  block_duration b("Reading keys with streaming GET", TEST_SIZE);
+  size_t total = 0;
+  redis::client::chunk_sink sink = [&](const char *, size_t len) { total += len; };
+  for(int i=0; i < TEST_SIZE; i++)
+  {
+    stringstream ss;
+    ss << "key_" << i;
+    c.get_to( ss.str(), sink );
+  }
+}
+
 void benchmark_set(redis::client & c, int TEST_SIZE, boost::optional<const string &> opt_val = boost::none)
 {
   block_duration b("Writing keys with SET", TEST_SIZE);
@@ -107,6 +120,7 @@ void benchmark(redis::client & c, int TEST_SIZE)
   c.flushdb();
   benchmark_mset(c, TEST_SIZE);
   benchmark_get (c, TEST_SIZE);
+  benchmark_get_to(c, TEST_SIZE);
   benchmark_mget(c, TEST_SIZE);
   benchmark_incr(c, TEST_SIZE);
 
@@ -133,6 +147,7 @@ void benchmark(redis::client & c, int TEST_SIZE)
     c.flushdb();
     benchmark_mset(c, TEST_SIZE, val);
     benchmark_get (c, TEST_SIZE);
+    benchmark_get_to(c, TEST_SIZE);
     benchmark_mget(c, TEST_SIZE);
 
     val.append(val);
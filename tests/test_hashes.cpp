@@ -20,6 +20,12 @@ void test_hashes(redis::client & c)
     ASSERT_EQUAL(c.hget("hash1", "key1"), string("hval1"));
     ASSERT_EQUAL(c.hget("hash1", "key2"), string("hval2"));
     ASSERT_EQUAL(c.hget("hash1", "key3"), string("hval3"));
+
+    string val;
+    c.hget("hash1", "key1", val);
+    ASSERT_EQUAL(val, string("hval1"));
+    c.hget("hash1", "nokey", val);
+    ASSERT_EQUAL(val, redis::client::missing_value());
   }
   
   test("hsetnx");
@@ -146,4 +152,18 @@ void test_hashes(redis::client & c)
     ASSERT_EQUAL( entries[3].first, string("key4") );
     ASSERT_EQUAL( entries[3].second, string("hval4") );
   }
+
+  test("hgetall (views)");
+  {
+    redis::client::string_ref_pair_vector entries;
+    c.hgetall("hash1", entries);
+    ASSERT_EQUAL( entries.size(), (size_t) 4 );
+    std::sort(entries.begin(), entries.end());
+
+    ASSERT_EQUAL( entries[0].first, redis::client::string_ref("key1") );
+    ASSERT_EQUAL( entries[0].second, redis::client::string_ref("hval1") );
+
+    ASSERT_EQUAL( entries[3].first, redis::client::string_ref("key4") );
+    ASSERT_EQUAL( entries[3].second, redis::client::string_ref("hval4") );
+  }
 }
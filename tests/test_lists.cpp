@@ -72,6 +72,38 @@ void test_lists(redis::client & c)
     ASSERT_EQUAL(vals3[0], string("x"));
   }
   
+  test("lrange (views)");
+  {
+    redis::client::string_ref_vector vals;
+    ASSERT_EQUAL(c.lrange("list1", 0, -1, vals), (redis::client::int_type) 2);
+    ASSERT_EQUAL(vals.size(), (size_t) 2);
+    ASSERT_EQUAL(vals[0], redis::client::string_ref("y"));
+    ASSERT_EQUAL(vals[1], redis::client::string_ref("x"));
+  }
+  
+  test("lrange (lazy)");
+  {
+    redis::client::string_range range = c.lrange("list1", 0, -1);
+    ASSERT_EQUAL(range.size(), (size_t) 2);
+    redis::client::string_vector vals(range.begin(), range.end());
+    ASSERT_EQUAL(vals.size(), (size_t) 2);
+    ASSERT_EQUAL(vals[0], string("y"));
+    ASSERT_EQUAL(vals[1], string("x"));
+
+    // Elements that are not iterated are skipped before the next command.
+    redis::client::string_range partial = c.lrange("list1", 0, -1);
+    ASSERT_EQUAL(*partial.begin(), string("y"));
+    ASSERT_EQUAL(c.llen("list1"), 2L);
+
+    // A clone has buffers of its own and leaves open ranges alone.
+    redis::client::string_range open = c.lrange("list1", 0, -1);
+    boost::shared_ptr<redis::client> copy(c.clone());
+    ASSERT_EQUAL(copy->llen("list1"), 2L);
+    vals.assign(open.begin(), open.end());
+    ASSERT_EQUAL(vals.size(), (size_t) 2);
+    ASSERT_EQUAL(c.llen("list1"), 2L);
+  }
+  
   test("get_list");
   {
     ASSERT_EQUAL(c.exists("list1"), true);
@@ -183,6 +215,16 @@ void test_lists(redis::client & c)
     ASSERT_EQUAL(c.lpop("list1"), redis::client::missing_value());
   }
   
+  test("lpop (reused string)");
+  {
+    c.rpush("list1", "hello");
+    string val;
+    c.lpop("list1", val);
+    ASSERT_EQUAL(val, string("hello"));
+    c.lpop("list1", val);
+    ASSERT_EQUAL(val, redis::client::missing_value());
+  }
+  
   test("rpop");
   {
     c.rpush("list1", "hello");
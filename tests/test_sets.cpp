@@ -53,6 +53,17 @@ void test_sets(redis::client & c)
     ASSERT_NOT_EQUAL(members.find("bye"), members.end());
   }
   
+  test("smembers (lazy)");
+  {
+    redis::client::string_set members;
+    redis::client::string_range range = c.smembers("set2");
+    for (redis::client::string_range::iterator it = range.begin(); it != range.end(); ++it)
+      members.insert(*it);
+    ASSERT_EQUAL(members.size(), (size_t) 2);
+    ASSERT_NOT_EQUAL(members.find("hi"),  members.end());
+    ASSERT_NOT_EQUAL(members.find("bye"), members.end());
+  }
+  
   test("sinter");
   {
     c.sadd("set3", "bye");
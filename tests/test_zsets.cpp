@@ -170,6 +170,31 @@ void test_zsets(redis::client & c)
     ASSERT_EQUAL(c.zscore("zset1", "zval1"), 2.719);
     ASSERT_EQUAL(c.zscore("zset1", "zval2"), 1.234);
     ASSERT_EQUAL(c.zscore("zset1", "zval3"), 3.141);
+
+    bool threw = false;
+
+    try
+    {
+      c.zscore("zset1", "zval9");
+    }
+    catch (redis::key_error & e)
+    {
+      threw = true;
+    }
+
+    ASSERT_EQUAL(threw, true);
+  }
+
+  test("zadd, zscore (round-trip scores)");
+  {
+    double scores[] = { 0.1 + 0.2, 1e23, -5e-324, 1.7976931348623157e308, 123456.789 };
+    for (size_t i = 0; i < sizeof(scores) / sizeof(scores[0]); i++)
+    {
+      string member = "member" + boost::lexical_cast<string>(i);
+      c.zadd("zset_scores", scores[i], member);
+      ASSERT_EQUAL(c.zscore("zset_scores", member), scores[i]);
+    }
+    c.del("zset_scores");
   }
 
   c.zadd("zset2", 1, "zval2");